@@ -0,0 +1,73 @@
+#pragma once
+
+#include <vector>
+
+#include "core.hpp"
+#include "rng.hpp"
+#include "flat.hpp"
+
+using namespace std;
+
+struct Candidate {
+  u32 char_id;
+  u32 ign; // interned
+};
+
+// players on the map we could trade with. a dense array plus a char_id ->
+// slot map: insert, erase (swap with the last slot) and a uniform random pick
+// are all O(1), where picking the n-th element of a hash map walks n nodes.
+struct CandidateSet {
+  vector<Candidate> items;
+  FlatMap<u32, u32> slot_of;
+
+  s32 size() { return items.size(); }
+  bool empty() { return items.empty(); }
+
+  Candidate *find(u32 char_id) {
+    auto slot = slot_of.find(char_id);
+    return slot == NULL ? NULL : &items[*slot];
+  }
+
+  // adds the player, or renames it if it's already here.
+  void insert(u32 char_id, u32 ign) {
+    auto c = find(char_id);
+    if (c != NULL) {
+      c->ign = ign;
+      return;
+    }
+    slot_of.insert(char_id, (u32)items.size());
+    items.push_back({ char_id, ign });
+  }
+
+  bool erase(u32 char_id) {
+    auto slot = slot_of.find(char_id);
+    if (slot == NULL)
+      return false;
+
+    erase_slot(*slot, char_id);
+    return true;
+  }
+
+  // removes and returns a uniformly random player. the set must not be empty.
+  Candidate take_random(Rng &rng) {
+    u32 slot = rng.below((u32)items.size());
+    Candidate c = items[slot];
+    erase_slot(slot, c.char_id);
+    return c;
+  }
+
+  void clear() {
+    items.clear();
+    slot_of.clear();
+  }
+
+  // fills the hole with the last slot.
+  void erase_slot(u32 slot, u32 char_id) {
+    slot_of.erase(char_id);
+    if (slot != items.size() - 1) {
+      items[slot] = items.back();
+      slot_of.insert(items[slot].char_id, slot);
+    }
+    items.pop_back();
+  }
+};
@@ -4,18 +4,56 @@
 #include <windows.h>
 #include <ws2tcpip.h>
 #include <string>
+#include <vector>
+#include <algorithm>
 
 #include "core.hpp"
 #include "packet.hpp"
 #include "crypto.hpp"
+#include "task.hpp"
+#include "scheduler.hpp"
+#include "wire.hpp"
+#include "pipeline.hpp"
+#include "flight.hpp"
+#include "session.hpp"
 
 using namespace std;
 #pragma comment(lib, "ws2_32.lib")
 
+#define CONNECT_TIMEOUT_MS 5000
+#define HANDSHAKE_TIMEOUT_MS 5000
+#define IN_READ_LIMIT (64 * 1024)
+#define TAPE_SOCKET ((SOCKET)~(uptr)1) // stands in for the socket while replaying
+
 struct GameClient {
-  SOCKET conn;
+  SOCKET conn = INVALID_SOCKET;
   bool connected;
   Packet packet;
+  u64 packet_framed_us; // when `packet` came off the wire
+  bool traced; // this read_packet call is sampled; trace_on doesn't survive a co_await
+  FlightRecorder *flight = NULL; // the last packets both ways, kept and dumped by the owner; NULL keeps none
+  SessionTape *tape = NULL; // records this client's sessions, or replays one (inline mode only)
+
+  // lifetime totals across reconnects, for the stats segment.
+  u64 packets_in = 0, bytes_in = 0;
+  u64 packets_out = 0, bytes_out = 0;
+  InBuf inbuf;       // received, not yet framed
+  InQueue inq;       // framed and decrypted, not yet handled
+  InPacket framed;   // staging for inq
+
+  // outbound queue. send_packet encrypts into it; flush() writes it with one
+  // WSASend. a flush runs at the end of every scheduler turn that queued
+  // something, and before the task waits for input.
+  OutQueue out;
+  bool flush_scheduled = false;
+
+  // set while the connection is handed to the io thread (pipelined mode).
+  Pipe *pipe = NULL;
+  vector<vector<u8>> tx_overflow; // sent while the tx ring was full, oldest first
+
+  // liveness, for the watchdog.
+  u64 last_bytes_ms; // last time anything arrived (inline mode)
+  u64 last_ping_ms;  // last OP_RECV_PING, noted by the handler
 
   u16 major_version;
   string minor_version;
@@ -23,43 +61,61 @@ struct GameClient {
   u8 iv_recv[4];
   u8 game_locale;
 
-  bool init(string ip, u16 port) {
-    connected = false;
+  // how long the last init() spent in each step, for the login breakdown.
+  u64 connect_ms;
+  u64 handshake_ms;
 
-    conn = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (conn == INVALID_SOCKET) {
-      debug_error("failed to open socket: %ld\n", WSAGetLastError());
-      return false;
+  Task<bool> init(string ip, u16 port) {
+    auto start = current_time_in_ms();
+    connected = false;
+    connect_ms = 0;
+    handshake_ms = 0;
+    inbuf.clear();
+    inq.clear();
+    last_bytes_ms = last_ping_ms = start;
+    out.clear();
+
+    if (tape != NULL && tape->replaying) {
+      if (!tape->next_connection())
+        co_return false;
+      conn = TAPE_SOCKET;
+    } else if (!co_await open_connection(ip, port, start)) {
+      co_return false;
     }
 
-    sockaddr_in addr;
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = inet_addr(ip.c_str());
-    addr.sin_port = htons(port);
-
-    auto err = ::connect(conn, (SOCKADDR*)&addr, sizeof(addr));
-    if (err == SOCKET_ERROR) {
-      debug_error("connect failed: %ld\n", WSAGetLastError()); 
-      return false;
+    auto connected_at = current_time_in_ms();
+    connect_ms = connected_at - start;
+    if (tape != NULL && tape->recording()) {
+      auto where = ip + ":" + to_string(port);
+      tape->add(TAPE_CONNECT, where.data(), where.size());
     }
 
     // read handshake
 
-    u16 len = 0, slen = 0;
-    u8 *tmp = NULL;
-
-    force_read(&len, sizeof(len));
-    force_read(&major_version, sizeof(major_version));
-    force_read(&slen, sizeof(slen));
+    auto deadline = connected_at + HANDSHAKE_TIMEOUT_MS;
+    u16 len = 0;
+    Packet hs;
 
-    tmp = new u8[slen];
-    defer { delete[] tmp; };
+    bool ok = co_await force_read(&len, sizeof(len), deadline);
+    if (ok) {
+      hs.bytes.resize(len);
+      ok = co_await force_read(hs.bytes.data(), len, deadline);
+    }
+    if (!ok) {
+      if (conn != INVALID_SOCKET) {
+        debug_error("handshake timed out after %dms", HANDSHAKE_TIMEOUT_MS);
+        disconnect();
+      }
+      co_return false;
+    }
 
-    force_read(tmp, slen);
-    minor_version = string(tmp, tmp + slen);
-    force_read(iv_send, 4);
-    force_read(iv_recv, 4);
-    force_read(&game_locale, sizeof(game_locale));
+    major_version = hs.read2();
+    minor_version = hs.readstr();
+    for (u32 i = 0; i < 4; i++)
+      iv_send[i] = hs.read1();
+    for (u32 i = 0; i < 4; i++)
+      iv_recv[i] = hs.read1();
+    game_locale = hs.read1();
 
     debug_print("major_version = %d", major_version);
     debug_print("minor_version = %s", minor_version.c_str());
@@ -67,78 +123,376 @@ struct GameClient {
     debug_print("iv_recv = %02x %02x %02x %02x", iv_recv[0], iv_recv[1], iv_recv[2], iv_recv[3]);
     debug_print("game_locale = %d", game_locale);
 
+    if (tape != NULL && tape->recording()) {
+      u8 keys[10];
+      memcpy(keys, &major_version, 2);
+      memcpy(keys + 2, iv_send, 4);
+      memcpy(keys + 6, iv_recv, 4);
+      tape->add(TAPE_KEYS, keys, sizeof(keys));
+    }
+
+    handshake_ms = current_time_in_ms() - connected_at;
     connected = true;
-    return true;
+    co_return true;
   }
 
-  void disconnect() { 
-    closesocket(conn);
-    connected = false;
-  }
+  // a non-blocking tcp connection to ip:port, in conn. false (with conn
+  // closed) if it failed or took CONNECT_TIMEOUT_MS.
+  Task<bool> open_connection(string ip, u16 port, u64 start) {
+    conn = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (conn == INVALID_SOCKET) {
+      debug_error("failed to open socket: %ld\n", WSAGetLastError());
+      co_return false;
+    }
+
+    u_long nonblocking = 1;
+    ioctlsocket(conn, FIONBIO, &nonblocking);
 
-  bool force_send(void *buf, s32 len) {
-    int offset = 0;
-    do {
-      int n = send(conn, (char*)buf + offset, (int)len, 0);
-      if (n == 0 || n == SOCKET_ERROR) {
-        debug_error("server disconnected while we tried to send something.");
+    // we batch frames ourselves, Nagle would only hold the batch back.
+    BOOL nodelay = TRUE;
+    setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, (char*)&nodelay, sizeof(nodelay));
+
+    sockaddr_in addr;
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(ip.c_str());
+    addr.sin_port = htons(port);
+
+    // the socket is non-blocking, so connect completes when it turns writable.
+    auto err = ::connect(conn, (SOCKADDR*)&addr, sizeof(addr));
+    if (err == SOCKET_ERROR)
+      err = WSAGetLastError();
+    if (err == WSAEWOULDBLOCK) {
+      if (co_await wait_io(conn, POLLWRNORM, start + CONNECT_TIMEOUT_MS) == 0) {
+        debug_error("connect timed out after %dms", CONNECT_TIMEOUT_MS);
         disconnect();
-        return false;
+        co_return false;
       }
-      len -= n;
-      offset += n;
-    } while (len > 0);
-    return true;
+
+      int optlen = sizeof(err);
+      getsockopt(conn, SOL_SOCKET, SO_ERROR, (char*)&err, &optlen);
+    }
+    if (err != 0) {
+      debug_error("connect failed: %ld\n", err); 
+      disconnect();
+      co_return false;
+    }
+
+    co_return true;
   }
 
-  bool force_read(void *buf, s32 len) {
-    int n = recv(conn, (char*)buf, (int)len, MSG_WAITALL);
-    return (n != 0 && n != SOCKET_ERROR);
+  void disconnect() { 
+    if (pipe != NULL) {
+      // the io thread owns the socket now; it closes it and frees the pipe.
+      pipe->detach();
+      pipe = NULL;
+      tx_overflow.clear();
+    } else if (conn != INVALID_SOCKET) {
+      if (tape != NULL && tape->recording())
+        tape->add(TAPE_CLOSE, NULL, 0);
+      if (conn != TAPE_SOCKET)
+        closesocket(conn);
+      out.print_stats();
+    }
+    conn = INVALID_SOCKET;
+    connected = false;
+    out.clear();
   }
 
-  Packet *read_packet() {
-    u8 lenbuf[4];
-    if (recv(conn, (char*)lenbuf, 4, MSG_PEEK) < 4)
-      return NULL;
+  // hands the established connection to the io thread: from here on it reads,
+  // frames and decrypts into pipe->rx, and encrypts and sends from pipe->tx.
+  void start_pipeline(IoThread *io) {
+    pipe = new Pipe();
+    pipe->conn = conn;
+    pipe->major_version = major_version;
+    copy(iv_send, iv_send + 4, pipe->iv_send);
+    copy(iv_recv, iv_recv + 4, pipe->iv_recv);
+    pipe->inbuf = move(inbuf);
+    pipe->last_bytes_ms = last_bytes_ms;
+    pipe->out = move(out); // anything still queued was encrypted with our iv_send
+    pipe->rx_ready.waker = &this_scheduler->waker;
+    pipe->tx_room.waker = &this_scheduler->waker;
+    io->attach(pipe);
+    inbuf.clear();
+    out = OutQueue();
+  }
 
-    recv(conn, (char*)lenbuf, 4, 0);
+  u64 last_bytes() {
+    if (pipe != NULL)
+      return pipe->last_bytes_ms.load(memory_order_relaxed);
+    return last_bytes_ms;
+  }
 
-    auto len = crypto::get_packet_length(lenbuf);
-    if (len < 2) {
+  // pushes queued packets out without blocking. false if the connection dropped.
+  bool flush() {
+    if (pipe != NULL) {
+      // what didn't fit last time goes first, as far as there's room now.
+      s32 moved = 0;
+      while (moved < tx_overflow.size() && pipe->tx.push(tx_overflow[moved]))
+        moved++;
+      tx_overflow.erase(tx_overflow.begin(), tx_overflow.begin() + moved);
+      if (pipe->tx.publish())
+        pipe->io->waker.wake();
+      return true;
+    }
+    if (conn == INVALID_SOCKET) {
+      out.clear();
+      return false;
+    }
+    if (conn == TAPE_SOCKET) {
+      for (auto &frame : out.frames)
+        tape->check_send(frame.data(), frame.size());
+      out.clear();
+      return true;
+    }
+    if (!out.flush(conn)) {
+      debug_error("server disconnected while we tried to send something.");
       disconnect();
-      return NULL;
+      return false;
     }
+    return true;
+  }
 
-    auto buf = new u8[len];
-    defer { delete[] buf; };
+  // backpressure: once this many bytes are queued the task should stop
+  // producing and co_await drain() until the socket catches up.
+  bool congested() {
+    if (pipe != NULL)
+      return !tx_overflow.empty() || pipe->tx.full();
+    return out.queued > OUT_HIGH_WATER;
+  }
 
-    if (!force_read(buf, len)) {
+  Task<bool> drain() {
+    if (pipe != NULL) {
+      // parked until the io thread takes from the ring (or the connection dies).
+      while (connected && !pipe->dead) {
+        flush();
+        if (!congested())
+          break;
+        co_await wait_event(&pipe->tx_room);
+      }
+      co_return connected;
+    }
+    while (flush() && out.queued > OUT_LOW_WATER) {
+      if (co_await wait_io(conn, POLLWRNORM) == 0)
+        co_return false;
+    }
+    co_return connected;
+  }
+
+  // one non-blocking recv into inbuf. bytes read, 0 if nothing was waiting,
+  // -1 if the connection dropped.
+  int recv_some() {
+    if (conn == INVALID_SOCKET)
+      return -1;
+    if (conn == TAPE_SOCKET)
+      return replay_recv();
+
+    auto into = inbuf.grow(4096);
+    auto start = read_clock_ns();
+    int got = recv(conn, (char*)into, 4096, 0);
+    trace_span("recv", start, read_clock_ns(), max(got, 0));
+    inbuf.trim(4096 - max(got, 0));
+    if (got > 0) {
+      last_bytes_ms = current_time_in_ms();
+      if (tape != NULL && tape->recording())
+        tape->add(TAPE_RECV, into, got);
+      return got;
+    }
+
+    if (got == 0 || WSAGetLastError() != WSAEWOULDBLOCK) {
       debug_error("connection closed while trying to read");
       disconnect();
-      return NULL;
+      return -1;
+    }
+    return 0;
+  }
+
+  // recv_some while replaying: the next recorded chunk, once it's due.
+  int replay_recv() {
+    auto e = tape->peek_recv();
+    if (e == NULL) {
+      disconnect();
+      return -1;
+    }
+    if (read_clock_us() < tape->due_us(*e))
+      return 0;
+    copy(e->bytes.begin(), e->bytes.end(), inbuf.grow(e->bytes.size()));
+    tape->recv_at++;
+    last_bytes_ms = current_time_in_ms();
+    return e->bytes.size();
+  }
+
+  // end of this task's turn: pushes out what it queued, then sleeps until the
+  // socket has something for us. false on disconnect or deadline.
+  Task<bool> wait_readable(u64 deadline) {
+    if (current_time_in_ms() >= deadline)
+      co_return false;
+    if (!flush())
+      co_return false;
+
+    // replaying, "readable" is the next chunk coming due.
+    if (conn == TAPE_SOCKET) {
+      auto e = tape->peek_recv();
+      if (e == NULL)
+        co_return true; // recv_some reports the close
+      u64 now_us = read_clock_us();
+      u64 due_us = tape->due_us(*e);
+      u64 now = current_time_in_ms();
+      u64 wait = due_us > now_us ? (due_us - now_us + 999) / 1000 : 0;
+      if (now + wait >= deadline) {
+        co_await sleep_for((u32)(deadline > now ? deadline - now : 0));
+        co_return false;
+      }
+      if (wait > 0)
+        co_await sleep_for((u32)wait);
+      else
+        co_await yield_now();
+      co_return true;
+    }
+
+    short events = POLLRDNORM | (out.queued > 0 ? POLLWRNORM : 0);
+    auto revents = co_await wait_io(conn, events, deadline);
+    if (revents == 0)
+      co_return false;
+    if ((revents & POLLWRNORM) && !flush())
+      co_return false;
+    co_return true;
+  }
+
+  // makes sure at least n bytes are buffered in inbuf. false if the connection
+  // dropped or the deadline passed first; check `connected` to tell which.
+  Task<bool> fill(s32 n, u64 deadline = NO_DEADLINE) {
+    while (inbuf.size() < n) {
+      int got = recv_some();
+      if (got < 0)
+        co_return false;
+      if (got == 0 && !co_await wait_readable(deadline))
+        co_return false;
     }
+    co_return true;
+  }
 
-    crypto::decrypt(buf, iv_recv, len);
+  Task<bool> force_read(void *buf, s32 len, u64 deadline = NO_DEADLINE) {
+    if (!co_await fill(len, deadline))
+      co_return false;
+    copy(inbuf.data(), inbuf.data() + len, (u8*)buf);
+    inbuf.consume(len);
+    co_return true;
+  }
 
-    packet.bytes.assign(buf, buf+len);
+  // takes everything the socket has (up to IN_READ_LIMIT buffered) and frames
+  // it into inq, so a ping that arrived behind a burst is seen before the
+  // burst is handled. false if the connection dropped.
+  bool receive() {
+    int got;
+    while (inbuf.size() < IN_READ_LIMIT && (got = recv_some()) > 0);
+    if (conn == INVALID_SOCKET)
+      return false;
+
+    while (true) {
+      int len = frame_length(inbuf);
+      if (len == 0)
+        return true;
+      if (len < 0) {
+        debug_error("garbage packet header");
+        disconnect();
+        return false;
+      }
+
+      open_frame(framed, inbuf, len, iv_recv);
+      inq.push(framed);
+    }
+  }
+
+  // moves the next packet from inq into `packet`, if there is one.
+  bool take_packet() {
+    u8 iv[4];
+    if (!inq.pop(packet.bytes, &packet_framed_us, iv))
+      return false;
+    trace_on = traced;
+    auto now_ns = read_clock_ns();
+    trace_span("queue", packet_framed_us * 1000, now_ns, inq.count);
+    if (flight != NULL)
+      flight->record(DIR_RECV, packet.bytes.data(), packet.bytes.size(), iv, now_ns / 1000);
     packet.i = 0;
-    // packet.print(true);
+    packet.overrun = false;
+    packets_in++;
+    bytes_in += packet.bytes.size();
+    return true;
+  }
 
-    return &packet;
+  // waits at most timeout_ms for a whole packet. NULL on timeout or disconnect.
+  // pings first, then trade packets, then everything else.
+  Task<Packet*> read_packet(u32 timeout_ms = INFINITE) {
+    auto deadline = (timeout_ms == INFINITE) ? NO_DEADLINE : current_time_in_ms() + timeout_ms;
+    traced = trace_sample();
+
+    if (pipe != NULL)
+      co_return co_await read_piped_packet(deadline);
+
+    while (true) {
+      if (!receive())
+        co_return NULL;
+      if (take_packet())
+        co_return &packet;
+      if (!co_await wait_readable(deadline))
+        co_return NULL;
+      trace_on = traced;
+    }
   }
 
-  void send_packet(Packet *p) {
-    // p->print(false);
+  // pipelined mode: packets arrive already framed, decrypted and classified.
+  Task<Packet*> read_piped_packet(u64 deadline) {
+    while (true) {
+      while (pipe->rx.pop(framed))
+        inq.push(framed);
+      pipe->rx.release();
+
+      if (take_packet())
+        co_return &packet;
 
-    u16 len = (u16)p->bytes.size();
-    auto tmp = new u8[len + 4];
-    defer { delete[] tmp; };
+      if (pipe->dead && pipe->rx.empty()) {
+        debug_error("connection closed while trying to read");
+        disconnect();
+        co_return NULL;
+      }
+      if (current_time_in_ms() >= deadline || !flush())
+        co_return NULL;
+      // sends that didn't fit go out before we read on.
+      if (!tx_overflow.empty() && !co_await drain())
+        co_return NULL;
+      if (!co_await wait_event(&pipe->rx_ready, deadline))
+        co_return NULL;
+      trace_on = traced;
+    }
+  }
 
-    copy(p->bytes.begin(), p->bytes.begin() + len, tmp + 4);
-    crypto::create_packet_header(tmp, iv_send, len, major_version);
-    crypto::encrypt(tmp + 4, iv_send, len);
+  void send_packet(Packet *p) {
+    packets_out++;
+    bytes_out += p->bytes.size();
+    if (flight != NULL)
+      flight->record(DIR_SEND, p->bytes.data(), p->bytes.size(), pipe == NULL ? iv_send : NULL, read_clock_us());
+
+    if (pipe != NULL) {
+      // the io thread encrypts. if it's a whole ring behind, keep the packet
+      // until flush() finds room; congested() tells the task to stop sending.
+      if (!tx_overflow.empty() || !pipe->tx.push(p->bytes))
+        tx_overflow.push_back(p->bytes);
+    } else {
+      out.push(p->bytes.data(), (u16)p->bytes.size(), iv_send, major_version);
+      if (tape != NULL && tape->recording())
+        tape->add(TAPE_SEND, out.frames.back().data(), out.frames.back().size());
+    }
 
-    force_send(tmp, len + 4);
+    // packets queued from timer callbacks have no task about to wait on the
+    // socket, so the scheduler flushes at the end of the turn either way.
+    if (!flush_scheduled && this_scheduler != NULL) {
+      flush_scheduled = true;
+      this_scheduler->at_end_of_turn([](void *p) {
+        auto client = (GameClient*)p;
+        client->flush_scheduled = false;
+        client->flush();
+      }, this);
+    }
   }
 
   // ====================
@@ -1,17 +1,37 @@
 #include "core.hpp"
 #include <windows.h>
-#include <stdarg.h>
 
-static char output_debug_buf[1024];
+static thread_local u64 cached_time_in_ms;
 
-cstr output_debug_printf(ccstr fmt, ...) {
-  va_list args;
-  va_start(args, fmt);
+static u64 read_clock(u64 units_per_second) {
+  static LARGE_INTEGER freq;
+  if (freq.QuadPart == 0)
+    QueryPerformanceFrequency(&freq);
 
-  vsnprintf(output_debug_buf, _countof(output_debug_buf), fmt, args);
-  OutputDebugStringA(output_debug_buf);
-  printf("%s", output_debug_buf);
+  LARGE_INTEGER li;
+  QueryPerformanceCounter(&li);
+  return (u64)(li.QuadPart / freq.QuadPart * units_per_second + (li.QuadPart % freq.QuadPart) * units_per_second / freq.QuadPart);
+}
+
+u64 read_clock_ms() {
+  return read_clock(1000);
+}
+
+u64 refresh_clock_ms() {
+  cached_time_in_ms = read_clock(1000);
+  return cached_time_in_ms;
+}
+
+u64 read_clock_us() {
+  return read_clock(1000000);
+}
+
+u64 read_clock_ns() {
+  return read_clock(1000000000);
+}
 
-  va_end(args);
-  return output_debug_buf;
+u64 current_time_in_ms() {
+  if (cached_time_in_ms == 0)
+    return read_clock(1000);
+  return cached_time_in_ms;
 }
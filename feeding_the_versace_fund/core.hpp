@@ -20,7 +20,18 @@ typedef wchar_t      wchar;
 typedef wchar*       wstr;
 typedef const wchar* cwstr;
 
-cstr output_debug_printf(ccstr fmt, ...);
+#define CACHE_LINE 64 // for alignas, to keep data other threads write off our lines
 
-#define debug_print(fmt, ...) output_debug_printf(fmt "\n", __VA_ARGS__)
-#define debug_error(fmt, ...) output_debug_printf("[err] " fmt "\n", __VA_ARGS__)
+// monotonic milliseconds. read_clock_ms samples the performance counter.
+// a scheduler thread samples it once per turn with refresh_clock_ms, and
+// current_time_in_ms returns that sample there; on a thread that never
+// refreshes (ui, writers, the io thread) it reads the counter every time.
+// read_clock_us and read_clock_ns are uncached, for short intervals.
+u64 read_clock_ms();
+u64 refresh_clock_ms();
+u64 read_clock_us();
+u64 read_clock_ns();
+u64 current_time_in_ms();
+
+// debug_print, debug_error and friends
+#include "debuglog.hpp"
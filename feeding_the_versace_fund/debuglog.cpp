@@ -0,0 +1,253 @@
+#include "debuglog.hpp"
+#include <windows.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+// single-producer ring of records, one per logging thread. the owning thread
+// writes at tail, the writer thread reads at head; both only ever grow.
+struct ThreadLog {
+  alignas(64) atomic<u64> head{0};
+  alignas(64) atomic<u64> tail{0};
+  atomic<u64> dropped{0};
+  u64 dropped_reported = 0; // writer only
+  u8 bytes[DLOG_RING_BYTES];
+
+  void copy_in(u64 at, const u8 *src, u32 len) {
+    u32 off = at & (DLOG_RING_BYTES - 1);
+    u32 first = min<u32>(len, DLOG_RING_BYTES - off);
+    memcpy(bytes + off, src, first);
+    memcpy(bytes, src + first, len - first);
+  }
+
+  void copy_out(u64 at, u8 *dst, u32 len) {
+    u32 off = at & (DLOG_RING_BYTES - 1);
+    u32 first = min<u32>(len, DLOG_RING_BYTES - off);
+    memcpy(dst, bytes + off, first);
+    memcpy(dst + first, bytes, len - first);
+  }
+};
+
+// rings are never freed: the threads that log live as long as the process.
+static SRWLOCK registry_lock = SRWLOCK_INIT;
+static vector<ThreadLog*> registry;
+static atomic<bool> writer_running{false};
+static atomic<u32> min_level{LOG_TRACE};
+static SRWLOCK drain_lock = SRWLOCK_INIT; // one drain at a time
+
+static ThreadLog *this_thread_log() {
+  static thread_local ThreadLog *mine;
+  if (mine == NULL) {
+    mine = new ThreadLog;
+    AcquireSRWLockExclusive(&registry_lock);
+    registry.push_back(mine);
+    ReleaseSRWLockExclusive(&registry_lock);
+  }
+  return mine;
+}
+
+// ==========
+// formatting
+// ==========
+
+struct LogArg {
+  LogArgTag tag;
+  u64 word;
+  string str;
+};
+
+// walks the format string and prints each conversion on its own, with the
+// length modifier swapped for the width the argument was stored at.
+static void format_record(const u8 *rec, string &out) {
+  LogRecordHeader header;
+  memcpy(&header, rec, sizeof(header));
+
+  vector<LogArg> args(header.n_args);
+  u32 at = sizeof(header);
+  for (auto &arg : args) {
+    arg.tag = (LogArgTag)rec[at++];
+    if (arg.tag == ARG_STR) {
+      u16 len;
+      memcpy(&len, rec + at, 2);
+      arg.str.assign((const char*)rec + at + 2, len);
+      at += 2 + len;
+    } else {
+      memcpy(&arg.word, rec + at, 8);
+      at += 8;
+    }
+  }
+
+  if (header.site->level >= LOG_ERROR)
+    out += "[err] ";
+
+  auto fmt = header.site->fmt;
+  u32 next = 0;
+  char piece[512];
+  for (auto p = fmt; *p != '\0'; p++) {
+    if (*p != '%') {
+      out += *p;
+      continue;
+    }
+    if (p[1] == '%') {
+      out += '%';
+      p++;
+      continue;
+    }
+
+    string spec = "%";
+    auto q = p + 1;
+    while (*q != '\0' && strchr("-+ #0123456789.", *q))
+      spec += *q++;
+    while (*q != '\0' && strchr("hlLqjzt", *q))
+      q++;
+    char conv = *q;
+    if (conv == '\0')
+      break;
+    p = q;
+
+    if (next >= args.size()) {
+      out += "?";
+      continue;
+    }
+    auto &arg = args[next++];
+    double as_double;
+    if (arg.tag == ARG_DOUBLE)
+      memcpy(&as_double, &arg.word, 8);
+    else
+      as_double = arg.tag == ARG_INT ? (double)(i64)arg.word : (double)arg.word;
+    u64 as_int = arg.tag == ARG_DOUBLE ? (u64)(i64)as_double : arg.word;
+
+    if (arg.tag == ARG_STR || conv == 's') {
+      if (arg.tag == ARG_STR)
+        snprintf(piece, sizeof(piece), (spec + "s").c_str(), arg.str.c_str());
+      else
+        snprintf(piece, sizeof(piece), "%llu", (unsigned long long)as_int);
+    } else if (strchr("di", conv)) {
+      snprintf(piece, sizeof(piece), (spec + "lld").c_str(), (long long)as_int);
+    } else if (strchr("uxXo", conv)) {
+      snprintf(piece, sizeof(piece), (spec + "ll" + conv).c_str(), (unsigned long long)as_int);
+    } else if (conv == 'c') {
+      snprintf(piece, sizeof(piece), (spec + "c").c_str(), (int)as_int);
+    } else if (strchr("fFeEgGaA", conv)) {
+      snprintf(piece, sizeof(piece), (spec + conv).c_str(), as_double);
+    } else if (conv == 'p') {
+      snprintf(piece, sizeof(piece), (spec + "p").c_str(), (void*)(uptr)as_int);
+    } else {
+      snprintf(piece, sizeof(piece), "%%%c", conv);
+    }
+    out += piece;
+  }
+
+  // the old printf-style sites sometimes carried their own newline
+  while (!out.empty() && out.back() == '\n')
+    out.pop_back();
+  out += '\n';
+}
+
+static void emit(const string &text) {
+  if (text.empty())
+    return;
+  OutputDebugStringA(text.c_str());
+  fwrite(text.data(), 1, text.size(), stdout);
+  fflush(stdout);
+}
+
+// ======
+// writer
+// ======
+
+void dlog_commit(const LogSite *site, LogRecord &r) {
+  if (site->level < min_level.load(memory_order_relaxed))
+    return;
+  LogRecordHeader header = { r.size, r.n_args, site, read_clock_us() };
+  memcpy(r.bytes, &header, sizeof(header));
+
+  if (!writer_running.load(memory_order_relaxed)) {
+    string line;
+    format_record(r.bytes, line);
+    emit(line);
+    return;
+  }
+
+  auto log = this_thread_log();
+  u64 tail = log->tail.load(memory_order_relaxed);
+  if (tail + r.size - log->head.load(memory_order_acquire) > DLOG_RING_BYTES) {
+    log->dropped.fetch_add(1, memory_order_relaxed);
+    return;
+  }
+  log->copy_in(tail, r.bytes, r.size);
+  log->tail.store(tail + r.size, memory_order_release);
+}
+
+// takes every record out of every ring and prints them in timestamp order.
+static void drain() {
+  AcquireSRWLockExclusive(&drain_lock);
+  defer { ReleaseSRWLockExclusive(&drain_lock); };
+
+  static vector<ThreadLog*> logs;
+  static vector<u8> batch;
+  static vector<pair<u64, u32>> order; // time, offset into batch
+  static string text;
+
+  AcquireSRWLockShared(&registry_lock);
+  logs = registry;
+  ReleaseSRWLockShared(&registry_lock);
+
+  batch.clear();
+  order.clear();
+  text.clear();
+
+  for (auto log : logs) {
+    u64 head = log->head.load(memory_order_relaxed);
+    u64 tail = log->tail.load(memory_order_acquire);
+    while (head < tail) {
+      LogRecordHeader header;
+      log->copy_out(head, (u8*)&header, sizeof(header));
+      u32 at = batch.size();
+      batch.resize(at + header.size);
+      log->copy_out(head, batch.data() + at, header.size);
+      order.push_back({ header.time_us, at });
+      head += header.size;
+    }
+    log->head.store(head, memory_order_release);
+
+    u64 dropped = log->dropped.load(memory_order_relaxed);
+    if (dropped != log->dropped_reported) {
+      char note[64];
+      snprintf(note, sizeof(note), "[err] log ring full, dropped %llu lines\n", (unsigned long long)(dropped - log->dropped_reported));
+      text += note;
+      log->dropped_reported = dropped;
+    }
+  }
+
+  stable_sort(order.begin(), order.end(), [](auto &a, auto &b) { return a.first < b.first; });
+  for (auto &[time, at] : order)
+    format_record(batch.data() + at, text);
+
+  emit(text);
+}
+
+bool debug_log_start() {
+  auto proc = [](LPVOID) -> DWORD {
+    while (true) {
+      Sleep(DLOG_FLUSH_MS);
+      drain();
+    }
+    return 0;
+  };
+  writer_running.store(true, memory_order_relaxed);
+  if (CreateThread(NULL, 0, proc, NULL, 0, NULL) == NULL) {
+    writer_running.store(false, memory_order_relaxed);
+    return false;
+  }
+  return true;
+}
+
+void debug_log_flush() {
+  drain();
+}
+
+void debug_log_level(u32 level) {
+  min_level.store(level, memory_order_relaxed);
+}
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <atomic>
+#include <type_traits>
+#include <string.h>
+
+#include "core.hpp"
+
+using namespace std;
+
+// debug logging that costs the caller about a memcpy. a call site has a
+// static LogSite (level and format string); a call writes a pointer to it,
+// a timestamp and the raw argument bytes into its thread's ring, and a
+// background thread does the formatting and printing. string arguments are
+// copied at the call, so passing c_str() of a temporary is fine.
+//
+// levels below LOG_MIN_LEVEL aren't compiled in at all. a thread whose ring
+// is full drops the line and counts it instead of waiting.
+
+#define LOG_TRACE 0
+#define LOG_INFO 1
+#define LOG_ERROR 2
+
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_INFO
+#endif
+
+#define DLOG_RING_BYTES (64 * 1024) // per thread, power of two
+#define DLOG_RECORD_MAX 1024        // longer strings are cut to fit
+#define DLOG_FLUSH_MS 20
+
+struct LogSite {
+  u32 level;
+  ccstr fmt;
+};
+
+enum LogArgTag : u8 {
+  ARG_INT,
+  ARG_UINT,
+  ARG_DOUBLE,
+  ARG_PTR,
+  ARG_STR, // u16 length, then the bytes
+};
+
+struct LogRecordHeader {
+  u32 size; // header included
+  u32 n_args;
+  const LogSite *site;
+  u64 time_us;
+};
+
+// one record being built on the caller's stack.
+struct LogRecord {
+  u8 bytes[DLOG_RECORD_MAX];
+  u32 size = sizeof(LogRecordHeader);
+  u32 n_args = 0;
+
+  void put_word(LogArgTag tag, const void *word) {
+    if (size + 1 + 8 > DLOG_RECORD_MAX)
+      return;
+    bytes[size] = tag;
+    memcpy(bytes + size + 1, word, 8);
+    size += 1 + 8;
+    n_args++;
+  }
+
+  void put_str(ccstr s) {
+    if (s == NULL)
+      s = "(null)";
+    if (size + 1 + 2 > DLOG_RECORD_MAX)
+      return;
+    u16 len = (u16)min<s32>(strlen(s), DLOG_RECORD_MAX - size - 3);
+    bytes[size] = ARG_STR;
+    memcpy(bytes + size + 1, &len, 2);
+    memcpy(bytes + size + 3, s, len);
+    size += 3 + len;
+    n_args++;
+  }
+
+  template <typename T>
+  void put(T v) {
+    if constexpr (is_same_v<T, char*> || is_same_v<T, const char*>) {
+      put_str(v);
+    } else if constexpr (is_enum_v<T>) {
+      put((underlying_type_t<T>)v);
+    } else if constexpr (is_floating_point_v<T>) {
+      double d = v;
+      put_word(ARG_DOUBLE, &d);
+    } else if constexpr (is_integral_v<T> && is_signed_v<T>) {
+      i64 i = v;
+      put_word(ARG_INT, &i);
+    } else if constexpr (is_integral_v<T>) {
+      u64 u = v;
+      put_word(ARG_UINT, &u);
+    } else if constexpr (is_pointer_v<T>) {
+      u64 p = (uptr)v;
+      put_word(ARG_PTR, &p);
+    } else {
+      static_assert(!sizeof(T), "can't log this type");
+    }
+  }
+};
+
+// hands the record to the writer thread, or prints it right away if the
+// writer isn't running.
+void dlog_commit(const LogSite *site, LogRecord &r);
+
+template <typename... Args>
+void dlog_write(const LogSite *site, Args... args) {
+  LogRecord r;
+  (r.put(args), ...);
+  dlog_commit(site, r);
+}
+
+// starts the writer thread. until then (and in tools that never start it)
+// lines are formatted and printed by the caller.
+bool debug_log_start();
+
+// prints everything logged so far. for shutdown.
+void debug_log_flush();
+
+// drops lines below level from here on. for tools that run many clients.
+void debug_log_level(u32 level);
+
+#define debug_log(level, fmt, ...)                   \
+  do {                                               \
+    static const LogSite dlog_site = { level, fmt }; \
+    dlog_write(&dlog_site, __VA_ARGS__);             \
+  } while (0)
+
+#if LOG_MIN_LEVEL <= LOG_TRACE
+#define debug_trace(fmt, ...) debug_log(LOG_TRACE, fmt, __VA_ARGS__)
+#else
+#define debug_trace(fmt, ...) ((void)0)
+#endif
+
+#if LOG_MIN_LEVEL <= LOG_INFO
+#define debug_print(fmt, ...) debug_log(LOG_INFO, fmt, __VA_ARGS__)
+#else
+#define debug_print(fmt, ...) ((void)0)
+#endif
+
+#define debug_error(fmt, ...) debug_log(LOG_ERROR, fmt, __VA_ARGS__)
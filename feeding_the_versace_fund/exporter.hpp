@@ -0,0 +1,88 @@
+#pragma once
+
+#include <winsock2.h>
+#include <windows.h>
+#include <string>
+
+#include "core.hpp"
+#include "task.hpp"
+#include "scheduler.hpp"
+#include "metrics.hpp"
+
+using namespace std;
+
+// the metrics over http, for a prometheus on the same machine to scrape.
+// listens on loopback only. any request gets the whole registry back; the
+// serving task handles one scrape at a time, which is plenty for a scraper.
+
+#define METRICS_PORT 9464
+#define METRICS_SCRAPE_TIMEOUT_MS 2000
+#define METRICS_REQUEST_LIMIT 8192
+
+inline Task<> answer_scrape(SOCKET conn) {
+  auto deadline = current_time_in_ms() + METRICS_SCRAPE_TIMEOUT_MS;
+
+  // the request itself doesn't matter, but read it to the end of the headers
+  // so closing doesn't reset the connection under the scraper.
+  string request;
+  char buf[1024];
+  while (request.find("\r\n\r\n") == string::npos && request.size() < METRICS_REQUEST_LIMIT) {
+    int got = recv(conn, buf, sizeof(buf), 0);
+    if (got > 0) {
+      request.append(buf, got);
+      continue;
+    }
+    if (got == 0 || WSAGetLastError() != WSAEWOULDBLOCK)
+      co_return;
+    if (co_await wait_io(conn, POLLRDNORM, deadline) == 0)
+      co_return;
+  }
+
+  auto body = metrics.prometheus();
+  auto response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                  to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+
+  s32 sent = 0;
+  while (sent < response.size()) {
+    int n = send(conn, response.data() + sent, (int)(response.size() - sent), 0);
+    if (n > 0) {
+      sent += n;
+      continue;
+    }
+    if (WSAGetLastError() != WSAEWOULDBLOCK)
+      co_return;
+    if (co_await wait_io(conn, POLLWRNORM, deadline) == 0)
+      co_return;
+  }
+}
+
+inline Task<> serve_metrics(u16 port) {
+  auto listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (listener == INVALID_SOCKET) {
+    debug_error("metrics: failed to open socket: %d", WSAGetLastError());
+    co_return;
+  }
+  defer { closesocket(listener); };
+
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  if (bind(listener, (SOCKADDR*)&addr, sizeof(addr)) == SOCKET_ERROR || listen(listener, SOMAXCONN) == SOCKET_ERROR) {
+    debug_error("metrics: can't listen on 127.0.0.1:%u (%d), only writing the file", port, WSAGetLastError());
+    co_return;
+  }
+  u_long nonblocking = 1;
+  ioctlsocket(listener, FIONBIO, &nonblocking);
+  debug_print("metrics: serving on http://127.0.0.1:%u/metrics", port);
+
+  while (true) {
+    if (co_await wait_io(listener, POLLRDNORM) == 0)
+      continue;
+    auto conn = accept(listener, NULL, NULL); // inherits non-blocking
+    if (conn == INVALID_SOCKET)
+      continue;
+    co_await answer_scrape(conn);
+    closesocket(conn);
+  }
+}
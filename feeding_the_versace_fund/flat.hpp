@@ -0,0 +1,192 @@
+#pragma once
+
+#include <vector>
+#include <bit>
+#include <utility>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define FLAT_SSE2 1
+#endif
+
+#include "core.hpp"
+
+using namespace std;
+
+// open-addressing hash map in the swiss-table style: keys and values sit in
+// flat arrays, and a parallel array of control bytes holds 7 bits of each
+// key's hash. probing looks at a group of 16 control bytes at once (one SSE2
+// compare), so a lookup usually touches one cache line of control bytes and
+// one key. no per-entry allocation, no node pointers.
+//
+// control byte: FLAT_EMPTY, FLAT_DELETED, or the low 7 bits of the hash.
+
+#define FLAT_GROUP 16
+#define FLAT_EMPTY ((u8)0x80)
+#define FLAT_DELETED ((u8)0xfe)
+
+// mixes a key into a well-spread 64-bit hash (murmur3 finalizer).
+inline u64 flat_hash(u64 k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdull;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ull;
+  k ^= k >> 33;
+  return k;
+}
+
+// bit i set where group[i] == tag.
+inline u32 flat_match(const u8 *group, u8 tag) {
+#ifdef FLAT_SSE2
+  auto ctrl = _mm_loadu_si128((const __m128i*)group);
+  return (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)tag)));
+#else
+  u32 mask = 0;
+  for (u32 i = 0; i < FLAT_GROUP; i++)
+    mask |= (u32)(group[i] == tag) << i;
+  return mask;
+#endif
+}
+
+template <typename K, typename V>
+struct FlatMap {
+  vector<u8> ctrl;  // capacity control bytes
+  vector<K> keys;
+  vector<V> vals;
+  s32 count = 0;
+  s32 tombstones = 0;
+
+  s32 size() { return count; }
+  bool empty() { return count == 0; }
+  s32 capacity() { return ctrl.size(); }
+
+  V *find(K key) {
+    if (count == 0)
+      return NULL;
+    auto h = flat_hash((u64)key);
+    u8 tag = (u8)(h & 0x7f);
+    s32 groups = ctrl.size() / FLAT_GROUP;
+    s32 g = (s32)(h >> 7) & (groups - 1);
+    for (s32 step = 1; ; step++) {
+      auto group = ctrl.data() + g * FLAT_GROUP;
+      for (u32 m = flat_match(group, tag); m != 0; m &= m - 1) {
+        s32 i = g * FLAT_GROUP + countr_zero(m);
+        if (keys[i] == key)
+          return &vals[i];
+      }
+      if (flat_match(group, FLAT_EMPTY) != 0)
+        return NULL;
+      g = (g + step) & (groups - 1); // triangular probing visits every group
+    }
+  }
+
+  bool contains(K key) {
+    return find(key) != NULL;
+  }
+
+  // inserts or overwrites. returns the stored value.
+  V *insert(K key, V val) {
+    auto existing = find(key);
+    if (existing != NULL) {
+      *existing = move(val);
+      return existing;
+    }
+
+    if ((count + tombstones + 1) * 8 > capacity() * 7)
+      rehash(count + 1 > capacity() * 7 / 16 ? max<s32>(capacity() * 2, FLAT_GROUP) : capacity());
+
+    auto h = flat_hash((u64)key);
+    s32 i = free_slot(h);
+    if (ctrl[i] == FLAT_DELETED)
+      tombstones--;
+    ctrl[i] = (u8)(h & 0x7f);
+    keys[i] = key;
+    vals[i] = move(val);
+    count++;
+    return &vals[i];
+  }
+
+  bool erase(K key) {
+    auto v = find(key);
+    if (v == NULL)
+      return false;
+    s32 i = v - vals.data();
+    ctrl[i] = FLAT_DELETED;
+    vals[i] = V();
+    count--;
+    tombstones++;
+    return true;
+  }
+
+  void clear() {
+    fill(ctrl.begin(), ctrl.end(), FLAT_EMPTY);
+    count = 0;
+    tombstones = 0;
+  }
+
+  // calls fn(key, value) for every entry.
+  template <typename F>
+  void each(F fn) {
+    for (s32 i = 0; i < ctrl.size(); i++)
+      if (!(ctrl[i] & 0x80))
+        fn(keys[i], vals[i]);
+  }
+
+  s32 free_slot(u64 h) {
+    s32 groups = ctrl.size() / FLAT_GROUP;
+    s32 g = (s32)(h >> 7) & (groups - 1);
+    for (s32 step = 1; ; step++) {
+      auto group = ctrl.data() + g * FLAT_GROUP;
+      u32 m = flat_match(group, FLAT_EMPTY) | flat_match(group, FLAT_DELETED);
+      if (m != 0)
+        return g * FLAT_GROUP + countr_zero(m);
+      g = (g + step) & (groups - 1);
+    }
+  }
+
+  // grows to new_capacity slots (a power of two) and drops tombstones.
+  void rehash(s32 new_capacity) {
+    auto old_ctrl = move(ctrl);
+    auto old_keys = move(keys);
+    auto old_vals = move(vals);
+    ctrl.assign(new_capacity, FLAT_EMPTY);
+    keys.assign(new_capacity, K());
+    vals = vector<V>(new_capacity);
+    tombstones = 0;
+
+    for (s32 i = 0; i < old_ctrl.size(); i++) {
+      if (old_ctrl[i] & 0x80)
+        continue;
+      auto h = flat_hash((u64)old_keys[i]);
+      s32 j = free_slot(h);
+      ctrl[j] = (u8)(h & 0x7f);
+      keys[j] = old_keys[i];
+      vals[j] = move(old_vals[i]);
+    }
+  }
+};
+
+// a FlatMap without values.
+template <typename K>
+struct FlatSet {
+  FlatMap<K, u8> map;
+
+  s32 size() { return map.size(); }
+  bool empty() { return map.empty(); }
+  bool contains(K key) { return map.contains(key); }
+  bool erase(K key) { return map.erase(key); }
+  void clear() { map.clear(); }
+
+  // false if it was already there.
+  bool insert(K key) {
+    if (map.contains(key))
+      return false;
+    map.insert(key, 1);
+    return true;
+  }
+
+  template <typename F>
+  void each(F fn) {
+    map.each([&](K key, u8) { fn(key); });
+  }
+};
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <windows.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <fstream>
+
+#include "core.hpp"
+#include "hex.hpp"
+#include "metrics.hpp"
+
+using namespace std;
+
+// the last FLIGHT_PACKETS packets of a connection, both ways, as they were
+// handled: decrypted bytes, opcode, the iv they were crypted with and when.
+// recording is a fixed-size copy into a ring owned by the connection's task;
+// formatting only happens in dump, after the fact (a disconnect, a packet
+// that didn't parse), on the FlightWriter thread.
+
+#define FLIGHT_PACKETS 256    // per connection; a power of two
+#define FLIGHT_SNAP_BYTES 232 // kept of each packet, so an entry is 256 bytes
+#define FLIGHT_DIR "flight"
+
+struct FlightEntry {
+  u64 time_us;  // read_clock_us when handled or sent
+  u32 len;      // of the whole packet; at most FLIGHT_SNAP_BYTES are kept
+  u16 opcode;
+  u8 dir;       // Direction
+  u8 has_iv;    // sends the io thread encrypts don't have one yet
+  u8 iv[4];     // before this packet's crypt
+  u8 bytes[FLIGHT_SNAP_BYTES];
+};
+
+struct FlightRecorder {
+  u64 next = 0;
+  FlightEntry entries[FLIGHT_PACKETS];
+
+  void record(Direction dir, const u8 *bytes, s32 len, const u8 *iv, u64 time_us) {
+    auto &e = entries[next++ & (FLIGHT_PACKETS - 1)];
+    e.time_us = time_us;
+    e.len = (u32)len;
+    e.opcode = len >= 2 ? bytes[0] | (bytes[1] << 8) : 0;
+    e.dir = (u8)dir;
+    e.has_iv = iv != NULL;
+    if (iv != NULL)
+      memcpy(e.iv, iv, 4);
+    memcpy(e.bytes, bytes, min<s32>(len, FLIGHT_SNAP_BYTES));
+  }
+
+  bool empty() { return next == 0; }
+  void reset() { next = 0; }
+
+  // oldest first, times relative to the newest packet. written to a temp
+  // file and moved over path.
+  bool dump(string path, ccstr title) {
+    auto tmp = path + ".tmp";
+    ofstream out(tmp, ios::binary | ios::trunc);
+    if (!out.is_open())
+      return false;
+
+    u64 count = min<u64>(next, FLIGHT_PACKETS);
+    u64 newest = count > 0 ? entries[(next - 1) & (FLIGHT_PACKETS - 1)].time_us : 0;
+    char buf[256 + (FLIGHT_SNAP_BYTES / HEX_ROW + 1) * HEX_ROW_CHARS]; // one entry: header line, rows, note
+    out << title << "\n" << next << " packets, the last " << count << " of them below, times relative to the last\n\n";
+
+    for (u64 n = next - count; n < next; n++) {
+      auto &e = entries[n & (FLIGHT_PACKETS - 1)];
+      char iv[12] = "-";
+      if (e.has_iv)
+        iv[hex_bytes(iv, e.iv, 4)] = '\0';
+      s32 used = snprintf(buf, sizeof(buf), "%+11.3fms %s 0x%04x %u bytes iv %s\n",
+                          -(double)(newest - e.time_us) / 1000, direction_names[e.dir], e.opcode, e.len, iv);
+
+      s32 kept = min<s32>(e.len, FLIGHT_SNAP_BYTES);
+      for (s32 off = 0; off < kept; off += HEX_ROW)
+        used += hex_row(buf + used, (u32)off, e.bytes + off, min<s32>(HEX_ROW, kept - off));
+      if (e.len > kept)
+        used += snprintf(buf + used, sizeof(buf) - used, "      (%u more bytes not kept)\n", (u32)(e.len - kept));
+      out.write(buf, used);
+    }
+
+    out.close();
+    return !out.fail() && MoveFileExA(tmp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+  }
+};
+
+// a copy of a ring on its way to disk; the connection goes on recording
+// into the original.
+struct FlightDump {
+  FlightRecorder flight;
+  string path;
+  string title;
+
+  void write() {
+    CreateDirectoryA(FLIGHT_DIR, NULL);
+    if (flight.dump(path, title.c_str()))
+      debug_print("flight: wrote %s", path.c_str());
+    else
+      debug_error("flight: failed to write %s: %d", path.c_str(), GetLastError());
+  }
+};
+
+// formats and writes dumps off the shards: a dump is a few hundred KB of
+// text, and the other instances on the shard are waiting to be served.
+struct FlightWriter {
+  SRWLOCK lock = SRWLOCK_INIT;
+  CONDITION_VARIABLE wake = CONDITION_VARIABLE_INIT;
+  vector<FlightDump*> queue; // guarded by lock
+  bool running = false;
+
+  bool start() {
+    auto proc = [](LPVOID p) -> DWORD {
+      ((FlightWriter*)p)->run();
+      return 0;
+    };
+    running = CreateThread(NULL, 0, proc, this, 0, NULL) != NULL;
+    return running;
+  }
+
+  // copies the ring and goes. without the thread, writes it here.
+  void submit(const FlightRecorder &flight, string path, string title) {
+    auto dump = new FlightDump{ flight, move(path), move(title) };
+    if (!running) {
+      dump->write();
+      delete dump;
+      return;
+    }
+    AcquireSRWLockExclusive(&lock);
+    queue.push_back(dump);
+    ReleaseSRWLockExclusive(&lock);
+    WakeConditionVariable(&wake);
+  }
+
+  void run() {
+    vector<FlightDump*> batch;
+    while (true) {
+      AcquireSRWLockExclusive(&lock);
+      while (queue.empty())
+        SleepConditionVariableSRW(&wake, &lock, INFINITE, 0);
+      batch.swap(queue);
+      ReleaseSRWLockExclusive(&lock);
+
+      for (auto dump : batch) {
+        dump->write();
+        delete dump;
+      }
+      batch.clear();
+    }
+  }
+};
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "core.hpp"
+
+// hex dumps by table lookup: a byte's two digits and its printable form are
+// one load each, so dumping a packet doesn't go through printf or a stream
+// per byte.
+
+#define HEX_ROW 16 // bytes per hex_row
+#define HEX_ROW_CHARS (6 + HEX_ROW * 3 + 2 + HEX_ROW + 2) // "0000  " hex " |" ascii "|\n"
+
+struct HexTable {
+  char digits[256][2];
+  char printable[256];
+
+  constexpr HexTable() : digits(), printable() {
+    const char hex[] = "0123456789abcdef";
+    for (u32 i = 0; i < 256; i++) {
+      digits[i][0] = hex[i >> 4];
+      digits[i][1] = hex[i & 15];
+      printable[i] = (i >= 0x20 && i < 0x7f) ? (char)i : '.';
+    }
+  }
+};
+
+inline constexpr HexTable hex_table;
+
+// "xx xx xx" for n bytes, 3n - 1 chars, not terminated.
+inline s32 hex_bytes(char *out, const u8 *bytes, s32 n) {
+  char *p = out;
+  for (s32 i = 0; i < n; i++) {
+    if (i > 0)
+      *p++ = ' ';
+    *p++ = hex_table.digits[bytes[i]][0];
+    *p++ = hex_table.digits[bytes[i]][1];
+  }
+  return p - out;
+}
+
+// one row of a dump, at most HEX_ROW bytes, newline included, not terminated:
+// "0010  01 02 03 ...  |abc...|". out needs HEX_ROW_CHARS.
+inline s32 hex_row(char *out, u32 offset, const u8 *bytes, s32 n) {
+  char *p = out;
+  for (u32 digit = 0; digit < 4; digit++)
+    *p++ = "0123456789abcdef"[(offset >> (12 - 4 * digit)) & 15];
+  *p++ = ' ';
+  *p++ = ' ';
+  for (s32 i = 0; i < HEX_ROW; i++) {
+    if (i < n) {
+      *p++ = hex_table.digits[bytes[i]][0];
+      *p++ = hex_table.digits[bytes[i]][1];
+    } else {
+      *p++ = ' ';
+      *p++ = ' ';
+    }
+    *p++ = ' ';
+  }
+  *p++ = ' ';
+  *p++ = '|';
+  for (s32 i = 0; i < n; i++)
+    *p++ = hex_table.printable[bytes[i]];
+  *p++ = '|';
+  *p++ = '\n';
+  return p - out;
+}
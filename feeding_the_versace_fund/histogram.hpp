@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <string>
+#include <sstream>
+
+#include "core.hpp"
+
+using namespace std;
+
+#define HIST_SUB_BITS 3
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+// log-linear histogram, hdr style: values below HIST_SUB_COUNT get a bucket
+// each, every power of two above that is split into HIST_SUB_COUNT buckets,
+// so a quantile is off by at most 1/HIST_SUB_COUNT of its value. recording is
+// a couple of relaxed atomic adds, so any thread can record into it.
+struct Histogram {
+  atomic<u64> counts[HIST_BUCKETS] = {};
+  atomic<u64> total{0};
+  atomic<u64> sum{0};
+  atomic<u64> max_value{0};
+
+  static u32 bucket_of(u64 v) {
+    if (v < HIST_SUB_COUNT)
+      return (u32)v;
+    u32 shift = (63 - countl_zero(v)) - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + (u32)((v >> shift) & (HIST_SUB_COUNT - 1));
+  }
+
+  // smallest value that lands in bucket b.
+  static u64 bucket_floor(u32 b) {
+    if (b < HIST_SUB_COUNT)
+      return b;
+    u32 shift = (b >> HIST_SUB_BITS) - 1;
+    return (u64)(HIST_SUB_COUNT + (b & (HIST_SUB_COUNT - 1))) << shift;
+  }
+
+  void record(u64 v) {
+    counts[bucket_of(v)].fetch_add(1, memory_order_relaxed);
+    total.fetch_add(1, memory_order_relaxed);
+    sum.fetch_add(v, memory_order_relaxed);
+    auto m = max_value.load(memory_order_relaxed);
+    while (v > m && !max_value.compare_exchange_weak(m, v, memory_order_relaxed));
+  }
+
+  // upper edge of the bucket holding the q-th quantile (0 < q <= 1).
+  u64 quantile(double q) {
+    u64 n = total.load(memory_order_relaxed);
+    if (n == 0)
+      return 0;
+    u64 rank = (u64)(q * n + 0.5);
+    if (rank == 0)
+      rank = 1;
+    u64 seen = 0;
+    for (u32 b = 0; b < HIST_BUCKETS; b++) {
+      seen += counts[b].load(memory_order_relaxed);
+      if (seen >= rank) {
+        u64 upper = (b + 1 < HIST_BUCKETS) ? bucket_floor(b + 1) - 1 : ~(u64)0;
+        return min<u64>(upper, max_value.load(memory_order_relaxed));
+      }
+    }
+    return max_value.load(memory_order_relaxed);
+  }
+
+  double mean() {
+    u64 n = total.load(memory_order_relaxed);
+    return n == 0 ? 0 : (double)sum.load(memory_order_relaxed) / n;
+  }
+
+  // one line: "<name> n=... mean=... p50=... p90=... p99=... max=..."
+  string summary(ccstr name) {
+    stringstream ss;
+    ss << name << " n=" << total.load(memory_order_relaxed) << " mean=" << (u64)mean()
+       << " p50=" << quantile(0.5) << " p90=" << quantile(0.9) << " p99=" << quantile(0.99)
+       << " max=" << max_value.load(memory_order_relaxed);
+    return ss.str();
+  }
+};
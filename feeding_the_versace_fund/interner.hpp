@@ -0,0 +1,102 @@
+#pragma once
+
+#include <windows.h>
+#include <string>
+#include <string_view>
+#include <deque>
+
+#include "core.hpp"
+#include "flat.hpp"
+
+using namespace std;
+
+// fnv-1a, never 0 so 0 can mark an empty slot. this is also the hash the seen
+// index is keyed by, so it can't change without rebuilding those.
+inline u64 hash_ign(const char *s, s32 len) {
+  u64 h = 0xcbf29ce484222325ull;
+  for (s32 i = 0; i < len; i++) {
+    h ^= (u8)s[i];
+    h *= 0x100000001b3ull;
+  }
+  return h == 0 ? 1 : h;
+}
+
+inline u64 hash_ign(string_view s) {
+  return hash_ign(s.data(), s.size());
+}
+
+// process-wide ign table. every name we come across gets a small id once, and
+// from then on the containers hold ids: no string copies per player, no
+// rehashing of names. lookups hash straight from the packet bytes and only a
+// name we've never seen allocates.
+//
+// like the seen index, names are told apart by their 64-bit hash.
+//
+// id 0 means no name. ids are never freed; the table grows with the number of
+// distinct players we've seen this run.
+struct Interner {
+  struct Entry {
+    u64 hash;
+    string name;
+  };
+
+  SRWLOCK lock = SRWLOCK_INIT;
+  deque<Entry> entries; // id - 1 -> entry. deque, so names never move
+  FlatMap<u64, u32> ids; // hash -> id
+
+  u32 intern(string_view s) {
+    auto h = hash_ign(s);
+
+    AcquireSRWLockShared(&lock);
+    auto found = ids.find(h);
+    u32 id = found ? *found : 0;
+    ReleaseSRWLockShared(&lock);
+    if (id != 0)
+      return id;
+
+    AcquireSRWLockExclusive(&lock);
+    found = ids.find(h); // someone may have beaten us to it
+    if (found != NULL) {
+      id = *found;
+    } else {
+      entries.push_back({ h, string(s) });
+      id = (u32)entries.size();
+      ids.insert(h, id);
+    }
+    ReleaseSRWLockExclusive(&lock);
+    return id;
+  }
+
+  // the reference stays valid for the life of the process.
+  const string &name(u32 id) {
+    static const string none;
+    if (id == 0)
+      return none;
+    AcquireSRWLockShared(&lock);
+    auto &e = entries[id - 1];
+    ReleaseSRWLockShared(&lock);
+    return e.name;
+  }
+
+  u64 hash(u32 id) {
+    if (id == 0)
+      return 0;
+    AcquireSRWLockShared(&lock);
+    auto h = entries[id - 1].hash;
+    ReleaseSRWLockShared(&lock);
+    return h;
+  }
+
+  s32 size() {
+    AcquireSRWLockShared(&lock);
+    s32 n = entries.size();
+    ReleaseSRWLockShared(&lock);
+    return n;
+  }
+};
+
+inline Interner igns;
+
+inline ccstr ign_name(u32 id) {
+  return igns.name(id).c_str();
+}
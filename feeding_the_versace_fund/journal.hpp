@@ -0,0 +1,221 @@
+#pragma once
+
+#include <windows.h>
+#include <string>
+#include <vector>
+
+#include "core.hpp"
+#include "seen.hpp"
+
+using namespace std;
+
+// newly seen players go to a per-profile journal instead of the profile. the
+// packet path only queues the name; a background writer appends queued names
+// to their journals in batches, one FlushFileBuffers per journal per batch,
+// and once a journal gets big it folds it into the profile's name list and
+// empties it.
+//
+// record: u16 length, u32 crc32 of length and name, name bytes. a crash can
+// leave a torn record at the end; replay stops at the first record that
+// doesn't check out and cuts the file there.
+
+#define JOURNAL_GROUP_MS 50              // how long the writer gathers a batch
+#define JOURNAL_COMPACT_BYTES (64 * 1024)
+
+inline u32 crc32(const u8 *bytes, s32 len, u32 crc = 0) {
+  static u32 table[256];
+  if (table[1] == 0) {
+    for (u32 i = 0; i < 256; i++) {
+      u32 c = i;
+      for (u32 k = 0; k < 8; k++)
+        c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+      table[i] = c;
+    }
+  }
+  crc = ~crc;
+  for (s32 i = 0; i < len; i++)
+    crc = table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+inline void journal_record(vector<u8> &out, const string &name) {
+  u16 len = (u16)min<s32>(name.size(), 0xffff);
+  u8 len_bytes[2] = { (u8)len, (u8)(len >> 8) };
+  u32 crc = crc32((const u8*)name.data(), len, crc32(len_bytes, 2));
+  out.push_back(len_bytes[0]);
+  out.push_back(len_bytes[1]);
+  for (u32 i = 0; i < 4; i++)
+    out.push_back((u8)(crc >> (i * 8)));
+  out.insert(out.end(), name.begin(), name.begin() + len);
+}
+
+struct Journal {
+  string path;
+  string profile_path;
+  HANDLE file = INVALID_HANDLE_VALUE;
+
+  vector<string> pending;   // queued by the instance, guarded by the writer's lock
+  vector<string> journaled; // writer only: names in the file since the last compaction
+  u64 size = 0;             // writer only
+
+  // opens the journal and folds whatever a previous run left in it into the
+  // profile and `seen`. runs before the writer thread starts.
+  bool open(string journal_path, string profile, SeenSet *seen) {
+    path = journal_path;
+    profile_path = profile;
+    file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+      debug_error("failed to open journal %s: %d", path.c_str(), GetLastError());
+      return false;
+    }
+
+    LARGE_INTEGER file_size;
+    GetFileSizeEx(file, &file_size);
+    vector<u8> bytes((s32)file_size.QuadPart);
+    DWORD got = 0;
+    if (!bytes.empty())
+      ReadFile(file, bytes.data(), (DWORD)bytes.size(), &got, NULL);
+    bytes.resize(got);
+
+    // replay
+    s32 at = 0;
+    while (at + 6 <= bytes.size()) {
+      u16 len = bytes[at] | (bytes[at + 1] << 8);
+      u32 crc = 0;
+      for (u32 i = 0; i < 4; i++)
+        crc |= (u32)bytes[at + 2 + i] << (i * 8);
+      if (at + 6 + len > bytes.size() || crc32(bytes.data() + at + 6, len, crc32(bytes.data() + at, 2)) != crc)
+        break;
+
+      string name((char*)bytes.data() + at + 6, len);
+      if (!seen->contains(name)) {
+        seen->insert(name);
+        journaled.push_back(name);
+      }
+      at += 6 + len;
+    }
+    if (at < bytes.size())
+      debug_error("journal %s: dropping %zu bytes of torn records", path.c_str(), bytes.size() - at);
+
+    size = at;
+    truncate(at);
+    return compact();
+  }
+
+  // appends the journaled names to the profile, makes that durable, then
+  // empties the journal. a crash in between leaves the names in both places,
+  // which the next replay dedups.
+  bool compact() {
+    if (!journaled.empty()) {
+      auto profile = CreateFileA(profile_path.c_str(), FILE_APPEND_DATA | GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+      if (profile == INVALID_HANDLE_VALUE) {
+        debug_error("failed to open %s for compaction: %d", profile_path.c_str(), GetLastError());
+        return false;
+      }
+      defer { CloseHandle(profile); };
+
+      string text;
+
+      // a torn last line from an earlier crash mustn't swallow the next name.
+      LARGE_INTEGER end = {}, pos;
+      char last = '\n';
+      DWORD got = 0;
+      end.QuadPart = -1;
+      if (SetFilePointerEx(profile, end, &pos, FILE_END))
+        ReadFile(profile, &last, 1, &got, NULL);
+      if (last != '\n')
+        text += "\r\n";
+
+      for (auto &name : journaled)
+        text += name + "\r\n";
+
+      DWORD wrote = 0;
+      if (!WriteFile(profile, text.data(), (DWORD)text.size(), &wrote, NULL) || wrote != text.size() || !FlushFileBuffers(profile)) {
+        debug_error("failed to compact journal into %s: %d", profile_path.c_str(), GetLastError());
+        return false;
+      }
+      journaled.clear();
+    }
+
+    size = 0;
+    return truncate(0);
+  }
+
+  bool truncate(u64 at) {
+    LARGE_INTEGER pos;
+    pos.QuadPart = at;
+    return SetFilePointerEx(file, pos, NULL, FILE_BEGIN) && SetEndOfFile(file) && FlushFileBuffers(file);
+  }
+};
+
+struct JournalWriter {
+  SRWLOCK lock = SRWLOCK_INIT;
+  CONDITION_VARIABLE wake = CONDITION_VARIABLE_INIT;
+  vector<Journal*> dirty; // guarded by lock
+
+  bool start() {
+    auto proc = [](LPVOID p) -> DWORD {
+      ((JournalWriter*)p)->run();
+      return 0;
+    };
+    return CreateThread(NULL, 0, proc, this, 0, NULL) != NULL;
+  }
+
+  // the packet path: queue the name and go.
+  void append(Journal *journal, const string &name) {
+    AcquireSRWLockExclusive(&lock);
+    if (journal->pending.empty())
+      dirty.push_back(journal);
+    journal->pending.push_back(name);
+    ReleaseSRWLockExclusive(&lock);
+    WakeConditionVariable(&wake);
+  }
+
+  void run() {
+    vector<Journal*> batch;
+    vector<string> names;
+    vector<u8> bytes;
+
+    while (true) {
+      AcquireSRWLockExclusive(&lock);
+      while (dirty.empty())
+        SleepConditionVariableSRW(&wake, &lock, INFINITE, 0);
+      ReleaseSRWLockExclusive(&lock);
+
+      // group commit: let more names pile up before paying for the flush.
+      Sleep(JOURNAL_GROUP_MS);
+
+      AcquireSRWLockExclusive(&lock);
+      batch.swap(dirty);
+      ReleaseSRWLockExclusive(&lock);
+
+      for (auto journal : batch) {
+        AcquireSRWLockExclusive(&lock);
+        names.swap(journal->pending);
+        ReleaseSRWLockExclusive(&lock);
+
+        bytes.clear();
+        for (auto &name : names)
+          journal_record(bytes, name);
+
+        DWORD wrote = 0;
+        LARGE_INTEGER pos;
+        pos.QuadPart = journal->size;
+        if (!SetFilePointerEx(journal->file, pos, NULL, FILE_BEGIN) ||
+            !WriteFile(journal->file, bytes.data(), (DWORD)bytes.size(), &wrote, NULL) || wrote != bytes.size() ||
+            !FlushFileBuffers(journal->file)) {
+          debug_error("failed to write journal %s: %d", journal->path.c_str(), GetLastError());
+          journal->truncate(journal->size); // drop the partial batch; the names stay in memory
+        } else {
+          journal->size += wrote;
+          journal->journaled.insert(journal->journaled.end(), names.begin(), names.end());
+        }
+        names.clear();
+
+        if (journal->size >= JOURNAL_COMPACT_BYTES)
+          journal->compact();
+      }
+      batch.clear();
+    }
+  }
+};
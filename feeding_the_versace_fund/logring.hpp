@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <string.h>
+
+#include "core.hpp"
+
+using namespace std;
+
+#define LOG_LINES 512    // per instance, power of two
+#define LOG_LINE_LEN 120 // longer lines are cut
+
+struct LogLine {
+  atomic<u64> seq{0}; // 2n + 1 while line n is being written, 2n + 2 once it's done
+  u32 len = 0;
+  char text[LOG_LINE_LEN];
+};
+
+// an instance's log: the last LOG_LINES lines in fixed slots, so memory stays
+// flat however long it runs. any thread can log: a writer claims the next
+// line number with one fetch_add and never waits on anyone. the window reads
+// lines by number, and each slot is a tiny seqlock, so a reader that races a
+// writer just sees the line as missing instead of half-written.
+//
+// two writers a whole ring apart could land on the same slot at once; with
+// LOG_LINES lines in between that doesn't happen in practice, and the worst
+// case is one garbled line.
+struct LogRing {
+  atomic<u64> next{0};    // lines ever written
+  atomic<u64> cleared{0}; // lines before this are hidden
+  LogLine lines[LOG_LINES];
+
+  void push(ccstr s) {
+    u64 n = next.fetch_add(1, memory_order_relaxed);
+    auto &line = lines[n & (LOG_LINES - 1)];
+    line.seq.store(2 * n + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    u32 len = (u32)strnlen(s, LOG_LINE_LEN);
+    while (len > 0 && (s[len - 1] == '\n' || s[len - 1] == '\r'))
+      len--;
+    memcpy(line.text, s, len);
+    line.len = len;
+
+    line.seq.store(2 * n + 2, memory_order_release);
+  }
+
+  // [first(), end()) is what's left to show.
+  u64 end() {
+    return next.load(memory_order_acquire);
+  }
+
+  u64 first() {
+    u64 e = end();
+    return max<u64>(cleared.load(memory_order_relaxed), e > LOG_LINES ? e - LOG_LINES : 0);
+  }
+
+  void clear() {
+    cleared.store(end(), memory_order_relaxed);
+  }
+
+  // copies line n into out (cap bytes, nul-terminated). false if it has been
+  // overwritten or is still being written.
+  bool read(u64 n, char *out, u32 cap) {
+    auto &line = lines[n & (LOG_LINES - 1)];
+    u64 seq = line.seq.load(memory_order_acquire);
+    if (seq != 2 * n + 2)
+      return false;
+    u32 len = min<u32>(line.len, min<u32>(cap - 1, LOG_LINE_LEN));
+    memcpy(out, line.text, len);
+    atomic_thread_fence(memory_order_acquire);
+    if (line.seq.load(memory_order_relaxed) != seq)
+      return false;
+    out[len] = '\0';
+    return true;
+  }
+};
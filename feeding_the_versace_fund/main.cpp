@@ -17,6 +17,24 @@
 #include <windowsx.h>
 
 #include "client.hpp"
+#include "scheduler.hpp"
+#include "reactor.hpp"
+#include "histogram.hpp"
+#include "seen.hpp"
+#include "journal.hpp"
+#include "candidates.hpp"
+#include "rng.hpp"
+#include "interner.hpp"
+#include "logring.hpp"
+#include "seqlock.hpp"
+#include "metrics.hpp"
+#include "exporter.hpp"
+#include "statseg.hpp"
+#include "trace.hpp"
+#include "probes.hpp"
+#include "session.hpp"
+#include "trade.hpp"
+#include "registry.hpp"
 #include "core.hpp"
 #include "defer.hpp"
 #include "crypto.hpp"
@@ -26,39 +44,91 @@
 
 using namespace std;
 
-enum TradeState {
-  STATE_INACTIVE,
-  STATE_INITIATED,
-  STATE_PLAYER_JOINED,
-  STATE_PLAYER_MADE_OFFER,
-  STATE_PLAYER_ACCEPTED,
+// the steps of getting an instance online, in order. each is timed from the
+// end of the previous one.
+enum LoginPhase {
+  PHASE_CONNECT,         // tcp connect to the login server
+  PHASE_HANDSHAKE,       // login server hello
+  PHASE_LOGIN_STATUS,    // auth -> LOGIN_STATUS
+  PHASE_SERVER_LIST,
+  PHASE_WORLD_INFO,
+  PHASE_CHAR_INFO,
+  PHASE_SERVER_INFO,
+  PHASE_CHANNEL_CONNECT, // connect + handshake with the channel server
+  PHASE_FIRST_PACKET,    // first packet from the channel server
+  PHASE_ONLINE,          // the whole thing, first connect to first packet
+  PHASE_COUNT,
 };
 
-struct Trade {
-  TradeState state = STATE_INACTIVE;
-  u32 char_id; 
-  string ign;
-  u64 last_activity;
+ccstr login_phase_names[PHASE_COUNT] = {
+  "connect", "handshake", "login_status", "server_list", "world_info",
+  "char_info", "server_info", "channel_connect", "first_packet", "online",
 };
 
-u64 current_time_in_ms() {
-   FILETIME ft;
-   GetSystemTimeAsFileTime(&ft);
+#define LOGIN_PHASE_TIMEOUT_MS 5000
+#define STATS_INTERVAL_MS 60000
+#define METRICS_FILE "metrics.prom" // rewritten every STATS_INTERVAL_MS
+#define TRACE_POLL_MS 500 // how often `tools trace` requests are looked for
+#define DRAIN_BUDGET_US 2000
+
+// watchdog defaults, overridable per profile.
+#define SILENCE_TIMEOUT_MS 30000 // nothing at all from the server
+#define PING_TIMEOUT_MS 60000    // no OP_RECV_PING
+
+// reconnect backoff: BACKOFF_BASE_MS doubling per consecutive failure up to
+// BACKOFF_CAP_MS, each delay drawn from [half, all] of that.
+#define BACKOFF_BASE_MS 2000
+#define BACKOFF_CAP_MS 300000
+
+// the window polls the selected instance's log and stats instead of being
+// told about every change.
+#define UI_TIMER 1
+#define UI_REFRESH_MS 100
+#define LOG_ROW_HEIGHT 15 // matches the 15px Consolas the log is drawn in
+
+struct Inst;
+
+// the trade state machine's way out, for one instance: the client, the log,
+// metrics and the seen set.
+struct InstTradeIo {
+  Inst *inst;
+
+  void initiate_trade(u32 char_id);
+  void cancel_trade();
+  void submit_trade();
+  void send_trade_message();
+  void state_changed(TradeState from, TradeState to);
+  void joined();
+  void timed_out(TradeState state);
+};
 
-   LARGE_INTEGER li;
-   li.LowPart = ft.dwLowDateTime;
-   li.HighPart = ft.dwHighDateTime;
+struct Trade {
+  TradeFsm<InstTradeIo> fsm;
+  InstTradeIo io;
+  Timer timer;      // fires at the fsm's next deadline
+  u64 beg_armed_ns; // when a sampled packet armed the beg message, else 0
+};
 
-   return li.QuadPart / 10000;
-}
+// what the window shows about an instance. the instance publishes a fresh
+// copy whenever one of these changes.
+struct InstStats {
+  bool in_game;
+  u32 mesos;
+  u32 players;
+  char ign[16];
+};
 
-// instance
-struct Inst {
-  vector<string> logs;
+// what an instance was configured with, and the state its shard writes off
+// the packet path: logs, published stats, the tape, the seen journal, the
+// flight recorder. kept apart from Inst so the per-packet working set doesn't
+// drag strings and log lines through the cache; aligned like Inst, since
+// neighbouring profiles are written by different shards.
+struct alignas(CACHE_LINE) InstProfile {
+  LogRing logs;
+  Seqlock<InstStats> stats;
   string profile_file;
-  GameClient client;
+  unordered_map<string, string> config; // as read from the profile
 
-  // profile
   string name;
   string username;
   string password;
@@ -70,26 +140,84 @@ struct Inst {
   string server_ip;
   string beg_message;
   u16 server_port;
-  unordered_set<string> players_seen;
-
-  u32 char_id;
+  bool pipelined; // hand the connection to the io thread once in game
+  bool record;    // record each session into TAPE_DIR, for replay
+  SessionTape tape;
+  Journal seen_journal; // names seen since the profile was last compacted
+  FlightRecorder flight; // the client's last packets, 64 KB of them
   u32 account_id;
+  string ign;
+};
 
-  bool in_game;
+// instance: the connection and what its packets update, written by the shard
+// it runs on. aligned so that neighbours on other shards never share a line.
+struct alignas(CACHE_LINE) Inst {
+  u32 id; // index into world.instances and world.profiles
+  InstProfile *profile;
+  GameClient client;
+  TaskCtx task; // lets inst_main migrate between shards along with its trade timer
   Trade trade; // current trade
-  unordered_map<u32, string> players; 
+  CandidateSet players; // on the map, not seen yet
+  SeenSet players_seen;
+  Rng rng;
+  u32 char_id;
   u32 mesos;
-  string ign;
+  bool in_game;
+  u32 silence_timeout_ms;
+  u32 ping_timeout_ms;
+
+  ccstr status = "connect"; // login phase being waited on, "online" or "backoff"
+  u64 published_ms;         // last write to the stats segment
+  u32 reconnects;
+  u32 failures;    // consecutive runs that never got online
+  u64 down_since;  // when the connection last dropped, 0 while online
 };
 
+// 19 lines with libstdc++, not measured under msvc, whose debug containers
+// are bigger; the bound is there to catch something big moving in.
+static_assert(sizeof(Inst) <= 32 * CACHE_LINE, "Inst is the hot half: big or rarely read state belongs in InstProfile");
+
 struct World {
-  Inst instances[100];
-  s32 n_instances;
+  Registry<Inst> instances;
+  Registry<InstProfile> profiles; // by the same index
   HWND wnd;
+  IoThread io_thread; // shared by pipelined instances
+  Reactor reactor;
+  Histogram login_latency[PHASE_COUNT]; // ms, across all instances
+  Histogram recovery_ms; // connection drop to back online
+  JournalWriter journal_writer;
+  TapeWriter tape_writer; // started if any profile records
+  FlightWriter flight_writer;
+
+  // metrics (see register_metrics)
+  Histogram handler_ns; // one in-game packet handled
+  Histogram pong_us;    // OP_RECV_PING off the wire to our pong queued
+  u32 reconnects;
+  u32 trades_initiated;
+  u32 trade_events[STATE_COUNT][0x20]; // by state and TradeOp
+  u32 trade_timeouts[STATE_COUNT];
+
+  StatsSegment stats_segment; // for `tools top` and `tools trace`
+  atomic<u64> disconnect_traced_ms; // last trace dumped on a disconnect
 };
 
 static World world;
 
+// a new instance with an empty profile, at the end of the registry.
+Inst *add_inst() {
+  auto inst = world.instances.add();
+  inst->id = world.instances.size() - 1;
+  inst->profile = world.profiles.add();
+  inst->client.flight = &inst->profile->flight;
+  return inst;
+}
+
+// ms from `then` to `now`, 0 if `then` is later: in pipelined mode the io
+// thread stamps last_bytes with its own, fresher clock read.
+u64 ms_since(u64 then, u64 now) {
+  return now > then ? now - then : 0;
+}
+
 string format_number(int n) {
   string num = to_string(n);
   int pos = (int)num.length() - 3;
@@ -100,46 +228,157 @@ string format_number(int n) {
   return num;
 }
 
-bool is_inst_selected(Inst *inst) {
-  auto cbox = GetDlgItem(world.wnd, IDC_ACCOUNTS);
-  return inst == (world.instances + ComboBox_GetCurSel(cbox));
-};
+// formats the line once, for the window (which picks it up on its next
+// UI_REFRESH_MS tick) and for the debug log. never blocks.
+template <typename... Args>
+void log_inst(Inst *inst, u32 level, ccstr fmt, Args... args) {
+  char line[1024];
+  s32 prefix = level >= LOG_ERROR ? snprintf(line, sizeof(line), "[err] ") : 0;
+  snprintf(line + prefix, sizeof(line) - prefix, fmt, args...);
+  inst->profile->logs.push(line);
+  if (level >= LOG_ERROR)
+    debug_error("%s", line + prefix);
+  else
+    debug_print("%s", line);
+}
+
+// the instance's row in the shared stats segment. like publish_stats, only
+// the instance calls it.
+void publish_slot(Inst *inst) {
+  auto slot = world.stats_segment.slot(inst->id);
+  if (slot == NULL)
+    return;
+
+  auto client = &inst->client;
+  InstSlot row = {};
+  copy_field(row.name, sizeof(row.name), inst->profile->name.c_str());
+  copy_field(row.ign, sizeof(row.ign), inst->profile->ign.c_str());
+  copy_field(row.status, sizeof(row.status), inst->status);
+  copy_field(row.trade, sizeof(row.trade), trade_state_names[inst->trade.fsm.state]);
+  row.mesos = inst->mesos;
+  row.players = inst->players.size();
+  row.seen = inst->players_seen.size();
+  row.reconnects = inst->reconnects;
+  row.packets_in = client->packets_in;
+  row.packets_out = client->packets_out;
+  row.bytes_in = client->bytes_in;
+  row.bytes_out = client->bytes_out;
+  row.inq_depth = client->inq.count;
+  row.outq_bytes = (u32)client->out.queued;
+  row.updated_ms = read_clock_ms();
+  slot->store(row);
+  inst->published_ms = row.updated_ms;
+}
+
+// called by the instance itself, the only writer of these fields.
+void publish_stats(Inst *inst) {
+  InstStats stats = {};
+  stats.in_game = inst->in_game;
+  stats.mesos = inst->mesos;
+  stats.players = inst->players.size();
+  memcpy(stats.ign, inst->profile->ign.data(), min<s32>(inst->profile->ign.size(), sizeof(stats.ign) - 1));
+  inst->profile->stats.store(stats);
+  publish_slot(inst);
+}
+
+// hands the instance's last packets to the flight writer, for FLIGHT_DIR:
+// one file per instance and reason, replaced each time.
+void dump_flight(Inst *inst, ccstr reason) {
+  auto &flight = inst->profile->flight;
+  if (flight.empty())
+    return;
+  auto path = string(FLIGHT_DIR "/") + inst->profile->name + "." + reason + ".txt";
+  log_inst(inst, LOG_INFO, "Writing the last packets to %s.", path.c_str());
+  world.flight_writer.submit(flight, path, inst->profile->name + ": " + reason);
+}
 
-auto log_inst = [&](Inst *inst, ccstr s) {
-  string str(s);
-  inst->logs.push_back(str);
+void InstTradeIo::initiate_trade(u32 char_id) { inst->client.initiate_trade(char_id); }
+void InstTradeIo::cancel_trade() { inst->client.cancel_trade(); }
+void InstTradeIo::submit_trade() { inst->client.submit_trade(); }
 
-  if (is_inst_selected(inst)) {
-    auto lb = GetDlgItem(world.wnd, IDC_LOGS);
-    SendMessage(lb, LB_ADDSTRING, 0, (LPARAM)s);
-    SendMessage(lb, LB_SETCURSEL, inst->logs.size() - 1, 0);
+void InstTradeIo::send_trade_message() {
+  auto trade = &inst->trade;
+  if (trade->beg_armed_ns != 0) {
+    trace_on = true; // the rest of a sampled reply
+    trace_span("beg_wait", trade->beg_armed_ns, read_clock_ns());
+    trade->beg_armed_ns = 0;
   }
-};
+  inst->client.send_trade_message(inst->profile->beg_message);
+}
+
+void InstTradeIo::state_changed(TradeState from, TradeState to) {
+  probe3(trade_state, inst, inst->id, from, (u32)from, to, (u32)to);
+}
+
+void InstTradeIo::joined() {
+  auto trade = &inst->trade;
+  auto ign = trade->fsm.ign;
+
+  // we've now "seen" the character. the journal writer makes it durable in
+  // the background.
+  inst->players_seen.insert(igns.hash(ign));
+  if (!inst->profile->tape.replaying) // a replay doesn't get to change the profile
+    world.journal_writer.append(&inst->profile->seen_journal, igns.name(ign));
+
+  log_inst(inst, LOG_INFO, "%s joined the trade.", ign_name(ign));
+  trade->beg_armed_ns = trace_on ? read_clock_ns() : 0;
+}
 
-int run_inst(int instid) {
-  auto inst = world.instances + instid;
+void InstTradeIo::timed_out(TradeState state) {
+  log_inst(inst, LOG_INFO, "Player was unresponsive for %ds, cancelling trade.", inst->trade.fsm.timings->timeout_ms[state] / 1000);
+  metrics.add(world.trade_timeouts[state]);
+}
+
+Task<int> run_inst(int instid) {
+  auto inst = world.instances.get(instid);
   auto client = &inst->client;
 
-  #define log(fmt, ...) log_inst(inst, debug_print(fmt, __VA_ARGS__))
-  #define log_error(fmt, ...) log_inst(inst, debug_error(fmt, __VA_ARGS__))
+  #define log(fmt, ...) log_inst(inst, LOG_INFO, fmt, __VA_ARGS__)
+  #define log_error(fmt, ...) log_inst(inst, LOG_ERROR, fmt, __VA_ARGS__)
+
+  // every phase of the login gets LOGIN_PHASE_TIMEOUT_MS from the end of the
+  // previous one. phases are recorded once, the first time they're reached.
+  auto login_start = current_time_in_ms();
+  inst->status = login_phase_names[PHASE_CONNECT];
+  publish_slot(inst);
+  auto phase_start = login_start;
+  auto phase_deadline = login_start + LOGIN_PHASE_TIMEOUT_MS;
+  u32 next_phase = PHASE_CONNECT;
+
+  auto mark_phase = [&](LoginPhase phase, u64 took) {
+    if (phase < next_phase)
+      return;
+    world.login_latency[phase].record(took);
+    probe3(login_phase, inst, (u32)instid, phase, (u32)phase, ms, took);
+    next_phase = phase + 1;
+    inst->status = next_phase < PHASE_ONLINE ? login_phase_names[next_phase] : "online";
+    publish_slot(inst);
+    phase_start = current_time_in_ms();
+    phase_deadline = phase_start + LOGIN_PHASE_TIMEOUT_MS;
+  };
+  auto reach_phase = [&](LoginPhase phase) {
+    mark_phase(phase, current_time_in_ms() - phase_start);
+  };
 
   { // try to log in
-    if (!client->init(inst->server_ip, inst->server_port)) {
+    if (!co_await client->init(inst->profile->server_ip, inst->profile->server_port)) {
       log_error("unable to connect to server.");
-      return EXIT_FAILURE;
+      co_return EXIT_FAILURE;
     }
+    mark_phase(PHASE_CONNECT, client->connect_ms);
+    mark_phase(PHASE_HANDSHAKE, client->handshake_ms);
 
-    auto last_login_activity = current_time_in_ms();
     bool in_game = false;
 
-    client->auth(inst->username, inst->password);
+    client->auth(inst->profile->username, inst->profile->password);
 
     while (client->connected && !in_game) {
-      auto p = client->read_packet();
+      auto now = current_time_in_ms();
+      auto p = co_await client->read_packet(now < phase_deadline ? (u32)(phase_deadline - now) : 0);
       if (p == NULL) {
-        if (current_time_in_ms() - last_login_activity > 5000) {
-          log_error("login attempt timed out (maybe credentials wrong, or we're banned)");
-          return EXIT_FAILURE;
+        if (current_time_in_ms() >= phase_deadline) {
+          log_error("login timed out waiting for %s (maybe credentials wrong, or we're banned)", login_phase_names[next_phase]);
+          co_return EXIT_FAILURE;
         }
         continue;
       }
@@ -150,41 +389,42 @@ int run_inst(int instid) {
       case OP_RECV_LOGIN_STATUS:
         switch ((LoginStatus)p->read1()) {
         case LOGIN_SUCCESS:
+          reach_phase(PHASE_LOGIN_STATUS);
           p->read1();
           p->read4();
-          inst->account_id = p->read4();
+          inst->profile->account_id = p->read4();
           client->show_world();
           break;
-        case LOGIN_DOESNT_HAPPEN:     log_error("Login failed (reason unknown).");       return EXIT_FAILURE;
-        case LOGIN_TEMP_BAN:          log_error("Login failed (account tempbanned).");   return EXIT_FAILURE;
-        case LOGIN_PERM_BAN:          log_error("Login failed (account permabanned).");  return EXIT_FAILURE;
-        case LOGIN_WRONG_PASSWORD:    log_error("Login failed (wrong password).");       return EXIT_FAILURE;
-        case LOGIN_WRONG_USERNAME:    log_error("Login failed (wrong username).");       return EXIT_FAILURE;
-        case LOGIN_SYSTEM_ERROR:      log_error("Login failed (server error)");          return EXIT_FAILURE;
-        case LOGIN_ALREADY_LOGGED_IN: log_error("Login failed (already logged in)");     return EXIT_FAILURE;
+        case LOGIN_DOESNT_HAPPEN:     log_error("Login failed (reason unknown).");       co_return EXIT_FAILURE;
+        case LOGIN_TEMP_BAN:          log_error("Login failed (account tempbanned).");   co_return EXIT_FAILURE;
+        case LOGIN_PERM_BAN:          log_error("Login failed (account permabanned).");  co_return EXIT_FAILURE;
+        case LOGIN_WRONG_PASSWORD:    log_error("Login failed (wrong password).");       co_return EXIT_FAILURE;
+        case LOGIN_WRONG_USERNAME:    log_error("Login failed (wrong username).");       co_return EXIT_FAILURE;
+        case LOGIN_SYSTEM_ERROR:      log_error("Login failed (server error)");          co_return EXIT_FAILURE;
+        case LOGIN_ALREADY_LOGGED_IN: log_error("Login failed (already logged in)");     co_return EXIT_FAILURE;
         }
         break;
       case OP_RECV_SERVER_LIST:
         if (p->read1() == 0xff)
           break;
         log("Received server list.");
-        last_login_activity = current_time_in_ms();
+        reach_phase(PHASE_SERVER_LIST);
 
-        client->select_world(inst->world);
+        client->select_world(inst->profile->world);
         break;
       case OP_RECV_WORLD_INFO:
-        client->select_channel(inst->world, inst->channel);
+        client->select_channel(inst->profile->world, inst->profile->channel);
         log("Received world info.");
-        last_login_activity = current_time_in_ms();
+        reach_phase(PHASE_WORLD_INFO);
         break;
       case OP_RECV_CHAR_INFO:
         p->read2();
         inst->char_id = p->read4();
 
         log("Received character info (ID = 0x%x).", inst->char_id);
-        last_login_activity = current_time_in_ms();
+        reach_phase(PHASE_CHAR_INFO);
 
-        client->select_char_with_pic(inst->char_id, inst->pic, inst->macid, inst->hwid);
+        client->select_char_with_pic(inst->char_id, inst->profile->pic, inst->profile->macid, inst->profile->hwid);
         break;
       case OP_RECV_SERVER_INFO: {
         p->read2();
@@ -200,13 +440,14 @@ int run_inst(int instid) {
         inst->char_id = p->read4();
 
         log("Connecting to channel (%s:%d)...", ss.str().c_str(), port);
-        last_login_activity = current_time_in_ms();
+        reach_phase(PHASE_SERVER_INFO);
 
         client->disconnect();
-        if (!client->init(ss.str(), port)) {
+        if (!co_await client->init(ss.str(), port)) {
           log_error("Unable to connect to game server.");
-          return EXIT_FAILURE;
+          co_return EXIT_FAILURE;
         }
+        reach_phase(PHASE_CHANNEL_CONNECT);
 
         client->announce_logged_in(inst->char_id);
 
@@ -217,24 +458,83 @@ int run_inst(int instid) {
       }
     }
     if (!in_game)
-      return EXIT_FAILURE;
+      co_return EXIT_FAILURE;
   }
 
+  if (inst->profile->pipelined)
+    client->start_pipeline(&world.io_thread);
+
   inst->mesos = 0;
-  inst->ign = "";
+  inst->profile->ign = "";
   inst->in_game = true;
+  publish_stats(inst);
   
-  // look for trades in a loop.
+  // look for trades in a loop. the decisions are the fsm's; this keeps its
+  // timer on its next deadline and hands it the trade packets.
   auto trade = &inst->trade;
-  trade->state = STATE_INACTIVE;
-  trade->ign = "";
-  trade->last_activity = current_time_in_ms();
+  auto fsm = &trade->fsm;
+  trade->io.inst = inst;
+  fsm->io = &trade->io;
+  fsm->reset();
+
+  auto sync_timer = [=]() {
+    auto deadline = fsm->next_deadline();
+    if (deadline == NO_TRADE_DEADLINE)
+      cancel_timer(&trade->timer);
+    else
+      arm_timer_at(&trade->timer, deadline);
+  };
+
+  // make a decision based on current state of trade.
+  auto initiate_next_trade = [=]() {
+    if (fsm->active() || inst->players.empty())
+      return;
+
+    auto picked = inst->players.take_random(inst->rng);
+    metrics.add(world.trades_initiated);
+
+    log("---");
+    log("Initiating trade with %s.", ign_name(picked.ign));
+    fsm->start(picked.char_id, picked.ign, current_time_in_ms());
+    sync_timer();
+  };
+
+  trade->timer.callback = [=]() {
+    fsm->advance(current_time_in_ms());
+    sync_timer();
+    initiate_next_trade();
+  };
 
+  bool dumped_overrun = false;
   while (client->connected) {
-    // clear up to 50 packets from the packet queue
+    // handle packets for up to DRAIN_BUDGET_US. only the first read waits, the
+    // rest take whatever has already arrived. a budget in time rather than in
+    // packets keeps a flood of cheap packets from starving trade decisions and
+    // the other instances on this shard, without cutting a quiet map short.
     Packet *p;
-    for (u32 i = 0; i < 50 && (p = client->read_packet()) != NULL; i++) {
-      switch (p->read2()) {
+    auto drain_start = read_clock_us();
+    bool over_budget = false;
+    auto now = read_clock_ms();
+    auto watchdog = min(client->last_bytes() + inst->silence_timeout_ms, client->last_ping_ms + inst->ping_timeout_ms);
+    auto first_wait = (watchdog > now) ? (u32)min<u64>(watchdog - now, INFINITE - 1) : 0;
+    for (u32 i = 0; !over_budget && (p = co_await client->read_packet(i == 0 ? first_wait : 0)) != NULL; i++) {
+      over_budget = read_clock_us() - drain_start >= DRAIN_BUDGET_US;
+
+      if (next_phase == PHASE_FIRST_PACKET) {
+        reach_phase(PHASE_FIRST_PACKET);
+        mark_phase(PHASE_ONLINE, current_time_in_ms() - login_start);
+        log("Online after %llums.", current_time_in_ms() - login_start);
+        if (inst->down_since != 0) {
+          world.recovery_ms.record(current_time_in_ms() - inst->down_since);
+          inst->down_since = 0;
+        }
+        inst->failures = 0;
+      }
+
+      auto handle_start = read_clock_ns();
+      auto opcode = p->read2();
+      probe2(handler_begin, inst, (u32)instid, opcode, opcode);
+      switch (opcode) {
       case OP_RECV_WARP_TO_MAP: {
         p->read4();
         p->read1();
@@ -245,11 +545,11 @@ int run_inst(int instid) {
           p->skip(12); // rng seeds
           p->skip(13); // random crap
 
-          inst->ign = "";
+          inst->profile->ign = "";
           for (u32 i = 0; i < 13; i++) {
             char ch = p->read1();
             if (ch != 0)
-              inst->ign += ch;
+              inst->profile->ign += ch;
           }
 
           p->skip(77);
@@ -258,10 +558,7 @@ int run_inst(int instid) {
 
           inst->mesos = p->read4();
 
-          if (is_inst_selected(inst)) {
-            SetDlgItemText(world.wnd, IDC_IGN, inst->ign.c_str());
-            SetDlgItemText(world.wnd, IDC_MESOS, format_number(inst->mesos).c_str());
-          }
+          publish_stats(inst);
         }
         break;
       }
@@ -269,169 +566,282 @@ int run_inst(int instid) {
         p->read1();
         if (p->read4() == 0x40000) { // mesos
           inst->mesos = p->read4();
-          if (is_inst_selected(inst))
-            SetDlgItemText(world.wnd, IDC_MESOS, format_number(inst->mesos).c_str());
+          publish_stats(inst);
         }
         break;
       case OP_RECV_TRADE: {
-        switch (p->read1()) {
+        auto op = p->read1();
+        if (op < 0x20 && trade_op_name(op) != NULL)
+          metrics.add(world.trade_events[fsm->state][op]);
+
+        // the rest of the packet is only for the log.
+        switch (op) {
         case TRADE_MESOS:
-          trade->last_activity = current_time_in_ms();
           p->read1();
-          log("%s offered %s mesos.", trade->ign.c_str(), format_number(p->read4()).c_str());
+          log("%s offered %s mesos.", ign_name(fsm->ign), format_number(p->read4()).c_str());
           break;
 
         case TRADE_ITEM:
-          trade->last_activity = current_time_in_ms();
-          log("%s offered an item.", trade->ign.c_str());
+          log("%s offered an item.", ign_name(fsm->ign));
           break;
 
         case TRADE_ACCEPTED:
-          log("%s accepted the trade.", trade->ign.c_str());
-          trade->state = STATE_PLAYER_ACCEPTED;
-          client->submit_trade();
-          trade->last_activity = current_time_in_ms();
+          log("%s accepted the trade.", ign_name(fsm->ign));
           break;
 
-        case TRADE_JOINED: {
-          if (trade->state != STATE_INITIATED)
-            break;
-          trade->state = STATE_PLAYER_JOINED;
-
-          // we've now "seen" the character
-          inst->players_seen.insert(trade->ign);
-
-          // save profile file
-          ofstream file(inst->profile_file);
-          file << "name = " << inst->name << endl;
-          file << "username = " << inst->username << endl;
-          file << "password = " << inst->password << endl;
-          file << "world = " << (int)inst->world << endl;
-          file << "channel = " << (int)inst->channel << endl;
-          file << "pic = " << inst->pic << endl;
-          file << "macid = " << inst->macid << endl;
-          file << "hwid = " << inst->hwid << endl;
-          file << "server_ip = " << inst->server_ip << endl;
-          file << "server_port = " << inst->server_port << endl;
-          file << "beg_message = " << inst->beg_message << endl;
-          file << endl;
-          for (auto ign : inst->players_seen)
-            file << ign << "\n";
-
-          log("%s joined the trade.", trade->ign.c_str());
-          Sleep(2000);
-          client->send_trade_message(inst->beg_message);
-          trade->last_activity = current_time_in_ms();
-          break;
-        }
-
         case TRADE_CHAT: {
           p->read1();
           auto side = p->read1(); // side
           auto msg = p->readstr();
-
-          trade->last_activity = current_time_in_ms();
           log("> %s", msg.c_str());
           break;
         }
 
         case TRADE_DECLINED:
-          log("%s declined the trade.", trade->ign.c_str());
-          trade->state = STATE_INACTIVE;
+          log("%s declined the trade.", ign_name(fsm->ign));
           break;
 
         case TRADE_ENDED:
           p->read1();
           switch (p->read1()) {
-          case 0x02: log("%s cancelled the trade.", trade->ign.c_str()); break;
-          case 0x07: log("Trade finished successfully!");                break;
-          default:   log("Trade ended.");                                break;
+          case 0x02: log("%s cancelled the trade.", ign_name(fsm->ign)); break;
+          case 0x07: log("Trade finished successfully!");              break;
+          default:   log("Trade ended.");                              break;
           }
-          trade->state = STATE_INACTIVE;
           break;
         }
+
+        fsm->on_trade(op, current_time_in_ms());
+        sync_timer();
         break;
       }
       case OP_RECV_PING:
+        client->last_ping_ms = current_time_in_ms();
         client->pong();
+        world.pong_us.record(read_clock_us() - client->packet_framed_us);
         break;
       case OP_RECV_PLAYER_ENTERED: {
         auto char_id = p->read4();
         if (char_id == inst->char_id)
           break;
         p->read1();
-        auto ign = p->readstr();
-        if (inst->players_seen.find(ign) == inst->players_seen.end()) {
+        auto ign = igns.intern(p->readstr_view());
+        if (!inst->players_seen.contains(igns.hash(ign))) {
           p->read1();
-          inst->players[char_id] = ign;
-          if (is_inst_selected(inst))
-            SetDlgItemText(world.wnd, IDC_PLAYERS, format_number((int)inst->players.size()).c_str());
+          inst->players.insert(char_id, ign);
+          publish_stats(inst);
         }
         break;
       }
       case OP_RECV_PLAYER_EXITED: {
         auto char_id = p->read4();
-        auto it = inst->players.find(char_id);
-        if (it != inst->players.end()) {
-          auto ign = it->second;
-          if (inst->players_seen.find(ign) != inst->players_seen.end()) {
+        auto player = inst->players.find(char_id);
+        if (player != NULL) {
+          if (inst->players_seen.contains(igns.hash(player->ign))) {
             inst->players.erase(char_id);
-            if (is_inst_selected(inst))
-              SetDlgItemText(world.wnd, IDC_PLAYERS, format_number((int)inst->players.size()).c_str());
+            publish_stats(inst);
           }
         }
         break;
       }
       }
-    }
-
-    auto has_time_elapsed = [&](u32 ms) -> bool {
-      return (current_time_in_ms() - trade->last_activity > ms);
-    };
-
-    auto cancel_trade_if_time_elapsed = [&](u32 ms) {
-      if (has_time_elapsed(ms)) {
-        log("Player was unresponsive for %ds, cancelling trade.", ms / 1000);
-        trade->state = STATE_INACTIVE;
-        client->cancel_trade(); 
+      auto handle_end = read_clock_ns();
+      probe3(handler_end, inst, (u32)instid, opcode, opcode, ns, handle_end - handle_start);
+      world.handler_ns.record(handle_end - handle_start);
+      trace_span("handle", handle_start, handle_end, opcode);
+
+      // once per connection: a format we misread tends to repeat.
+      if (p->overrun && !dumped_overrun) {
+        log_error("Packet 0x%04x was shorter than we read it as, keeping the last packets.", opcode);
+        dump_flight(inst, "parse_error");
+        dumped_overrun = true;
       }
-    };
-
-    // make a decision based on current state of trade.
-    switch (trade->state) {
-    case STATE_INACTIVE: {
-      if (inst->players.size() > 0) {
-        auto it = std::next(std::begin(inst->players), rand() % inst->players.size());
-
-        trade->state = STATE_INITIATED;
-        trade->char_id = it->first;
-        trade->ign = it->second;
-        trade->last_activity = current_time_in_ms();
+    }
 
-        log("---");
-        log("Initiating trade with %s.", trade->ign.c_str());
-        client->initiate_trade(trade->char_id);
+    if (!client->connected)
+      break;
 
-        inst->players.erase(it);
-      }
+    // watchdog: a server that stopped talking without closing the connection.
+    now = read_clock_ms();
+    auto silent_ms = ms_since(client->last_bytes(), now);
+    if (silent_ms >= inst->silence_timeout_ms) {
+      log_error("Server silent for %llus, dropping the connection.", silent_ms / 1000);
       break;
     }
-    case STATE_INITIATED: // waiting for acceptance
-      cancel_trade_if_time_elapsed(15000);
+    auto unpinged_ms = ms_since(client->last_ping_ms, now);
+    if (unpinged_ms >= inst->ping_timeout_ms) {
+      log_error("No ping for %llus, dropping the connection.", unpinged_ms / 1000);
       break;
-    case STATE_PLAYER_JOINED: // waiting for offer
-      cancel_trade_if_time_elapsed(20000);
-      break;
-    case STATE_PLAYER_MADE_OFFER: // waiting for submission
-      cancel_trade_if_time_elapsed(30000);
-      break;
-    case STATE_PLAYER_ACCEPTED: // waiting for server
-      cancel_trade_if_time_elapsed(10000);
     }
+
+    // the server isn't draining what we send; stop reading until it does.
+    if (client->congested() && !co_await client->drain())
+      break;
+
+    initiate_next_trade();
+
+    if (current_time_in_ms() - inst->published_ms >= STATSEG_PUBLISH_MS)
+      publish_slot(inst);
+
+    // more is queued; let the rest of the shard run before handling it.
+    if (over_budget)
+      co_await yield_now();
   }
 
   // means client disconnected -- successful program should run forever.
-  return EXIT_FAILURE;
+  co_return EXIT_FAILURE;
+}
+
+// a fresh tape for each session (one run_inst) of a profile with `record = 1`.
+void start_recording(Inst *inst) {
+  CreateDirectoryA(TAPE_DIR, NULL);
+  SYSTEMTIME t;
+  GetLocalTime(&t);
+  char path[MAX_PATH];
+  snprintf(path, sizeof(path), TAPE_DIR "/%s-%04u%02u%02u-%02u%02u%02u.tape", inst->profile->name.c_str(),
+           t.wYear, t.wMonth, t.wDay, t.wHour, t.wMinute, t.wSecond);
+
+  auto &tape = inst->profile->tape;
+  if (!tape.create(path, &world.tape_writer)) {
+    log_inst(inst, LOG_ERROR, "Can't record to %s.", path);
+    inst->client.tape = NULL;
+    return;
+  }
+
+  string profile;
+  for (auto &[key, value] : inst->profile->config)
+    profile += key + " = " + value + "\r\n";
+  tape.add(TAPE_PROFILE, profile.data(), profile.size());
+  vector<u64> seen;
+  inst->players_seen.each([&](u64 h) { seen.push_back(h); });
+  tape.add(TAPE_SEEN, seen.data(), seen.size() * sizeof(u64));
+  tape.add(TAPE_SEED, &inst->rng.state, sizeof(inst->rng.state));
+  inst->client.tape = &tape;
+  log_inst(inst, LOG_INFO, "Recording this session to %s.", path);
+}
+
+Task<> inst_main(int instid) {
+  auto inst = world.instances.get(instid);
+  while (true) {
+    if (inst->profile->record)
+      start_recording(inst);
+    co_await run_inst(instid);
+    cancel_timer(&inst->trade.timer);
+    dump_flight(inst, "disconnect");
+    inst->profile->flight.reset();
+    inst->client.disconnect();
+    inst->profile->tape.close();
+    inst->in_game = false;
+    publish_stats(inst);
+    metrics.add(world.reconnects);
+    inst->reconnects++;
+    inst->status = "backoff";
+    publish_slot(inst);
+
+    // what led up to a drop is worth keeping, but a flapping fleet would
+    // otherwise write a trace per instance per reconnect.
+    u64 last = world.disconnect_traced_ms.load(memory_order_relaxed);
+    u64 now = current_time_in_ms();
+    if (trace_sample_every.load(memory_order_relaxed) != 0 && (last == 0 || ms_since(last, now) >= TRACE_DISCONNECT_DUMP_MS) &&
+        world.disconnect_traced_ms.compare_exchange_strong(last, now))
+      trace_dump_auto_async("disconnect");
+    if (inst->down_since == 0)
+      inst->down_since = current_time_in_ms();
+
+    // back off exponentially while logins keep failing, and jitter the delay
+    // so instances that dropped together don't all reconnect together.
+    u32 cap = BACKOFF_CAP_MS;
+    if (inst->failures < 16)
+      cap = min<u32>(cap, BACKOFF_BASE_MS << inst->failures);
+    u32 delay = cap / 2 + inst->rng.below(cap / 2 + 1);
+    inst->failures++;
+
+    log_inst(inst, LOG_INFO, "Client has disconnected, reconnecting in %.1f seconds...", delay / 1000.0);
+    co_await sleep_for(delay);
+  }
+}
+
+// writes the login latency breakdown next to the profiles, one phase per line,
+// followed by the time to recover from a dropped connection.
+void export_login_latency(ccstr path) {
+  ofstream file(path);
+  for (u32 i = 0; i < PHASE_COUNT; i++) {
+    auto line = world.login_latency[i].summary(login_phase_names[i]);
+    file << line << "\n";
+    debug_print("login %s", line.c_str());
+  }
+  auto line = world.recovery_ms.summary("recovery");
+  file << line << "\n";
+  debug_print("login %s", line.c_str());
+}
+
+// everything the registry exports besides the per-opcode packet counts.
+// runs before any instance does.
+void register_metrics() {
+  world.reconnects = metrics.counter("reconnects_total", "", "connections lost, each followed by a reconnect");
+  world.trades_initiated = metrics.counter("trades_initiated_total", "", "trade requests sent");
+  for (u32 s = 0; s < STATE_COUNT; s++) {
+    for (u32 op = 0; op < 0x20; op++) {
+      if (trade_op_name(op) == NULL)
+        continue;
+      auto labels = string("state=\"") + trade_state_names[s] + "\",op=\"" + trade_op_name(op) + "\"";
+      world.trade_events[s][op] = metrics.counter("trade_events_total", labels, "trade packets by the state they arrived in");
+    }
+  }
+  for (u32 s = 0; s < STATE_COUNT; s++)
+    world.trade_timeouts[s] = metrics.counter("trade_timeouts_total", string("state=\"") + trade_state_names[s] + "\"", "trades given up on, by state");
+
+  metrics.histogram("decrypt_ns", &decrypt_ns, "", "time to decrypt one inbound packet");
+  metrics.histogram("encrypt_ns", &encrypt_ns, "", "time to encrypt one outbound packet");
+  metrics.histogram("handler_ns", &world.handler_ns, "", "time to handle one in-game packet");
+  metrics.histogram("pong_us", &world.pong_us, "", "ping off the wire to pong queued");
+  for (u32 c = 0; c < CLASS_COUNT; c++)
+    metrics.histogram("queue_delay_us", &queue_delay_us[c], string("class=\"") + packet_class_names[c] + "\"", "packet framed to handled");
+  for (u32 i = 0; i < PHASE_COUNT; i++)
+    metrics.histogram("login_phase_ms", &world.login_latency[i], string("phase=\"") + login_phase_names[i] + "\"", "login steps");
+  metrics.histogram("recovery_ms", &world.recovery_ms, "", "connection drop to back online");
+}
+
+// periodic reports, on one of the shards.
+Task<> report_stats() {
+  while (true) {
+    co_await sleep_for(STATS_INTERVAL_MS);
+    world.reactor.print_stats(STATS_INTERVAL_MS);
+    metrics.dump(METRICS_FILE);
+    export_login_latency("login_latency.txt");
+    for (u32 i = 0; i < CLASS_COUNT; i++)
+      debug_print("queue delay (us) %s", queue_delay_us[i].summary(packet_class_names[i]).c_str());
+  }
+}
+
+// `tools trace` asks through the stats segment: a new sampling rate, or a
+// dump, whose path goes back the same way.
+Task<> serve_trace_requests() {
+  auto header = world.stats_segment.header;
+  if (header == NULL)
+    co_return;
+
+  u32 handled = header->trace_requests.load(memory_order_acquire);
+  while (true) {
+    co_await sleep_for(TRACE_POLL_MS);
+
+    u32 every = header->trace_sample_every.load(memory_order_relaxed);
+    if (every != trace_sample_every.load(memory_order_relaxed)) {
+      trace_sample_every.store(every, memory_order_relaxed);
+      debug_print("trace: sampling one in %u (0 is off)", every);
+    }
+
+    u32 requested = header->trace_requests.load(memory_order_acquire);
+    if (requested == handled)
+      continue;
+    handled = requested;
+    auto path = trace_dump_auto("request");
+    char full[MAX_PATH] = "";
+    if (!path.empty())
+      GetFullPathNameA(path.c_str(), sizeof(full), full, NULL);
+    copy_field(header->trace_path, sizeof(header->trace_path), full);
+    header->trace_dumps.store(handled, memory_order_release);
+  }
 }
 
 /* super ghetto function to read our ghetto config file, which takes the format
@@ -447,13 +857,7 @@ fangblade
 blahblah
 bitcoinlover
 */
-bool read_config_into_inst(string path, Inst *inst) {
-  ifstream file(path);
-  if (!file.is_open())
-    return false;
-
-  unordered_map<string, string> config;
-
+bool parse_config(istream &file, unordered_map<string, string> &config) {
   auto skipwhite = [&]() {
     char c = 0;
     do { c = file.get(); } while (isspace(c));
@@ -499,36 +903,179 @@ bool read_config_into_inst(string path, Inst *inst) {
     if (done)
       break;
   }
+  return true;
+}
 
-  inst->profile_file = path;
-  inst->name = config["name"];
-  inst->username = config["username"];
-  inst->password = config["password"];
-  inst->world = stoi(config["world"]);
-  inst->channel = stoi(config["channel"]);
-  inst->pic = config["pic"];
-  inst->macid = config["macid"];
-  inst->hwid =  config["hwid"];
-  inst->server_ip = config["server_ip"];
-  inst->server_port = stoi(config["server_port"]);
-  inst->beg_message = config["beg_message"];
+void apply_config(unordered_map<string, string> &config, Inst *inst) {
+  auto profile = inst->profile;
+  profile->name = config["name"];
+  profile->username = config["username"];
+  profile->password = config["password"];
+  profile->world = stoi(config["world"]);
+  profile->channel = stoi(config["channel"]);
+  profile->pic = config["pic"];
+  profile->macid = config["macid"];
+  profile->hwid =  config["hwid"];
+  profile->server_ip = config["server_ip"];
+  profile->server_port = stoi(config["server_port"]);
+  profile->beg_message = config["beg_message"];
+  profile->pipelined = (config["pipelined"] == "1");
+  inst->silence_timeout_ms = config.count("silence_timeout") ? stoi(config["silence_timeout"]) : SILENCE_TIMEOUT_MS;
+  inst->ping_timeout_ms = config.count("ping_timeout") ? stoi(config["ping_timeout"]) : PING_TIMEOUT_MS;
+
+  // the recorder sits on the inline socket path.
+  profile->record = (config["record"] == "1");
+  if (profile->record)
+    profile->pipelined = false;
+}
+
+bool read_config_into_inst(string path, Inst *inst) {
+  auto profile = inst->profile;
+  ifstream file(path, ios::binary);
+  if (!file.is_open())
+    return false;
+  if (!parse_config(file, profile->config))
+    return false;
+  profile->profile_file = path;
+  apply_config(profile->config, inst);
 
+  // the names after the blank line are served from the seen index.
+  u64 names_offset;
   if (!file.eof()) {
     // skip over blank line
     string line;
     getline(file, line);
+    names_offset = file.tellg();
+  } else {
+    // no names yet: start the section, so appended names don't read as config.
+    file.clear();
+    file.seekg(-1, ios::end);
+    bool newline = (file.get() == '\n');
+    file.close();
+    ofstream(path, ios::app | ios::binary) << (newline ? "\r\n" : "\r\n\r\n");
+    ifstream sized(path, ios::binary | ios::ate);
+    names_offset = sized.tellg();
+  }
 
-    while (!file.eof()) {
-      getline(file, line);
-      inst->players_seen.insert(line);
+  auto seen_path = "seen/" + path.substr(path.find_last_of('/') + 1);
+  inst->players_seen.open(seen_path + ".idx", path, names_offset);
+  profile->seen_journal.open(seen_path + ".journal", path, &inst->players_seen);
+
+  return true;
+}
+
+// ======
+// replay
+// ======
+
+// runs a recorded session through run_inst again, with no server: as fast as
+// it goes, as a throughput benchmark, or at the recorded pace, which also
+// reproduces the sends timers make, so every frame should match.
+//
+// usage: feeding_the_versace_fund.exe --replay <tape> [--paced] [--loops n]
+
+Task<> replay_sessions(u32 loops, bool paced, u64 *unsent) {
+  auto inst = world.instances.get(0);
+  auto &tape = inst->profile->tape;
+  auto seed = tape.find(TAPE_SEED);
+  auto seen = tape.find(TAPE_SEEN);
+
+  for (u32 i = 0; i < loops; i++) {
+    tape.rewind(paced);
+    memcpy(&inst->rng.state, seed->bytes.data(), sizeof(inst->rng.state));
+    inst->players_seen.delta.clear();
+    for (s32 at = 0; at + sizeof(u64) <= seen->bytes.size(); at += sizeof(u64)) {
+      u64 h;
+      memcpy(&h, seen->bytes.data() + at, sizeof(h));
+      inst->players_seen.insert(h);
     }
-    inst->players_seen.erase("");
+    inst->players.clear();
+
+    co_await run_inst(0);
+    cancel_timer(&inst->trade.timer);
+    inst->client.disconnect();
+    *unsent += tape.frames_unsent();
   }
+}
 
-  return true;
+int replay_main(int argc, char **argv) {
+  FILE *console;
+  if (AttachConsole(ATTACH_PARENT_PROCESS))
+    freopen_s(&console, "CONOUT$", "w", stdout);
+
+  ccstr path = NULL;
+  bool paced = false;
+  u32 loops = 1;
+  for (int i = 0; i < argc; i++) {
+    if (strcmp(argv[i], "--paced") == 0)
+      paced = true;
+    else if (strcmp(argv[i], "--loops") == 0 && i + 1 < argc)
+      loops = max(atoi(argv[++i]), 1);
+    else
+      path = argv[i];
+  }
+  if (path == NULL) {
+    debug_error("usage: --replay <tape> [--paced] [--loops n]");
+    return EXIT_FAILURE;
+  }
+
+  auto inst = add_inst();
+  auto &tape = inst->profile->tape;
+  if (!tape.load(path)) {
+    debug_error("replay: can't read %s as a recording", path);
+    return EXIT_FAILURE;
+  }
+  auto profile = tape.find(TAPE_PROFILE);
+  if (profile == NULL || tape.find(TAPE_SEEN) == NULL || tape.find(TAPE_SEED) == NULL) {
+    debug_error("replay: %s is missing its profile, seen set or seed", path);
+    return EXIT_FAILURE;
+  }
+  stringstream text(string(profile->bytes.begin(), profile->bytes.end()));
+  if (!parse_config(text, inst->profile->config)) {
+    debug_error("replay: the profile in %s doesn't parse", path);
+    return EXIT_FAILURE;
+  }
+  apply_config(inst->profile->config, inst);
+  inst->profile->pipelined = false;
+  inst->profile->record = false;
+  inst->client.tape = &tape;
+  inst->task.timers = { &inst->trade.timer };
+
+  u64 unsent = 0;
+  world.reactor.init(1);
+  world.reactor.shards[0]->spawn(replay_sessions(loops, paced, &unsent), &inst->task);
+  auto start = read_clock_us();
+  world.reactor.shards[0]->run(); // on this thread, until the replay is done
+  double took = max<u64>(read_clock_us() - start, 1) / 1e6;
+
+  auto &client = inst->client;
+  debug_print("replay: %u pass(es) over %s %s took %.3fs", loops, path, paced ? "at the recorded pace" : "as fast as possible", took);
+  debug_print("replay: %llu packets in (%.0f/s, %.2f MB/s), %llu out",
+              client.packets_in, client.packets_in / took, client.bytes_in / took / (1 << 20), client.packets_out);
+  debug_print("replay: %s", world.handler_ns.summary("handler ns").c_str());
+
+  bool matched = tape.mismatches == 0 && unsent == 0;
+  if (matched) {
+    debug_print("replay: all %llu sent frames match the recording", tape.frames_checked);
+  } else {
+    debug_error("replay: %llu of %llu sent frames differ, %llu recorded frames weren't sent",
+                tape.mismatches, tape.frames_checked, unsent);
+    if (tape.mismatches > 0)
+      debug_error("replay: first difference at %s", tape.first_mismatch.c_str());
+    if (!paced)
+      debug_print("replay: sends made by timers (the beg message, trade timeouts) only line up at the recorded pace");
+  }
+  return matched ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 int WINAPI WinMain(HINSTANCE inst, HINSTANCE, LPSTR, int) {
+  debug_log_start();
+  defer { debug_log_flush(); };
+  if (!probes_start())
+    debug_error("failed to register the probe provider");
+  defer { probes_stop(); };
+  register_metrics();
+
   WSADATA wsaData;
   auto err = WSAStartup(MAKEWORD(2, 2), &wsaData);
   if (err != NO_ERROR) {
@@ -537,10 +1084,15 @@ int WINAPI WinMain(HINSTANCE inst, HINSTANCE, LPSTR, int) {
   }
   defer { WSACleanup(); };
 
+  if (__argc >= 2 && strcmp(__argv[1], "--replay") == 0)
+    return replay_main(__argc - 2, __argv + 2);
+
   // =============
   // load profiles
   // =============
 
+  CreateDirectoryA("seen", NULL); // seen-player indexes and journals, one per profile
+
   WIN32_FIND_DATAA find_data;
   auto find = FindFirstFileA("profiles/*", &find_data);
   if (find == INVALID_HANDLE_VALUE)
@@ -550,38 +1102,66 @@ int WINAPI WinMain(HINSTANCE inst, HINSTANCE, LPSTR, int) {
   do {
     if (!(find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
       auto path = string("profiles/") + find_data.cFileName;
-      auto inst = world.instances + (world.n_instances++);
-      read_config_into_inst(path, inst);
-
-      if (world.n_instances >= _countof(world.instances))
-        break;
+      read_config_into_inst(path, add_inst());
     }
   } while (FindNextFileA(find, &find_data));
 
-  // ===============================
-  // create thread for each instance
-  // ===============================
+  if (world.instances.empty()) {
+    debug_error("no profiles in profiles/");
+    return EXIT_FAILURE;
+  }
 
-  vector<HANDLE> thread_handles;
+  if (world.stats_segment.create(world.instances.size())) {
+    world.stats_segment.header->count = world.instances.size();
+    world.stats_segment.header->trace_sample_every = trace_sample_every.load();
+    world.instances.each(publish_slot);
+  } else {
+    debug_error("failed to create the stats segment: %d", GetLastError());
+  }
 
-  for (u32 i = 0; i < world.n_instances; i++) {
-    auto proc = [](LPVOID p) -> DWORD {
-      int instid = (int)(intptr_t)p;
-      auto inst = world.instances + instid;
-      while (true) {
-        run_inst(instid);
-        log_inst(inst, "Client has disconnected, reconnecting in 10 seconds...");
-        Sleep(10000);
-      }
-    };
-    auto h = CreateThread(NULL, 0, proc, (LPVOID)(uintptr_t)i, 0, NULL);
-    if (h == NULL) {
-      debug_error("failed to create thread for %s", world.instances[i].username.c_str());
-      continue;
-    }
-    thread_handles.push_back(h);
+  if (!world.journal_writer.start()) {
+    debug_error("failed to start journal writer: %d", GetLastError());
+    return EXIT_FAILURE;
   }
 
+  if (!world.flight_writer.start())
+    debug_error("failed to start the flight writer, dumping packets inline: %d", GetLastError());
+
+  bool any_recording = false;
+  world.profiles.each([&](InstProfile *profile) { any_recording |= profile->record; });
+  if (any_recording && !world.tape_writer.start()) {
+    debug_error("failed to start the tape writer, not recording");
+    world.profiles.each([](InstProfile *profile) { profile->record = false; });
+  }
+
+  bool any_pipelined = false;
+  world.profiles.each([&](InstProfile *profile) { any_pipelined |= profile->pipelined; });
+  if (any_pipelined && !world.io_thread.start()) {
+    debug_error("failed to start io thread, running pipelined profiles inline");
+    world.profiles.each([](InstProfile *profile) { profile->pipelined = false; });
+  }
+
+  // ================================================
+  // run the instances as tasks on one shard per core
+  // ================================================
+
+  SYSTEM_INFO sys_info;
+  GetSystemInfo(&sys_info);
+  u32 n_shards = max<u32>(1, min<u32>(sys_info.dwNumberOfProcessors, world.instances.size()));
+  world.reactor.init(n_shards);
+
+  world.instances.each([](Inst *inst) {
+    inst->task.timers = { &inst->trade.timer };
+    inst->rng.seed(read_clock_us() ^ ((u64)inst->id << 32) ^ GetCurrentProcessId());
+    world.reactor.spawn(inst_main(inst->id), &inst->task);
+  });
+  world.reactor.shards[0]->spawn(report_stats());
+  world.reactor.shards[0]->spawn(serve_metrics(METRICS_PORT));
+  world.reactor.shards[0]->spawn(serve_trace_requests());
+
+  if (!world.reactor.start())
+    return EXIT_FAILURE;
+
   // ==========
   // run window
   // ==========
@@ -589,27 +1169,55 @@ int WINAPI WinMain(HINSTANCE inst, HINSTANCE, LPSTR, int) {
   auto window_cb = [](HWND wnd, UINT msg, WPARAM wparam, LPARAM lparam) -> INT_PTR {
     static HFONT font;
 
-    auto fill_account_details = [](HWND wnd, Inst *inst) {
-      SetDlgItemText(wnd, IDC_ACCOUNT_NAME, inst->name.c_str());
+    static Inst *shown_inst;
+    static u64 shown_first, shown_end; // lines of shown_inst->profile->logs in the list box
+
+    // the list box holds no strings, just a count; rows are drawn from the
+    // ring on WM_DRAWITEM, so only the visible ones are ever touched.
+    auto refresh_logs = [](HWND wnd, Inst *inst) {
+      u64 first = inst->profile->logs.first();
+      u64 end = inst->profile->logs.end();
+      if (inst == shown_inst && first == shown_first && end == shown_end)
+        return;
+      shown_inst = inst;
+      shown_first = first;
+      shown_end = end;
+
+      auto lb = GetDlgItem(wnd, IDC_LOGS);
+      SendMessage(lb, LB_SETCOUNT, (WPARAM)(end - first), 0);
+      SendMessage(lb, LB_SETCURSEL, (WPARAM)(end - first) - 1, 0);
+      InvalidateRect(lb, NULL, FALSE);
+    };
 
-      if (inst->in_game) { 
-        if (inst->mesos == 0)
+    static Inst *stats_inst;
+    static InstStats shown_stats;
+
+    // redraws the labels from the instance's latest snapshot, if it changed.
+    auto refresh_stats = [](HWND wnd, Inst *inst) {
+      auto stats = inst->profile->stats.load();
+      if (inst == stats_inst && memcmp(&stats, &shown_stats, sizeof(stats)) == 0)
+        return;
+      stats_inst = inst;
+      shown_stats = stats;
+
+      if (stats.in_game) {
+        if (stats.mesos == 0)
           SetDlgItemText(wnd, IDC_MESOS, "???");
         else
-          SetDlgItemText(wnd, IDC_MESOS, format_number(inst->mesos).c_str());
-        SetDlgItemText(wnd, IDC_IGN, (inst->ign == "" ? "???" : inst->ign.c_str()));
-        SetDlgItemText(wnd, IDC_PLAYERS, format_number((int)inst->players.size()).c_str());
+          SetDlgItemText(wnd, IDC_MESOS, format_number(stats.mesos).c_str());
+        SetDlgItemText(wnd, IDC_IGN, (stats.ign[0] == '\0' ? "???" : stats.ign));
+        SetDlgItemText(wnd, IDC_PLAYERS, format_number((int)stats.players).c_str());
       } else {
         SetDlgItemText(wnd, IDC_MESOS, "???");
         SetDlgItemText(wnd, IDC_IGN, "???");
         SetDlgItemText(wnd, IDC_PLAYERS, "???");
       }
+    };
 
-      auto lb = GetDlgItem(wnd, IDC_LOGS);
-      SendMessage(lb, LB_RESETCONTENT, 0, 0);
-      for (auto it : inst->logs)
-        SendMessage(lb, LB_ADDSTRING, 0, (LPARAM)it.c_str());
-      SendMessage(lb, LB_SETCURSEL, inst->logs.size() - 1, 0);
+    auto fill_account_details = [&](HWND wnd, Inst *inst) {
+      SetDlgItemText(wnd, IDC_ACCOUNT_NAME, inst->profile->name.c_str());
+      refresh_stats(wnd, inst);
+      refresh_logs(wnd, inst);
     };
 
     switch (msg) {
@@ -622,32 +1230,58 @@ int WINAPI WinMain(HINSTANCE inst, HINSTANCE, LPSTR, int) {
         break;
       }
       SendMessage(GetDlgItem(wnd, IDC_LOGS), WM_SETFONT, (WPARAM)font, TRUE);
+      SendMessage(GetDlgItem(wnd, IDC_LOGS), LB_SETITEMHEIGHT, 0, LOG_ROW_HEIGHT);
 
       auto cbox = GetDlgItem(wnd, IDC_ACCOUNTS);
-      for (u32 i = 0; i < world.n_instances; i++)
-        ComboBox_AddString(cbox, world.instances[i].name.c_str());
+      world.profiles.each([&](InstProfile *profile) { ComboBox_AddString(cbox, profile->name.c_str()); });
       ComboBox_SetCurSel(cbox, 0);
-      fill_account_details(wnd, world.instances + 0);
+      fill_account_details(wnd, world.instances.get(0));
+      SetTimer(wnd, UI_TIMER, UI_REFRESH_MS, NULL);
+      break;
+    }
+    case WM_TIMER:
+      if (wparam == UI_TIMER) {
+        auto inst = world.instances.get(ComboBox_GetCurSel(GetDlgItem(wnd, IDC_ACCOUNTS)));
+        refresh_stats(wnd, inst);
+        refresh_logs(wnd, inst);
+      }
       break;
+    case WM_DRAWITEM: {
+      auto item = (DRAWITEMSTRUCT*)lparam;
+      if (item->CtlID != IDC_LOGS || item->itemID == (UINT)-1 || shown_inst == NULL)
+        break;
+
+      char line[LOG_LINE_LEN + 1];
+      if (!shown_inst->profile->logs.read(shown_first + item->itemID, line, sizeof(line)))
+        line[0] = '\0'; // overwritten since the last refresh
+
+      bool selected = (item->itemState & ODS_SELECTED) != 0;
+      SetBkColor(item->hDC, GetSysColor(selected ? COLOR_HIGHLIGHT : COLOR_WINDOW));
+      SetTextColor(item->hDC, GetSysColor(selected ? COLOR_HIGHLIGHTTEXT : COLOR_WINDOWTEXT));
+      SelectObject(item->hDC, font);
+      ExtTextOut(item->hDC, item->rcItem.left + 2, item->rcItem.top, ETO_OPAQUE | ETO_CLIPPED, &item->rcItem, line, (UINT)strlen(line), NULL);
+      return TRUE;
     }
     case WM_COMMAND:
       switch (LOWORD(wparam)) {
       case IDC_CLEARLOGS: {
-        auto inst = world.instances + ComboBox_GetCurSel(GetDlgItem(wnd, IDC_ACCOUNTS));
-        inst->logs.clear();
-        SendMessage(GetDlgItem(wnd, IDC_LOGS), LB_RESETCONTENT, 0, 0);
+        auto inst = world.instances.get(ComboBox_GetCurSel(GetDlgItem(wnd, IDC_ACCOUNTS)));
+        inst->profile->logs.clear();
+        refresh_logs(wnd, inst);
         break;
       }
       case IDC_ACCOUNTS:
         switch (HIWORD(wparam)) {
         case CBN_SELCHANGE:
-          fill_account_details(wnd, world.instances + ComboBox_GetCurSel((HWND)lparam));
+          fill_account_details(wnd, world.instances.get(ComboBox_GetCurSel((HWND)lparam)));
           break;
         }
         break;
       }
       break;
     case WM_CLOSE:
+      KillTimer(wnd, UI_TIMER);
+      world.tape_writer.shutdown(); // up to TAPE_GROUP_MS of records are still in memory
       if (font != NULL)
         DeleteObject(font);
       EndDialog(wnd, EXIT_SUCCESS);
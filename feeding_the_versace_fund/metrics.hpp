@@ -0,0 +1,177 @@
+#pragma once
+
+#include <windows.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <fstream>
+
+#include "core.hpp"
+#include "histogram.hpp"
+
+using namespace std;
+
+// counters and histograms for graphing a running fleet, exported in the
+// prometheus text format.
+//
+// counters are sharded per thread: each thread bumps its own copy with a
+// plain load and store (it's the only writer), and a scrape sums the copies.
+// histograms are the shared atomic Histogram, registered by pointer.
+
+#define METRIC_PREFIX "versace_"
+#define METRIC_OPCODES 0x200 // higher opcodes are counted in the last slot
+#define METRIC_COUNTERS 512  // registered counters, all shards
+
+enum Direction {
+  DIR_RECV,
+  DIR_SEND,
+  DIR_COUNT,
+};
+
+inline ccstr direction_names[DIR_COUNT] = { "recv", "send" };
+
+struct MetricShard {
+  atomic<u64> packets[DIR_COUNT][METRIC_OPCODES] = {};
+  atomic<u64> bytes[DIR_COUNT][METRIC_OPCODES] = {};
+  atomic<u64> counters[METRIC_COUNTERS] = {};
+};
+
+struct MetricDesc {
+  string name;   // without prefix
+  string labels; // `key="value",...`, may be empty
+  string help;
+};
+
+struct Metrics {
+  SRWLOCK lock = SRWLOCK_INIT;
+  vector<MetricShard*> shards; // never freed, like the threads that own them
+  vector<MetricDesc> counters;
+  vector<pair<MetricDesc, Histogram*>> histograms;
+
+  MetricShard *shard() {
+    static thread_local MetricShard *mine;
+    if (mine == NULL) {
+      mine = new MetricShard;
+      AcquireSRWLockExclusive(&lock);
+      shards.push_back(mine);
+      ReleaseSRWLockExclusive(&lock);
+    }
+    return mine;
+  }
+
+  // returns the counter's id. register every label set of a name one after
+  // another, so they're exported together.
+  u32 counter(ccstr name, string labels = "", ccstr help = "") {
+    AcquireSRWLockExclusive(&lock);
+    u32 id = (u32)counters.size();
+    if (id < METRIC_COUNTERS)
+      counters.push_back({ name, labels, help });
+    else
+      id = METRIC_COUNTERS - 1;
+    ReleaseSRWLockExclusive(&lock);
+    return id;
+  }
+
+  void histogram(ccstr name, Histogram *h, string labels = "", ccstr help = "") {
+    AcquireSRWLockExclusive(&lock);
+    histograms.push_back({ { name, labels, help }, h });
+    ReleaseSRWLockExclusive(&lock);
+  }
+
+  void add(u32 id, u64 n = 1) {
+    auto &c = shard()->counters[id];
+    c.store(c.load(memory_order_relaxed) + n, memory_order_relaxed);
+  }
+
+  void count_packet(Direction dir, const u8 *payload, u32 len) {
+    u32 opcode = len >= 2 ? payload[0] | (payload[1] << 8) : 0;
+    opcode = min<u32>(opcode, METRIC_OPCODES - 1);
+    auto s = shard();
+    auto &packets = s->packets[dir][opcode];
+    auto &bytes = s->bytes[dir][opcode];
+    packets.store(packets.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    bytes.store(bytes.load(memory_order_relaxed) + len, memory_order_relaxed);
+  }
+
+  string prometheus() {
+    AcquireSRWLockShared(&lock);
+    auto all = shards;
+    auto descs = counters;
+    auto hists = histograms;
+    ReleaseSRWLockShared(&lock);
+
+    stringstream ss;
+    auto type_line = [&](const string &name, ccstr type, const string &help) {
+      if (!help.empty())
+        ss << "# HELP " METRIC_PREFIX << name << " " << help << "\n";
+      ss << "# TYPE " METRIC_PREFIX << name << " " << type << "\n";
+    };
+    auto labelled = [](const string &name, const string &labels) {
+      return METRIC_PREFIX + name + (labels.empty() ? "" : "{" + labels + "}");
+    };
+
+    // per opcode, only the ones we've seen
+    ccstr opcode_metrics[2] = { "packets_total", "packet_bytes_total" };
+    for (u32 m = 0; m < 2; m++) {
+      type_line(opcode_metrics[m], "counter", m == 0 ? "packets by direction and opcode" : "payload bytes by direction and opcode");
+      for (u32 dir = 0; dir < DIR_COUNT; dir++) {
+        for (u32 op = 0; op < METRIC_OPCODES; op++) {
+          u64 sum = 0;
+          for (auto s : all)
+            sum += (m == 0 ? s->packets : s->bytes)[dir][op].load(memory_order_relaxed);
+          if (sum == 0)
+            continue;
+          char labels[64];
+          snprintf(labels, sizeof(labels), "dir=\"%s\",opcode=\"0x%04x\"", direction_names[dir], op);
+          ss << labelled(opcode_metrics[m], labels) << " " << sum << "\n";
+        }
+      }
+    }
+
+    for (u32 id = 0; id < descs.size(); id++) {
+      auto &d = descs[id];
+      if (id == 0 || descs[id - 1].name != d.name)
+        type_line(d.name, "counter", d.help);
+      u64 sum = 0;
+      for (auto s : all)
+        sum += s->counters[id].load(memory_order_relaxed);
+      ss << labelled(d.name, d.labels) << " " << sum << "\n";
+    }
+
+    // histograms as summaries: a few quantiles, the sum and the count
+    for (u32 i = 0; i < hists.size(); i++) {
+      auto &[d, h] = hists[i];
+      if (i == 0 || hists[i - 1].first.name != d.name)
+        type_line(d.name, "summary", d.help);
+      auto sep = d.labels.empty() ? "" : ",";
+      for (auto q : { 0.5, 0.9, 0.99, 1.0 })
+        ss << METRIC_PREFIX << d.name << "{" << d.labels << sep << "quantile=\"" << q << "\"} " << h->quantile(q) << "\n";
+      ss << labelled(d.name + "_sum", d.labels) << " " << h->sum.load(memory_order_relaxed) << "\n";
+      ss << labelled(d.name + "_count", d.labels) << " " << h->total.load(memory_order_relaxed) << "\n";
+    }
+    return ss.str();
+  }
+
+  // writes to a temp file and moves it into place, so a collector reading
+  // the file never sees half of it.
+  bool dump(string path) {
+    auto text = prometheus();
+    auto tmp = path + ".tmp";
+    {
+      ofstream out(tmp, ios::binary | ios::trunc);
+      if (!out.is_open())
+        return false;
+      out << text;
+      if (!out.good())
+        return false;
+    }
+    return MoveFileExA(tmp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+  }
+};
+
+inline Metrics metrics;
+
+// wire-level timings, in nanoseconds
+inline Histogram decrypt_ns;
+inline Histogram encrypt_ns;
@@ -1,9 +1,10 @@
 #pragma once
 
 #include <vector>
-#include <sstream>
 #include <string>
-#include <iomanip>
+#include <string_view>
+
+#include "hex.hpp"
 using namespace std;
 
 enum {
@@ -50,13 +51,28 @@ enum TradeOp {
   TRADE_DECLINED = 0x03,
 };
 
+inline ccstr trade_op_name(u8 op) {
+  switch (op) {
+  case TRADE_MESOS:    return "mesos";
+  case TRADE_ITEM:     return "item";
+  case TRADE_JOINED:   return "joined";
+  case TRADE_CHAT:     return "chat";
+  case TRADE_ACCEPTED: return "accepted";
+  case TRADE_ENDED:    return "ended";
+  case TRADE_DECLINED: return "declined";
+  default:             return NULL;
+  }
+}
+
 struct Packet {
   vector<u8> bytes;
   s32 i = 0;
+  bool overrun = false; // a read went past the end: the packet wasn't what we parsed it as
 
   void clear() {
     bytes.clear();
     i = 0;
+    overrun = false;
   }
 
   void add1(u8 x) {
@@ -86,8 +102,10 @@ struct Packet {
   }
 
   u8 read1() {
-    if (end())
+    if (end()) {
+      overrun = true;
       return 0;
+    }
     return bytes[i++];
   }
 
@@ -115,16 +133,29 @@ struct Packet {
     return ret;
   }
 
+  // like readstr, but points into the packet instead of copying. only valid
+  // until the packet is reused.
+  string_view readstr_view() {
+    s32 len = read2();
+    s32 left = bytes.size() - min<s32>(i, bytes.size());
+    if (len > left) {
+      overrun = true;
+      len = left;
+    }
+    string_view ret((const char*)bytes.data() + i, len);
+    i += len;
+    return ret;
+  }
+
   void skip(u32 n) {
     for (u32 i = 0; i < n; i++)
       read1();
   }
 
   void print(bool recv) {
-    stringstream ss;
-    for (auto byte : bytes)
-      ss << std::hex << std::setfill('0') << std::setw(2) << (int)byte << " ";
-    printf("[%s] %s\n", recv ? "recv" : "send", ss.str().c_str());
+    string hex(bytes.size() * 3, '\0');
+    hex.resize(hex_bytes(hex.data(), bytes.data(), bytes.size()));
+    debug_trace("[%s] %s", recv ? "recv" : "send", hex.c_str());
   }
 };
 
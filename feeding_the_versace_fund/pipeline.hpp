@@ -0,0 +1,205 @@
+#pragma once
+
+#include <winsock2.h>
+#include <windows.h>
+#include <vector>
+#include <atomic>
+
+#include "core.hpp"
+#include "crypto.hpp"
+#include "ring.hpp"
+#include "wire.hpp"
+#include "scheduler.hpp"
+#include "trace.hpp"
+
+using namespace std;
+
+// pipelined mode: one io thread owns the sockets of every pipelined
+// connection. it frames and decrypts inbound packets into a per-connection rx
+// ring and encrypts and sends whatever the protocol task pushes into the tx
+// ring, so crypto never runs on the thread that runs the handlers.
+
+#define PIPE_RING_SIZE 256
+#define PIPE_RX_BATCH 64
+
+struct IoThread;
+
+struct Pipe {
+  SpscRing<InPacket, PIPE_RING_SIZE> rx;   // decrypted packets, io -> protocol
+  SpscRing<vector<u8>, PIPE_RING_SIZE> tx; // plaintext packets, protocol -> io
+  Event rx_ready;
+  Event tx_room; // the io thread took packets from tx
+  IoThread *io = NULL;
+  atomic<bool> dead{false};    // io thread saw the connection drop
+  atomic<bool> closing{false}; // protocol side let go; io thread closes and frees
+  atomic<u64> last_bytes_ms{0}; // when the io thread last read anything
+
+  // io thread only
+  SOCKET conn = INVALID_SOCKET;
+  u16 major_version;
+  u8 iv_send[4];
+  u8 iv_recv[4];
+  InBuf inbuf;
+  vector<u8> scratch;
+  InPacket framed;
+  OutQueue out;
+
+  void detach();
+};
+
+struct IoThread {
+  Waker waker;
+  SRWLOCK lock = SRWLOCK_INIT;
+  vector<Pipe*> incoming; // guarded by lock
+  vector<Pipe*> pipes;
+  vector<WSAPOLLFD> pollfds;
+
+  bool start() {
+    if (!waker.init())
+      return false;
+    auto proc = [](LPVOID p) -> DWORD {
+      ((IoThread*)p)->run();
+      return 0;
+    };
+    return CreateThread(NULL, 0, proc, this, 0, NULL) != NULL;
+  }
+
+  void attach(Pipe *pipe) {
+    pipe->io = this;
+    AcquireSRWLockExclusive(&lock);
+    incoming.push_back(pipe);
+    ReleaseSRWLockExclusive(&lock);
+    waker.wake();
+  }
+
+  // publish first: once the protocol side sees dead with an empty ring it
+  // stops reading, so the last packets must already be visible.
+  void fail(Pipe *pipe) {
+    pipe->rx.publish();
+    pipe->dead = true;
+    pipe->rx_ready.set();
+    pipe->tx_room.set();
+  }
+
+  // each pump of a pipe is one unit of work for trace sampling.
+  void pump_tx(Pipe *pipe) {
+    trace_sample();
+    bool popped = false;
+    while (pipe->tx.pop(pipe->scratch)) {
+      popped = true;
+      if (!pipe->dead)
+        pipe->out.push(pipe->scratch.data(), (u16)pipe->scratch.size(), pipe->iv_send, pipe->major_version);
+    }
+    pipe->tx.release();
+    if (popped)
+      pipe->tx_room.set(); // for a drain() parked on a full ring
+
+    if (!pipe->dead && !pipe->out.flush(pipe->conn)) {
+      debug_error("server disconnected while we tried to send something.");
+      fail(pipe);
+    }
+  }
+
+  void pump_rx(Pipe *pipe) {
+    trace_sample();
+    for (u32 n = 0; n < PIPE_RX_BATCH && !pipe->dead && !pipe->rx.full(); ) {
+      auto &inbuf = pipe->inbuf;
+      int len = frame_length(inbuf);
+      if (len < 0) {
+        fail(pipe);
+        break;
+      }
+
+      if (len == 0) {
+        auto into = inbuf.grow(4096);
+        auto start = read_clock_ns();
+        int got = recv(pipe->conn, (char*)into, 4096, 0);
+        trace_span("recv", start, read_clock_ns(), max(got, 0));
+        inbuf.trim(4096 - max(got, 0));
+        if (got > 0) {
+          pipe->last_bytes_ms.store(read_clock_ms(), memory_order_relaxed);
+          continue;
+        }
+        if (got == 0 || WSAGetLastError() != WSAEWOULDBLOCK) {
+          debug_error("connection closed while trying to read");
+          fail(pipe);
+        }
+        break;
+      }
+
+      open_frame(pipe->framed, inbuf, len, pipe->iv_recv);
+      pipe->rx.push(pipe->framed);
+      n++;
+    }
+
+    // one publication and at most one wakeup per batch.
+    if (pipe->rx.publish())
+      pipe->rx_ready.set();
+  }
+
+  void run() {
+    trace_name_thread("io");
+    while (true) {
+      AcquireSRWLockExclusive(&lock);
+      pipes.insert(pipes.end(), incoming.begin(), incoming.end());
+      incoming.clear();
+      ReleaseSRWLockExclusive(&lock);
+
+      // send side first, so replies leave before we read more.
+      s32 kept = 0;
+      for (auto pipe : pipes) {
+        if (pipe->closing) {
+          closesocket(pipe->conn);
+          pipe->out.print_stats();
+          delete pipe;
+          continue;
+        }
+        pipes[kept++] = pipe;
+        pump_tx(pipe);
+      }
+      pipes.resize(kept);
+
+      // a connection whose rx ring is full isn't polled for input; we check
+      // back shortly instead of waiting for the protocol side to signal.
+      bool backlogged = false;
+      pollfds.resize(pipes.size() + 1);
+      pollfds[0] = { waker.sock, POLLRDNORM, 0 };
+      for (s32 i = 0; i < pipes.size(); i++) {
+        auto pipe = pipes[i];
+        short events = 0;
+        if (!pipe->rx.full())
+          events |= POLLRDNORM;
+        else
+          backlogged = true;
+        if (pipe->out.queued > 0)
+          events |= POLLWRNORM;
+        pollfds[i + 1] = { pipe->dead ? INVALID_SOCKET : pipe->conn, events, 0 };
+      }
+
+      if (WSAPoll(pollfds.data(), (ULONG)pollfds.size(), backlogged ? 1 : -1) == SOCKET_ERROR) {
+        debug_error("io thread WSAPoll failed: %d", WSAGetLastError());
+        Sleep(1);
+        continue;
+      }
+
+      if (pollfds[0].revents != 0)
+        waker.drain();
+
+      for (s32 i = 0; i < pipes.size(); i++) {
+        auto pipe = pipes[i];
+        auto revents = pollfds[i + 1].revents;
+        if (pipe->dead)
+          continue;
+        if ((revents & POLLWRNORM) && !pipe->out.flush(pipe->conn))
+          fail(pipe);
+        if (revents != 0 || backlogged)
+          pump_rx(pipe);
+      }
+    }
+  }
+};
+
+inline void Pipe::detach() {
+  closing = true;
+  io->waker.wake();
+}
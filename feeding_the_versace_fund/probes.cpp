@@ -0,0 +1,23 @@
+#include "probes.hpp"
+
+#if defined(PROBES_ETW)
+
+// the guid is the etw name hash of "Versace.Probes", so tools that take a
+// provider name (`*Versace.Probes`) find the same provider.
+TRACELOGGING_DEFINE_PROVIDER(probe_provider, "Versace.Probes",
+  (0xdf464f63, 0x5286, 0x5559, 0x58, 0x54, 0x04, 0x5d, 0x68, 0xf8, 0x26, 0xdc));
+
+bool probes_start() {
+  return SUCCEEDED(TraceLoggingRegister(probe_provider));
+}
+
+void probes_stop() {
+  TraceLoggingUnregister(probe_provider);
+}
+
+#else
+
+bool probes_start() { return true; }
+void probes_stop() {}
+
+#endif
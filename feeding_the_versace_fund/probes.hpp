@@ -0,0 +1,47 @@
+#pragma once
+
+#include "core.hpp"
+
+// static probes at the points our latency questions are about: a packet
+// framed, decrypt, the handler, trade state changes, sends queued and
+// flushed, login phases. with nothing listening a probe is one predictable
+// branch (etw) or a nop (usdt), and its arguments are plain locals.
+//
+// on windows they're tracelogging events of provider "Versace.Probes",
+// recorded with wpr (probes/versace.wprp). built against a sys/sdt.h they're
+// usdt probes of provider "versace", for bpftrace and perf (probes/*.bt).
+// anywhere else they compile away.
+//
+// probeN(name, field, value, ...): name and fields are identifiers, values
+// integers. field names only show up in etw; usdt arguments are positional.
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <TraceLoggingProvider.h>
+TRACELOGGING_DECLARE_PROVIDER(probe_provider);
+#define PROBES_ETW 1
+#elif __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBES_USDT 1
+#endif
+
+#if defined(PROBES_ETW)
+#define probe1(name, f1, v1) \
+  TraceLoggingWrite(probe_provider, #name, TraceLoggingValue(v1, #f1))
+#define probe2(name, f1, v1, f2, v2) \
+  TraceLoggingWrite(probe_provider, #name, TraceLoggingValue(v1, #f1), TraceLoggingValue(v2, #f2))
+#define probe3(name, f1, v1, f2, v2, f3, v3) \
+  TraceLoggingWrite(probe_provider, #name, TraceLoggingValue(v1, #f1), TraceLoggingValue(v2, #f2), TraceLoggingValue(v3, #f3))
+#elif defined(PROBES_USDT)
+#define probe1(name, f1, v1) DTRACE_PROBE1(versace, name, v1)
+#define probe2(name, f1, v1, f2, v2) DTRACE_PROBE2(versace, name, v1, v2)
+#define probe3(name, f1, v1, f2, v2, f3, v3) DTRACE_PROBE3(versace, name, v1, v2, v3)
+#else
+#define probe1(name, f1, v1) ((void)0)
+#define probe2(name, f1, v1, f2, v2) ((void)0)
+#define probe3(name, f1, v1, f2, v2, f3, v3) ((void)0)
+#endif
+
+// registers the etw provider; events written before are dropped.
+bool probes_start();
+void probes_stop();
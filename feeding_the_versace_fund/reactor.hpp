@@ -0,0 +1,82 @@
+#pragma once
+
+#include <windows.h>
+#include <vector>
+#include <atomic>
+
+#include "core.hpp"
+#include "task.hpp"
+#include "scheduler.hpp"
+
+using namespace std;
+
+// N schedulers, one thread each, pinned to cores. tasks are dealt out
+// round-robin; from then on idle shards steal ready tasks from busy ones (see
+// Scheduler::try_steal), so a shard that ends up with the chatty maps doesn't
+// become the bottleneck.
+struct Reactor {
+  vector<Scheduler*> shards;
+  atomic<int> live{0};
+  u32 next_shard = 0;
+  vector<HANDLE> threads;
+  vector<ShardStats> last_stats; // as of the previous report
+
+  void init(u32 n) {
+    for (u32 i = 0; i < n; i++) {
+      auto shard = new Scheduler();
+      shard->id = i;
+      shard->live = &live;
+      shard->peers = &shards;
+      shards.push_back(shard);
+    }
+    last_stats.resize(n);
+  }
+
+  void spawn(Task<> task, TaskCtx *ctx = NULL) {
+    shards[next_shard++ % shards.size()]->spawn(move(task), ctx);
+  }
+
+  bool start() {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+
+    auto proc = [](LPVOID p) -> DWORD {
+      ((Scheduler*)p)->run();
+      return 0;
+    };
+    for (auto shard : shards) {
+      auto thread = CreateThread(NULL, 0, proc, shard, CREATE_SUSPENDED, NULL);
+      if (thread == NULL) {
+        debug_error("failed to create shard %u thread: %d", shard->id, GetLastError());
+        return false;
+      }
+      SetThreadAffinityMask(thread, (DWORD_PTR)1 << (shard->id % info.dwNumberOfProcessors));
+      ResumeThread(thread);
+      threads.push_back(thread);
+    }
+    return true;
+  }
+
+  // waits for every shard to run out of tasks and return.
+  void join() {
+    for (auto thread : threads) {
+      WaitForSingleObject(thread, INFINITE);
+      CloseHandle(thread);
+    }
+    threads.clear();
+  }
+
+  // counters are owned by each shard's thread; a slightly stale read is fine
+  // for a log line.
+  void print_stats(u64 interval_ms) {
+    for (auto shard : shards) {
+      auto s = shard->stats;
+      auto &last = last_stats[shard->id];
+      debug_print("shard %u: %llu resumes, %llu polls, stole %llu, gave %llu, %.1f%% busy",
+        shard->id, s.resumes - last.resumes, s.polls - last.polls,
+        s.stolen_in - last.stolen_in, s.stolen_out - last.stolen_out,
+        100.0 * (s.busy_ms - last.busy_ms) / interval_ms);
+      last = s;
+    }
+  }
+};
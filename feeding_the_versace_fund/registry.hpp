@@ -0,0 +1,73 @@
+#pragma once
+
+#include <algorithm>
+#include <new>
+#include <vector>
+
+#include "core.hpp"
+
+using namespace std;
+
+// a growable array that never moves what it holds: elements live in fixed
+// blocks of REGISTRY_BLOCK, allocated as they're needed, so a pointer handed
+// to a task stays good however many are added after it. within a block the
+// elements are contiguous, so walking all of them is a linear scan with a
+// pointer chase once per block.
+//
+// for one array per kind of data, all indexed by the same id: the instances'
+// hot connection state in one registry, their cold profiles in another. give
+// T alignas(CACHE_LINE) when neighbours are written by different threads.
+//
+// filled before the threads that use it start; add isn't synchronized.
+
+#define REGISTRY_BLOCK 64
+
+template <typename T>
+struct Registry {
+  struct Block {
+    alignas(T) u8 bytes[REGISTRY_BLOCK * sizeof(T)];
+    T *items() { return (T *)bytes; }
+  };
+
+  vector<Block *> blocks;
+  u32 count = 0;
+
+  Registry() = default;
+  Registry(const Registry &) = delete;
+  Registry &operator=(const Registry &) = delete;
+
+  ~Registry() {
+    for (u32 i = 0; i < count; i++)
+      get(i)->~T();
+    for (auto b : blocks)
+      delete b;
+  }
+
+  u32 size() { return count; }
+  bool empty() { return count == 0; }
+
+  // a new T at index size(), zeroed before it is constructed, as a static
+  // would be.
+  T *add() {
+    if (count % REGISTRY_BLOCK == 0)
+      blocks.push_back(new Block);
+    auto item = new (blocks.back()->items() + count % REGISTRY_BLOCK) T();
+    count++;
+    return item;
+  }
+
+  T *get(u32 i) {
+    return blocks[i / REGISTRY_BLOCK]->items() + i % REGISTRY_BLOCK;
+  }
+
+  // calls fn(T *) for every element, in index order, a block at a time.
+  template <typename F>
+  void each(F fn) {
+    for (u32 b = 0; b < blocks.size(); b++) {
+      auto items = blocks[b]->items();
+      u32 n = min<u32>(REGISTRY_BLOCK, count - b * REGISTRY_BLOCK);
+      for (u32 i = 0; i < n; i++)
+        fn(items + i);
+    }
+  }
+};
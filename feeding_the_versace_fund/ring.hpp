@@ -0,0 +1,84 @@
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+#include "core.hpp"
+
+using namespace std;
+
+// bounded single-producer/single-consumer ring. each side works on a private
+// index and only publishes it (publish/release) once per batch, so the shared
+// cache lines bounce once per batch instead of once per element. each side
+// also caches the other's last published index and only re-reads it when the
+// ring looks full/empty.
+//
+// push and pop swap rather than copy: the producer gets back whatever buffer
+// the consumer left in the slot, so vector payloads are recycled, not freed.
+template <typename T, u32 N>
+struct SpscRing {
+  static_assert((N & (N - 1)) == 0, "ring size must be a power of two");
+
+  alignas(CACHE_LINE) atomic<u32> head{0}; // published by the consumer
+  alignas(CACHE_LINE) atomic<u32> tail{0}; // published by the producer
+
+  // producer-private
+  alignas(CACHE_LINE) u32 local_tail = 0;
+  u32 cached_head = 0;
+
+  // consumer-private
+  alignas(CACHE_LINE) u32 local_head = 0;
+  u32 cached_tail = 0;
+
+  alignas(CACHE_LINE) T slots[N];
+
+  // producer side
+
+  bool full() {
+    if (local_tail - cached_head < N)
+      return false;
+    cached_head = head.load(memory_order_acquire);
+    return local_tail - cached_head >= N;
+  }
+
+  bool push(T &v) {
+    if (full())
+      return false;
+    swap(slots[local_tail & (N - 1)], v);
+    local_tail++;
+    return true;
+  }
+
+  // makes everything pushed so far visible to the consumer. true if anything
+  // new was published.
+  bool publish() {
+    if (tail.load(memory_order_relaxed) == local_tail)
+      return false;
+    tail.store(local_tail, memory_order_release);
+    return true;
+  }
+
+  // consumer side
+
+  bool empty() {
+    if (local_head != cached_tail)
+      return false;
+    cached_tail = tail.load(memory_order_acquire);
+    return local_head == cached_tail;
+  }
+
+  bool pop(T &v) {
+    if (empty())
+      return false;
+    swap(v, slots[local_head & (N - 1)]);
+    local_head++;
+    if (local_head - head.load(memory_order_relaxed) >= N / 4)
+      release();
+    return true;
+  }
+
+  // hands consumed slots back to the producer.
+  void release() {
+    head.store(local_head, memory_order_release);
+  }
+};
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "core.hpp"
+
+// splitmix64. small, fast and plenty random for picking trade partners and
+// jittering delays; each instance owns one, so there's no shared state to
+// contend on the way there is with rand().
+struct Rng {
+  u64 state;
+
+  void seed(u64 s) {
+    state = s;
+  }
+
+  u64 next() {
+    u64 z = (state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+  }
+
+  // uniform in [0, n). multiply-shift instead of %, the bias is below 2^-32
+  // for the sizes we deal with.
+  u32 below(u32 n) {
+    return (u32)(((next() >> 32) * n) >> 32);
+  }
+};
@@ -0,0 +1,516 @@
+#pragma once
+
+#include <winsock2.h>
+#include <stdio.h>
+#include <windows.h>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <climits>
+#include <algorithm>
+#include <utility>
+
+#include "core.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+#include "trace.hpp"
+
+using namespace std;
+
+#define NO_DEADLINE ((u64)-1)
+
+struct IoAwaiter;
+struct EventAwaiter;
+
+// wakes a thread blocked in WSAPoll from another thread: a non-blocking UDP
+// socket bound to loopback that sends to itself. wakes are coalesced until
+// the owner drains.
+struct Waker {
+  SOCKET sock = INVALID_SOCKET;
+  sockaddr_in addr;
+  atomic<bool> pending{false};
+
+  bool init() {
+    sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock == INVALID_SOCKET)
+      return false;
+
+    addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    int len = sizeof(addr);
+    if (bind(sock, (SOCKADDR*)&addr, sizeof(addr)) == SOCKET_ERROR || getsockname(sock, (SOCKADDR*)&addr, &len) == SOCKET_ERROR) {
+      closesocket(sock);
+      sock = INVALID_SOCKET;
+      return false;
+    }
+
+    u_long nonblocking = 1;
+    ioctlsocket(sock, FIONBIO, &nonblocking);
+    return true;
+  }
+
+  void wake() {
+    if (!pending.exchange(true))
+      sendto(sock, "", 1, 0, (SOCKADDR*)&addr, sizeof(addr));
+  }
+
+  void drain() {
+    pending = false;
+    char buf[64];
+    while (recv(sock, buf, sizeof(buf), 0) > 0);
+  }
+};
+
+// a flag another thread raises to resume a task parked in wait_event. the
+// waker follows the task: every wait points it at the current scheduler.
+struct Event {
+  atomic<bool> signaled{false};
+  atomic<Waker*> waker{NULL};
+
+  void set() {
+    if (!signaled.exchange(true)) {
+      auto w = waker.load();
+      if (w != NULL)
+        w->wake();
+    }
+  }
+};
+
+// per top-level task bookkeeping, so a shard can hand the task to another
+// one. a task sitting in the ready queue owns no shard state except the
+// timers listed here, which travel with it.
+struct TaskCtx {
+  vector<Timer*> timers;
+};
+
+inline thread_local TaskCtx *this_task = NULL;
+
+struct Runnable {
+  coroutine_handle<> h;
+  TaskCtx *ctx;
+};
+
+// a stolen task plus the deadlines its timers had on the victim's wheel.
+struct Migrant {
+  Runnable task;
+  vector<u64> deadlines; // parallel to task.ctx->timers, NO_DEADLINE if unarmed
+  bool stolen;
+};
+
+struct ShardStats {
+  u64 resumes;
+  u64 polls;
+  u64 stolen_in;
+  u64 stolen_out;
+  u64 busy_ms;
+};
+
+// single-threaded run loop for Tasks. coroutines park themselves on a socket
+// (wait_io), an Event (wait_event) or a deadline (sleep_for); run() resumes
+// whatever became ready, then blocks in WSAPoll until the next socket event,
+// wakeup or timer. every deadline -- io timeouts, sleeps, trade timeouts --
+// lives in the timer wheel.
+//
+// a scheduler runs alone or as one shard of a Reactor. shards only meet in the
+// steal inbox: an idle shard asks the busiest one for work, and that one hands
+// over ready tasks at the top of its next turn.
+struct Scheduler {
+  deque<Runnable> ready;
+  vector<IoAwaiter*> io_waits;
+  vector<EventAwaiter*> event_waits;
+  vector<WSAPOLLFD> pollfds;
+  TimerWheel timers;
+  Waker waker;
+  vector<pair<void (*)(void*), void*>> end_of_turn;
+
+  atomic<int> own_live{0};
+  atomic<int> *live = &own_live; // shared by every shard of a reactor
+
+  // sharding. peers is NULL when running alone.
+  u32 id = 0;
+  vector<Scheduler*> *peers = NULL;
+  atomic<u32> ready_count{0}; // published once per turn, read by idle peers
+  atomic<bool> steal_wanted{false};
+  SRWLOCK inbox_lock = SRWLOCK_INIT;
+  vector<Scheduler*> thieves; // guarded by inbox_lock
+  vector<Migrant> migrants;   // guarded by inbox_lock
+  ShardStats stats = {};
+
+  Scheduler() {
+    timers.init(read_clock_ms());
+  }
+
+  void spawn(Task<> task, TaskCtx *ctx = NULL) {
+    auto h = task.release();
+    h.promise().live = live;
+    (*live)++;
+    AcquireSRWLockExclusive(&inbox_lock);
+    migrants.push_back({ { h, ctx }, {}, false });
+    ReleaseSRWLockExclusive(&inbox_lock);
+    waker.wake();
+  }
+
+  // one-shot hook run after the ready queue drains, before blocking in poll.
+  void at_end_of_turn(void (*fn)(void*), void *ctx) {
+    end_of_turn.push_back({ fn, ctx });
+  }
+
+  void run();
+  void run_end_of_turn();
+  void poll();
+  void drop_wait(IoAwaiter *w);
+  void drop_wait(EventAwaiter *w);
+  void take_migrants();
+  void serve_thieves();
+  void try_steal();
+};
+
+inline thread_local Scheduler *this_scheduler = NULL;
+
+// arms t to fire ms from now on the calling thread's scheduler.
+inline void arm_timer(Timer *t, u32 ms) {
+  this_scheduler->timers.schedule(t, current_time_in_ms() + ms);
+}
+
+// arms t to fire at deadline (current_time_in_ms clock).
+inline void arm_timer_at(Timer *t, u64 deadline) {
+  this_scheduler->timers.schedule(t, deadline);
+}
+
+inline void cancel_timer(Timer *t) {
+  this_scheduler->timers.cancel(t);
+}
+
+// ====================
+// awaitables
+// ====================
+
+struct SleepAwaiter {
+  u64 deadline;
+  Timer timer;
+
+  bool await_ready() { return deadline <= current_time_in_ms(); }
+
+  void await_suspend(coroutine_handle<> h) {
+    auto sched = this_scheduler;
+    auto ctx = this_task;
+    timer.callback = [sched, h, ctx]() { sched->ready.push_back({ h, ctx }); };
+    sched->timers.schedule(&timer, deadline);
+  }
+
+  void await_resume() {}
+};
+
+inline SleepAwaiter sleep_for(u32 ms) {
+  return { current_time_in_ms() + ms };
+}
+
+// lets the rest of the ready queue run before this task continues.
+struct YieldAwaiter {
+  bool await_ready() { return false; }
+
+  void await_suspend(coroutine_handle<> h) {
+    this_scheduler->ready.push_back({ h, this_task });
+  }
+
+  void await_resume() {}
+};
+
+inline YieldAwaiter yield_now() {
+  return {};
+}
+
+// resumes with the poll revents of the socket, or 0 if the deadline passed.
+struct IoAwaiter {
+  SOCKET sock;
+  short events;
+  u64 deadline;
+  short revents = 0;
+  Runnable task;
+  Timer timer;
+
+  bool await_ready() { return false; }
+
+  void await_suspend(coroutine_handle<> h) {
+    auto sched = this_scheduler;
+    task = { h, this_task };
+    sched->io_waits.push_back(this);
+    if (deadline != NO_DEADLINE) {
+      // leave io_waits before resuming: the frame holding this awaiter may be
+      // gone by the next poll.
+      timer.callback = [this, sched]() {
+        sched->drop_wait(this);
+        sched->ready.push_back(task);
+      };
+      sched->timers.schedule(&timer, deadline);
+    }
+  }
+
+  short await_resume() { return revents; }
+};
+
+inline IoAwaiter wait_io(SOCKET sock, short events, u64 deadline = NO_DEADLINE) {
+  return { sock, events, deadline };
+}
+
+// resumes with true once the event is set, false if the deadline passed.
+struct EventAwaiter {
+  Event *event;
+  u64 deadline;
+  bool fired = false;
+  Runnable task;
+  Timer timer;
+
+  bool await_ready() {
+    fired = event->signaled.exchange(false);
+    return fired;
+  }
+
+  bool await_suspend(coroutine_handle<> h) {
+    auto sched = this_scheduler;
+
+    // point the setter at this shard, then look again: either the setter
+    // sees the new waker or we see its flag.
+    event->waker.store(&sched->waker);
+    if (event->signaled.exchange(false)) {
+      fired = true;
+      return false;
+    }
+
+    task = { h, this_task };
+    sched->event_waits.push_back(this);
+    if (deadline != NO_DEADLINE) {
+      timer.callback = [this, sched]() {
+        sched->drop_wait(this);
+        sched->ready.push_back(task);
+      };
+      sched->timers.schedule(&timer, deadline);
+    }
+    return true;
+  }
+
+  bool await_resume() { return fired; }
+};
+
+inline EventAwaiter wait_event(Event *event, u64 deadline = NO_DEADLINE) {
+  return { event, deadline };
+}
+
+// ====================
+// run loop
+// ====================
+
+inline void Scheduler::run() {
+  this_scheduler = this;
+  refresh_clock_ms();
+  char thread_name[32];
+  snprintf(thread_name, sizeof(thread_name), "shard %u", id);
+  trace_name_thread(thread_name);
+  if (!waker.init())
+    debug_error("failed to create scheduler waker: %d", WSAGetLastError());
+  waker.pending = false; // wakes sent before the socket existed went nowhere
+
+  while (*live > 0) {
+    auto start = current_time_in_ms();
+
+    take_migrants();
+    serve_thieves();
+
+    while (!ready.empty()) {
+      auto task = ready.front();
+      ready.pop_front();
+      this_task = task.ctx;
+      trace_on = false; // a task decides for itself whether it's sampled
+      task.h.resume();
+      stats.resumes++;
+    }
+    this_task = NULL;
+    trace_on = false;
+    run_end_of_turn();
+
+    stats.busy_ms += refresh_clock_ms() - start;
+    if (*live > 0)
+      poll();
+    run_end_of_turn(); // timer callbacks may have queued sends
+  }
+}
+
+inline void Scheduler::drop_wait(IoAwaiter *w) {
+  auto it = find(io_waits.begin(), io_waits.end(), w);
+  if (it != io_waits.end()) {
+    *it = io_waits.back();
+    io_waits.pop_back();
+  }
+}
+
+inline void Scheduler::drop_wait(EventAwaiter *w) {
+  auto it = find(event_waits.begin(), event_waits.end(), w);
+  if (it != event_waits.end()) {
+    *it = event_waits.back();
+    event_waits.pop_back();
+  }
+}
+
+inline void Scheduler::run_end_of_turn() {
+  for (s32 i = 0; i < end_of_turn.size(); i++)
+    end_of_turn[i].first(end_of_turn[i].second);
+  end_of_turn.clear();
+}
+
+inline void Scheduler::poll() {
+  ready_count = 0;
+  if (peers != NULL)
+    try_steal();
+
+  auto now = current_time_in_ms();
+  auto deadline = timers.next_deadline();
+  int timeout = -1;
+  if (deadline != NO_DEADLINE)
+    timeout = (deadline <= now) ? 0 : (int)min<u64>(deadline - now, INT_MAX);
+
+  // the waker goes last so pollfds[i] lines up with io_waits[i]. it's always
+  // polled: events, spawns and migrants all arrive through it.
+  bool poll_waker = waker.sock != INVALID_SOCKET;
+  stats.polls++;
+
+  if (io_waits.empty() && !poll_waker) {
+    if (timeout != 0)
+      Sleep(timeout < 0 ? INFINITE : (DWORD)timeout);
+  } else {
+    pollfds.resize(io_waits.size() + (poll_waker ? 1 : 0));
+    for (s32 i = 0; i < io_waits.size(); i++) {
+      pollfds[i].fd = io_waits[i]->sock;
+      pollfds[i].events = io_waits[i]->events;
+      pollfds[i].revents = 0;
+    }
+    if (poll_waker)
+      pollfds.back() = { waker.sock, POLLRDNORM, 0 };
+    if (WSAPoll(pollfds.data(), (ULONG)pollfds.size(), timeout) == SOCKET_ERROR) {
+      // hand the failure to every waiter; their next recv/send reports it.
+      debug_error("WSAPoll failed: %d", WSAGetLastError());
+      for (auto &fd : pollfds)
+        fd.revents = POLLERR;
+    }
+  }
+
+  now = refresh_clock_ms();
+
+  if (poll_waker && pollfds.back().revents != 0)
+    waker.drain();
+
+  s32 kept = 0;
+  for (auto w : event_waits) {
+    if (w->event->signaled.exchange(false)) {
+      w->fired = true;
+      timers.cancel(&w->timer);
+      ready.push_back(w->task);
+    } else {
+      event_waits[kept++] = w;
+    }
+  }
+  event_waits.resize(kept);
+
+  kept = 0;
+  for (s32 i = 0; i < io_waits.size(); i++) {
+    auto w = io_waits[i];
+    if (pollfds[i].revents != 0) {
+      w->revents = pollfds[i].revents;
+      timers.cancel(&w->timer);
+      ready.push_back(w->task);
+    } else {
+      io_waits[kept++] = w;
+    }
+  }
+  io_waits.resize(kept);
+
+  timers.advance(now);
+
+  // let idle peers see how much we're about to chew through.
+  ready_count = (u32)ready.size();
+}
+
+// ====================
+// work stealing
+// ====================
+
+// thief side, right before going idle: ask the busiest peer for work. the
+// victim answers on its next turn and wakes us through our waker.
+inline void Scheduler::try_steal() {
+  Scheduler *victim = NULL;
+  u32 most = 1; // a victim keeps at least one task for itself
+  for (auto peer : *peers) {
+    auto n = peer->ready_count.load(memory_order_relaxed);
+    if (peer != this && n > most) {
+      victim = peer;
+      most = n;
+    }
+  }
+  if (victim == NULL)
+    return;
+
+  AcquireSRWLockExclusive(&victim->inbox_lock);
+  victim->thieves.push_back(this);
+  ReleaseSRWLockExclusive(&victim->inbox_lock);
+  victim->steal_wanted = true;
+}
+
+// victim side, top of the turn: hand surplus ready tasks to whoever asked.
+// only tasks with a TaskCtx can move; their timers come off our wheel.
+inline void Scheduler::serve_thieves() {
+  if (!steal_wanted.exchange(false))
+    return;
+
+  AcquireSRWLockExclusive(&inbox_lock);
+  auto asking = move(thieves);
+  thieves.clear();
+  ReleaseSRWLockExclusive(&inbox_lock);
+
+  for (auto thief : asking) {
+    // give away half of what's queued, from the back.
+    vector<Migrant> batch;
+    s32 give = ready.size() / 2;
+    for (s32 i = ready.size(); i-- > 0 && batch.size() < give; ) {
+      auto task = ready[i];
+      if (task.ctx == NULL)
+        continue;
+
+      Migrant m = { task, {}, true };
+      for (auto t : task.ctx->timers) {
+        m.deadlines.push_back(t->armed() ? t->deadline : NO_DEADLINE);
+        timers.cancel(t);
+      }
+      batch.push_back(move(m));
+      ready.erase(ready.begin() + i);
+    }
+    if (batch.empty())
+      continue;
+
+    stats.stolen_out += batch.size();
+    AcquireSRWLockExclusive(&thief->inbox_lock);
+    for (auto &m : batch)
+      thief->migrants.push_back(move(m));
+    ReleaseSRWLockExclusive(&thief->inbox_lock);
+    thief->waker.wake();
+  }
+}
+
+// tasks handed to us by spawn() or by a victim.
+inline void Scheduler::take_migrants() {
+  AcquireSRWLockExclusive(&inbox_lock);
+  auto arrived = move(migrants);
+  migrants.clear();
+  ReleaseSRWLockExclusive(&inbox_lock);
+
+  for (auto &m : arrived) {
+    if (m.stolen) {
+      auto &owned = m.task.ctx->timers;
+      for (s32 i = 0; i < owned.size(); i++)
+        if (m.deadlines[i] != NO_DEADLINE)
+          timers.schedule(owned[i], m.deadlines[i]);
+      stats.stolen_in++;
+    }
+    ready.push_back(m.task);
+  }
+}
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <windows.h>
+#include <string>
+#include <vector>
+#include <fstream>
+
+#include "core.hpp"
+#include "flat.hpp"
+#include "interner.hpp"
+
+using namespace std;
+
+// the set of players an instance has already traded with. the names live in
+// the tail of the profile, one per line; next to it sits a binary index of
+// their hashes that is mapped read-only at startup, so a profile with a few
+// hundred thousand names loads without parsing them or allocating per name.
+//
+// index file: SeenIndexHeader, then `capacity` u64 slots of an open-addressing
+// (linear probing) table of name hashes, 0 meaning empty. the header records
+// how much of the profile it covers; names appended since then are read into
+// an in-memory delta at startup, and the index is rebuilt once that delta
+// gets big.
+//
+// membership is by 64-bit hash, so two names colliding would make one of them
+// look seen. at a million names that's about a 1 in 10^7 chance.
+
+#define SEEN_MAGIC 0x4e454553 // "SEEN"
+#define SEEN_VERSION 1
+#define SEEN_MIN_CAPACITY 1024
+
+struct SeenIndexHeader {
+  u32 magic;
+  u32 version;
+  u64 capacity;     // power of two, at most half full
+  u64 count;
+  u64 names_offset; // where the names start in the profile
+  u64 source_size;  // profile bytes covered by this index
+};
+
+struct SeenSet {
+  HANDLE file = INVALID_HANDLE_VALUE;
+  HANDLE mapping = NULL;
+  const SeenIndexHeader *header = NULL;
+  const u64 *slots = NULL;
+  FlatSet<u64> delta; // hashes seen, but not in the index yet
+
+  bool contains(u64 h) {
+    if (delta.contains(h))
+      return true;
+    if (header == NULL)
+      return false;
+    u64 mask = header->capacity - 1;
+    for (u64 i = h & mask; slots[i] != 0; i = (i + 1) & mask)
+      if (slots[i] == h)
+        return true;
+    return false;
+  }
+
+  bool contains(const string &ign) {
+    return contains(hash_ign(ign));
+  }
+
+  void insert(u64 h) {
+    if (!contains(h))
+      delta.insert(h);
+  }
+
+  void insert(const string &ign) {
+    insert(hash_ign(ign));
+  }
+
+  // every hash in the set, indexed or not.
+  template <typename F>
+  void each(F fn) {
+    if (header != NULL)
+      for (u64 i = 0; i < header->capacity; i++)
+        if (slots[i] != 0)
+          fn(slots[i]);
+    delta.each(fn);
+  }
+
+  s32 size() {
+    return (header ? header->count : 0) + delta.size();
+  }
+
+  // maps index_path, checking it against the names in profile_path (which
+  // start at names_offset). reads names the index doesn't cover into the
+  // delta, and rebuilds the index if it's missing, stale or outgrown.
+  bool open(string index_path, string profile_path, u64 names_offset) {
+    close();
+
+    ifstream profile(profile_path, ios::binary);
+    if (!profile.is_open())
+      return false;
+    profile.seekg(0, ios::end);
+    u64 profile_size = profile.tellg();
+
+    u64 covered = names_offset;
+    if (map(index_path)) {
+      if (header->magic == SEEN_MAGIC && header->version == SEEN_VERSION && header->names_offset == names_offset && header->source_size <= profile_size)
+        covered = header->source_size;
+      else
+        unmap();
+    }
+
+    // names appended since the index was written
+    profile.seekg(covered);
+    string line;
+    while (getline(profile, line)) {
+      if (!line.empty() && line.back() == '\r')
+        line.pop_back();
+      if (!line.empty())
+        insert(line);
+    }
+
+    if (header != NULL && delta.size() <= header->count / 4 + SEEN_MIN_CAPACITY / 4)
+      return true;
+
+    // fold everything into a fresh index
+    vector<u64> hashes;
+    delta.each([&](u64 h) { hashes.push_back(h); });
+    if (header != NULL)
+      for (u64 i = 0; i < header->capacity; i++)
+        if (slots[i] != 0)
+          hashes.push_back(slots[i]);
+    close();
+
+    if (!write_index(index_path, hashes, names_offset, profile_size) || !map(index_path)) {
+      debug_error("failed to write seen index %s, keeping names in memory", index_path.c_str());
+      for (auto h : hashes)
+        delta.insert(h);
+      return true;
+    }
+    return true;
+  }
+
+  void close() {
+    unmap();
+    delta.clear();
+  }
+
+  void unmap() {
+    if (header != NULL)
+      UnmapViewOfFile(header);
+    if (mapping != NULL)
+      CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE)
+      CloseHandle(file);
+    file = INVALID_HANDLE_VALUE;
+    mapping = NULL;
+    header = NULL;
+    slots = NULL;
+  }
+
+  bool map(string path) {
+    file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+      return false;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart < sizeof(SeenIndexHeader)) {
+      unmap();
+      return false;
+    }
+
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL) {
+      unmap();
+      return false;
+    }
+    header = (const SeenIndexHeader*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (header == NULL) {
+      unmap();
+      return false;
+    }
+
+    // a truncated file can't be trusted
+    if (header->capacity == 0 || (header->capacity & (header->capacity - 1)) != 0 ||
+        (u64)size.QuadPart < sizeof(SeenIndexHeader) + header->capacity * sizeof(u64)) {
+      unmap();
+      return false;
+    }
+    slots = (const u64*)(header + 1);
+    return true;
+  }
+
+  // writes to a temp file and moves it over the old index, so a crash leaves
+  // either the old index or the new one.
+  static bool write_index(string path, const vector<u64> &hashes, u64 names_offset, u64 source_size) {
+    u64 capacity = SEEN_MIN_CAPACITY;
+    while (capacity < hashes.size() * 2)
+      capacity *= 2;
+
+    vector<u64> table(capacity);
+    u64 count = 0;
+    for (auto h : hashes) {
+      u64 i = h & (capacity - 1);
+      while (table[i] != 0 && table[i] != h)
+        i = (i + 1) & (capacity - 1);
+      if (table[i] == 0)
+        count++;
+      table[i] = h;
+    }
+
+    SeenIndexHeader header = { SEEN_MAGIC, SEEN_VERSION, capacity, count, names_offset, source_size };
+    auto tmp = path + ".tmp";
+    {
+      ofstream out(tmp, ios::binary | ios::trunc);
+      if (!out.is_open())
+        return false;
+      out.write((const char*)&header, sizeof(header));
+      out.write((const char*)table.data(), table.size() * sizeof(u64));
+      if (!out.good())
+        return false;
+    }
+    return MoveFileExA(tmp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+  }
+};
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <type_traits>
+#include <string.h>
+
+#include "core.hpp"
+
+using namespace std;
+
+// one writer publishes a small struct, any number of readers take consistent
+// copies of it without a lock. the writer never waits; a reader that overlaps
+// a write just copies again. the sequence is odd while a write is underway.
+template <typename T>
+struct Seqlock {
+  static_assert(is_trivially_copyable_v<T>, "seqlock values are copied bytewise");
+
+  atomic<u32> seq{0};
+  T value{};
+
+  // writer only.
+  void store(const T &v) {
+    u32 s = seq.load(memory_order_relaxed);
+    seq.store(s + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy((void*)&value, &v, sizeof(T));
+    seq.store(s + 2, memory_order_release);
+  }
+
+  // like load, but gives up after `attempts` tries at a value mid-write. for
+  // readers in another process, where the writer may have died mid-write.
+  bool try_load(T &out, u32 attempts) {
+    for (u32 i = 0; i < attempts; i++) {
+      u32 before = seq.load(memory_order_acquire);
+      if (before & 1)
+        continue;
+      memcpy((void*)&out, (const void*)&value, sizeof(T));
+      atomic_thread_fence(memory_order_acquire);
+      if (seq.load(memory_order_relaxed) == before)
+        return true;
+    }
+    return false;
+  }
+
+  T load() {
+    T out;
+    while (true) {
+      u32 before = seq.load(memory_order_acquire);
+      if (before & 1)
+        continue;
+      memcpy((void*)&out, (const void*)&value, sizeof(T));
+      atomic_thread_fence(memory_order_acquire);
+      if (seq.load(memory_order_relaxed) == before)
+        return out;
+    }
+  }
+};
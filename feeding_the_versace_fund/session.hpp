@@ -0,0 +1,365 @@
+#pragma once
+
+#include <windows.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <fstream>
+
+#include "core.hpp"
+
+using namespace std;
+
+// a session recorded at GameClient's socket: every chunk recv returned
+// (handshake included), every encrypted frame we sent, and what's needed
+// around them to run the same session again without a server: the profile,
+// the seen set and the instance's rng state.
+//
+// recording only appends to memory: the TapeWriter thread writes it out in
+// batches, so a recorded session keeps the timing it would have had anyway.
+//
+// replay feeds the chunks back to recv_some in order and checks every frame
+// flush would have sent against the recorded ones. the tape is read into
+// memory whole; sessions are minutes, not days.
+//
+// file: TapeHeader, then records, each a TapeRecord and `len` bytes.
+// recordings hold the account's credentials (in the auth frame, under ivs
+// that are in the tape too), so treat them like the profile.
+
+#define TAPE_MAGIC 0x45504154 // "TAPE"
+#define TAPE_VERSION 1
+#define TAPE_DIR "sessions"
+#define TAPE_GROUP_MS 100 // how long the writer gathers a batch
+
+enum TapeKind : u8 {
+  TAPE_PROFILE, // the profile's config section, as text
+  TAPE_SEEN,    // the seen set's hashes, u64 each
+  TAPE_SEED,    // the instance's rng state, u64
+  TAPE_CONNECT, // "ip:port"; starts a connection
+  TAPE_KEYS,    // major version (u16), iv_send, iv_recv, once the handshake is read
+  TAPE_RECV,    // what one recv returned
+  TAPE_SEND,    // one encrypted frame, header included
+  TAPE_CLOSE,   // the connection closed, either side
+};
+
+struct TapeHeader {
+  u32 magic;
+  u32 version;
+};
+
+struct TapeRecord {
+  u8 kind;
+  u8 reserved[3];
+  u32 len;
+  u64 time_us; // since the tape was started
+};
+
+struct TapeEntry {
+  TapeKind kind;
+  u64 time_us;
+  vector<u8> bytes;
+};
+
+// a recording's file and what hasn't been written to it yet. the instance
+// appends; the writer writes, and once the tape is closed, closes the file
+// and frees this.
+struct TapeFile {
+  HANDLE file;
+  u64 start_us;       // read_clock_us when recording began; records are relative to it
+  vector<u8> pending; // guarded by TapeWriter::lock
+  bool queued;        // in TapeWriter::dirty, guarded by the lock
+  bool closed;        // the same
+  bool connected;     // between a TAPE_CONNECT and its TAPE_CLOSE, the same
+  bool failed;        // writer only
+};
+
+// group commit for recordings, like JournalWriter: appends take a lock and
+// copy, the first append of a batch wakes the thread, and the thread gathers
+// for TAPE_GROUP_MS before each write. shutdown() closes whatever is still
+// recording and waits for it to reach the disk.
+struct TapeWriter {
+  SRWLOCK lock = SRWLOCK_INIT;
+  CONDITION_VARIABLE wake = CONDITION_VARIABLE_INIT;
+  CONDITION_VARIABLE idle = CONDITION_VARIABLE_INIT;
+  vector<TapeFile*> dirty; // guarded by lock
+  vector<TapeFile*> open;  // not closed yet, guarded by lock
+  bool busy = false;       // writing a batch, guarded by lock
+  bool stopping = false;   // shut down: the tapes are closed, drop the rest
+
+  bool start() {
+    auto proc = [](LPVOID p) -> DWORD {
+      ((TapeWriter*)p)->run();
+      return 0;
+    };
+    return CreateThread(NULL, 0, proc, this, 0, NULL) != NULL;
+  }
+
+  // a new recording, so shutdown() can close it.
+  void track(TapeFile *f) {
+    AcquireSRWLockExclusive(&lock);
+    open.push_back(f);
+    ReleaseSRWLockExclusive(&lock);
+  }
+
+  // the packet path: a record header and its bytes, copied, and go.
+  void append(TapeFile *f, const TapeRecord &r, const void *bytes) {
+    AcquireSRWLockExclusive(&lock);
+    if (stopping) {
+      ReleaseSRWLockExclusive(&lock);
+      return;
+    }
+    if (r.kind == TAPE_CONNECT || r.kind == TAPE_CLOSE)
+      f->connected = r.kind == TAPE_CONNECT;
+    auto &pending = f->pending;
+    auto at = pending.size();
+    pending.resize(at + sizeof(r) + r.len);
+    memcpy(pending.data() + at, &r, sizeof(r));
+    if (r.len > 0)
+      memcpy(pending.data() + at + sizeof(r), bytes, r.len);
+    bool wake_up = mark(f);
+    ReleaseSRWLockExclusive(&lock);
+    if (wake_up)
+      WakeConditionVariable(&wake);
+  }
+
+  // the file is the writer's from here on.
+  void close(TapeFile *f) {
+    AcquireSRWLockExclusive(&lock);
+    if (stopping) { // shutdown() closed it already, and it may be gone
+      ReleaseSRWLockExclusive(&lock);
+      return;
+    }
+    open.erase(find(open.begin(), open.end(), f));
+    f->closed = true;
+    bool wake_up = mark(f);
+    ReleaseSRWLockExclusive(&lock);
+    if (wake_up)
+      WakeConditionVariable(&wake);
+  }
+
+  // on exit: ends every recording with a TAPE_CLOSE if it was mid-connection,
+  // closes it, and returns once the writer has written it all. later appends
+  // and closes are dropped.
+  void shutdown() {
+    AcquireSRWLockExclusive(&lock);
+    stopping = true;
+    for (auto f : open) {
+      if (f->connected) {
+        TapeRecord r = {};
+        r.kind = TAPE_CLOSE;
+        r.time_us = read_clock_us() - f->start_us;
+        auto at = f->pending.size();
+        f->pending.resize(at + sizeof(r));
+        memcpy(f->pending.data() + at, &r, sizeof(r));
+      }
+      f->closed = true;
+      mark(f);
+    }
+    open.clear();
+    WakeConditionVariable(&wake);
+    while (!dirty.empty() || busy)
+      SleepConditionVariableSRW(&idle, &lock, INFINITE, 0);
+    ReleaseSRWLockExclusive(&lock);
+  }
+
+  // under lock. true if the writer was idle.
+  bool mark(TapeFile *f) {
+    if (f->queued)
+      return false;
+    f->queued = true;
+    dirty.push_back(f);
+    return dirty.size() == 1;
+  }
+
+  void run() {
+    vector<TapeFile*> batch;
+    vector<u8> bytes;
+
+    while (true) {
+      AcquireSRWLockExclusive(&lock);
+      while (dirty.empty())
+        SleepConditionVariableSRW(&wake, &lock, INFINITE, 0);
+      bool gather = !stopping;
+      ReleaseSRWLockExclusive(&lock);
+
+      if (gather)
+        Sleep(TAPE_GROUP_MS);
+
+      AcquireSRWLockExclusive(&lock);
+      batch.swap(dirty);
+      busy = true;
+      ReleaseSRWLockExclusive(&lock);
+
+      for (auto f : batch) {
+        AcquireSRWLockExclusive(&lock);
+        bytes.swap(f->pending);
+        f->queued = false;
+        bool closed = f->closed;
+        ReleaseSRWLockExclusive(&lock);
+
+        DWORD wrote = 0;
+        if (!f->failed && !bytes.empty() &&
+            (!WriteFile(f->file, bytes.data(), (DWORD)bytes.size(), &wrote, NULL) || wrote != bytes.size())) {
+          debug_error("failed to write a session recording: %d", GetLastError());
+          f->failed = true; // the rest would be out of sequence anyway
+        }
+        bytes.clear();
+
+        if (closed) {
+          CloseHandle(f->file);
+          delete f;
+        }
+      }
+      batch.clear();
+
+      AcquireSRWLockExclusive(&lock);
+      busy = false;
+      if (dirty.empty())
+        WakeAllConditionVariable(&idle);
+      ReleaseSRWLockExclusive(&lock);
+    }
+  }
+};
+
+struct SessionTape {
+  // recording
+  TapeWriter *writer = NULL;
+  TapeFile *file = NULL;
+
+  // replaying
+  bool replaying = false;
+  bool paced;          // release recvs at their recorded offsets, not at once
+  vector<TapeEntry> entries;
+  s32 recv_at;         // where recv_some is in the current connection
+  s32 send_at;         // the recorded frame the next sent one is checked against
+  u64 replay_start_us;
+  u64 frames_checked = 0;
+  u64 mismatches = 0;
+  string first_mismatch;
+
+  bool recording() {
+    return file != NULL;
+  }
+
+  // the writer must be started.
+  bool create(string path, TapeWriter *writer_) {
+    auto handle = CreateFileA(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (handle == INVALID_HANDLE_VALUE)
+      return false;
+    TapeHeader header = { TAPE_MAGIC, TAPE_VERSION };
+    DWORD wrote = 0;
+    if (!WriteFile(handle, &header, sizeof(header), &wrote, NULL) || wrote != sizeof(header)) {
+      CloseHandle(handle);
+      return false;
+    }
+    writer = writer_;
+    file = new TapeFile{ handle, read_clock_us() };
+    writer->track(file);
+    return true;
+  }
+
+  void add(TapeKind kind, const void *bytes, s32 len) {
+    TapeRecord r = {};
+    r.kind = kind;
+    r.len = (u32)len;
+    r.time_us = read_clock_us() - file->start_us;
+    writer->append(file, r, bytes);
+  }
+
+  void close() {
+    if (file == NULL)
+      return;
+    writer->close(file);
+    file = NULL;
+  }
+
+  bool load(string path) {
+    ifstream in(path, ios::binary);
+    TapeHeader header;
+    if (!in.read((char*)&header, sizeof(header)) || header.magic != TAPE_MAGIC || header.version != TAPE_VERSION)
+      return false;
+
+    entries.clear();
+    TapeRecord r;
+    while (in.read((char*)&r, sizeof(r))) {
+      TapeEntry e = { (TapeKind)r.kind, r.time_us };
+      e.bytes.resize(r.len);
+      if (!in.read((char*)e.bytes.data(), r.len))
+        return false; // cut short; a recording that died mid-write
+      entries.push_back(move(e));
+    }
+    replaying = true;
+    return true;
+  }
+
+  const TapeEntry *find(TapeKind kind) {
+    for (auto &e : entries)
+      if (e.kind == kind)
+        return &e;
+    return NULL;
+  }
+
+  // back to the start, for another pass.
+  void rewind(bool paced_) {
+    paced = paced_;
+    recv_at = 0;
+    send_at = 0;
+    replay_start_us = read_clock_us();
+  }
+
+  // moves to the next recorded connection. false if there isn't one.
+  bool next_connection() {
+    while (recv_at < entries.size() && entries[recv_at].kind != TAPE_CONNECT)
+      recv_at++;
+    if (recv_at == entries.size())
+      return false;
+    recv_at++;
+    return true;
+  }
+
+  // the current connection's next recv, NULL once it closed.
+  const TapeEntry *peek_recv() {
+    for (; recv_at < entries.size(); recv_at++) {
+      auto &e = entries[recv_at];
+      if (e.kind == TAPE_RECV)
+        return &e;
+      if (e.kind == TAPE_CLOSE || e.kind == TAPE_CONNECT)
+        return NULL;
+    }
+    return NULL;
+  }
+
+  // when a recv may be handed out, on the read_clock_us clock.
+  u64 due_us(const TapeEntry &e) {
+    return paced ? replay_start_us + e.time_us : 0;
+  }
+
+  void check_send(const u8 *frame, s32 len) {
+    while (send_at < entries.size() && entries[send_at].kind != TAPE_SEND)
+      send_at++;
+
+    frames_checked++;
+    char what[128];
+    if (send_at == entries.size()) {
+      snprintf(what, sizeof(what), "frame %llu: sent, but the recording has no more", (unsigned long long)frames_checked);
+    } else {
+      auto &e = entries[send_at++];
+      if (e.bytes.size() == len && memcmp(e.bytes.data(), frame, len) == 0)
+        return;
+      snprintf(what, sizeof(what), "frame %llu: %u bytes, recorded %u bytes at %.3fs",
+               (unsigned long long)frames_checked, (u32)len, (u32)e.bytes.size(), e.time_us / 1e6);
+    }
+    if (mismatches++ == 0)
+      first_mismatch = what;
+  }
+
+  // recorded frames nothing was sent for, once the replay is over.
+  u64 frames_unsent() {
+    u64 n = 0;
+    for (s32 i = send_at; i < entries.size(); i++)
+      n += entries[i].kind == TAPE_SEND;
+    return n;
+  }
+};
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <windows.h>
+#include <stdio.h>
+
+#include "core.hpp"
+#include "seqlock.hpp"
+
+using namespace std;
+
+// a named shared-memory segment the bot publishes every instance's state
+// into, so `tools top` can watch a running bot without a debugger and
+// without going through its window. the bot only ever does a seqlock store
+// into its own memory; readers map the segment read-only.
+//
+// layout: StatsSegHeader, then `capacity` slots of Seqlock<InstSlot>. the
+// sizes in the header let a reader refuse a layout it doesn't know.
+// counters are cumulative; the reader turns them into rates.
+//
+// the header also carries the one thing a reader may write: trace control
+// for `tools trace` (sampling rate, dump requests).
+//
+// the segment is STATSEG_NAME, or STATSEG_NAME_PID if another bot in the
+// session already has that.
+
+#define STATSEG_MAGIC 0x47455353 // "SSEG"
+#define STATSEG_VERSION 3
+#define STATSEG_NAME "Local\\versace_stats"
+#define STATSEG_NAME_PID "Local\\versace_stats_%lu"
+#define STATSEG_PUBLISH_MS 250
+
+struct StatsSegHeader {
+  u32 magic;
+  u32 version;
+  u32 header_size;
+  u32 slot_size;
+  u32 capacity;
+  atomic<u32> count; // slots in use
+  u32 pid;
+  u32 reserved;
+  atomic<u32> trace_sample_every; // written by `tools trace -s`, applied by the bot
+  atomic<u32> trace_requests;     // bumped by `tools trace` to ask for a dump
+  atomic<u32> trace_dumps;        // set to trace_requests by the bot once dumped
+  char trace_path[MAX_PATH];      // the last dump; written before trace_dumps
+};
+
+struct InstSlot {
+  char name[32];
+  char ign[16];
+  char status[16]; // login phase being waited on, "online" or "backoff"
+  char trade[24];  // trade state
+  u32 mesos;
+  u32 players;     // candidates on the map
+  u32 seen;
+  u32 reconnects;
+  u64 packets_in;
+  u64 packets_out;
+  u64 bytes_in;
+  u64 bytes_out;
+  u32 inq_depth;   // packets framed but not handled
+  u32 outq_bytes;  // bytes queued but not sent
+  u64 updated_ms;  // read_clock_ms of the write; comparable across processes
+};
+
+typedef Seqlock<InstSlot> StatsSlot;
+
+inline void copy_field(char *dst, s32 cap, ccstr src) {
+  s32 len = min<s32>(strlen(src), cap - 1);
+  memcpy(dst, src, len);
+  dst[len] = '\0';
+}
+
+struct StatsSegment {
+  HANDLE mapping = NULL;
+  StatsSegHeader *header = NULL;
+  StatsSlot *slots = NULL;
+
+  static s32 bytes_for(u32 capacity) {
+    return sizeof(StatsSegHeader) + (s32)capacity * sizeof(StatsSlot);
+  }
+
+  // the bot's side.
+  bool create(u32 capacity) {
+    auto size = bytes_for(capacity);
+    mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, (DWORD)size, STATSEG_NAME);
+    if (mapping != NULL && GetLastError() == ERROR_ALREADY_EXISTS) {
+      CloseHandle(mapping);
+      char name[64];
+      snprintf(name, sizeof(name), STATSEG_NAME_PID, GetCurrentProcessId());
+      mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, (DWORD)size, name);
+    }
+    if (mapping == NULL)
+      return false;
+
+    header = (StatsSegHeader*)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    if (header == NULL) {
+      close();
+      return false;
+    }
+    slots = (StatsSlot*)(header + 1);
+    header->header_size = sizeof(StatsSegHeader);
+    header->slot_size = sizeof(StatsSlot);
+    header->capacity = capacity;
+    header->pid = GetCurrentProcessId();
+    header->version = STATSEG_VERSION;
+    atomic_thread_fence(memory_order_release);
+    header->magic = STATSEG_MAGIC; // last: readers check it first
+    return true;
+  }
+
+  // the reader's side: pid 0 means the default name. writable is for trace
+  // control only.
+  bool open(u32 pid, bool writable = false) {
+    char name[64];
+    if (pid == 0)
+      snprintf(name, sizeof(name), "%s", STATSEG_NAME);
+    else
+      snprintf(name, sizeof(name), STATSEG_NAME_PID, pid);
+
+    auto access = writable ? FILE_MAP_READ | FILE_MAP_WRITE : FILE_MAP_READ;
+    mapping = OpenFileMappingA(access, FALSE, name);
+    if (mapping == NULL)
+      return false;
+    header = (StatsSegHeader*)MapViewOfFile(mapping, access, 0, 0, 0);
+    if (header == NULL || header->magic != STATSEG_MAGIC || header->version != STATSEG_VERSION ||
+        header->header_size != sizeof(StatsSegHeader) || header->slot_size != sizeof(StatsSlot)) {
+      close();
+      return false;
+    }
+    slots = (StatsSlot*)(header + 1);
+    return true;
+  }
+
+  void close() {
+    if (header != NULL)
+      UnmapViewOfFile(header);
+    if (mapping != NULL)
+      CloseHandle(mapping);
+    header = NULL;
+    slots = NULL;
+    mapping = NULL;
+  }
+
+  StatsSlot *slot(u32 i) {
+    return (header != NULL && i < header->capacity) ? slots + i : NULL;
+  }
+};
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <utility>
+#include <atomic>
+#include <type_traits>
+
+#include "core.hpp"
+
+// Task<T> is a lazily started coroutine. co_await'ing a task runs it and hands
+// back its result; when it finishes the awaiting coroutine is resumed through
+// symmetric transfer, so deep call chains don't grow the native stack.
+//
+// top-level tasks are given to Scheduler::spawn, which detaches them: their
+// frame destroys itself on completion and drops the scheduler's live count.
+
+struct TaskPromiseBase {
+  std::coroutine_handle<> continuation;
+  std::atomic<int> *live = NULL; // set for detached tasks
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+
+    template <typename P>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+      auto &promise = h.promise();
+      if (promise.continuation)
+        return promise.continuation;
+      if (promise.live != NULL) {
+        auto live = promise.live;
+        h.destroy();
+        live->fetch_sub(1);
+      }
+      return std::noop_coroutine();
+    }
+
+    void await_resume() noexcept {}
+  };
+
+  FinalAwaiter final_suspend() noexcept { return {}; }
+  void unhandled_exception() { std::terminate(); }
+};
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase {
+  T value{};
+  void return_value(T v) { value = std::move(v); }
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase {
+  void return_void() {}
+};
+
+template <typename T = void>
+struct Task {
+  struct promise_type : TaskPromise<T> {
+    Task get_return_object() { return Task(handle::from_promise(*this)); }
+  };
+
+  using handle = std::coroutine_handle<promise_type>;
+  handle h;
+
+  explicit Task(handle h) : h(h) {}
+  Task(Task &&other) noexcept : h(std::exchange(other.h, {})) {}
+  Task(const Task &) = delete;
+  ~Task() {
+    if (h)
+      h.destroy();
+  }
+
+  handle release() { return std::exchange(h, {}); }
+
+  bool await_ready() { return false; }
+
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) {
+    h.promise().continuation = awaiting;
+    return h;
+  }
+
+  T await_resume() {
+    if constexpr (!std::is_void_v<T>)
+      return std::move(h.promise().value);
+  }
+};
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <functional>
+#include <bit>
+
+#include "core.hpp"
+
+using namespace std;
+
+// a timer is an intrusive node; it lives wherever its owner lives (an Inst,
+// an awaiter in a coroutine frame) and is linked into a wheel slot while armed.
+struct Timer {
+  Timer *prev = NULL;
+  Timer *next = NULL;
+  u64 deadline = 0;
+  u8 level = 0;
+  u8 slot = 0;
+  function<void()> callback;
+
+  bool armed() const { return next != NULL; }
+};
+
+// hierarchical timer wheel with 1ms ticks. four levels of 64 slots cover
+// 2^24 ms (~4.6 hours); anything further out parks in the last slot and is
+// re-filed when it cascades. schedule/cancel are O(1); advance only visits
+// occupied slots and cascade points, thanks to a per-level occupancy mask.
+struct TimerWheel {
+  static const u32 LEVELS = 4;
+  static const u32 SLOT_BITS = 6;
+  static const u32 SLOTS = 1 << SLOT_BITS;
+  static const u64 MAX_SPAN = (1ull << (LEVELS * SLOT_BITS)) - 1;
+
+  Timer slots[LEVELS][SLOTS];
+  u64 occupied[LEVELS] = {};
+  u64 current = 0; // next tick to process; everything before it has fired
+  u32 count = 0;
+
+  TimerWheel() {
+    for (u32 l = 0; l < LEVELS; l++)
+      for (u32 s = 0; s < SLOTS; s++)
+        slots[l][s].prev = slots[l][s].next = &slots[l][s];
+  }
+
+  void init(u64 now) {
+    current = now;
+  }
+
+  void schedule(Timer *t, u64 deadline) {
+    if (t->armed())
+      cancel(t);
+    t->deadline = deadline;
+    file(t);
+    count++;
+  }
+
+  void cancel(Timer *t) {
+    if (!t->armed())
+      return;
+    unlink(t);
+    count--;
+  }
+
+  // fires every timer with a deadline <= now, in deadline order.
+  void advance(u64 now) {
+    while (current <= now) {
+      if (count == 0) {
+        current = now + 1;
+        break;
+      }
+
+      u32 idx = current & (SLOTS - 1);
+      if (idx == 0)
+        cascade(1);
+
+      auto head = &slots[0][idx];
+      if (head->next == head) {
+        // nothing due this tick: jump to the next occupied slot or cascade point.
+        u64 ahead = occupied[0] >> idx;
+        u64 step = ahead ? countr_zero(ahead) : SLOTS - idx;
+        current = min(current + step, now + 1);
+        continue;
+      }
+
+      // detach the slot before firing so callbacks can re-arm freely; anything
+      // re-armed for "now" lands on the next tick.
+      Timer due;
+      due.next = head->next;
+      due.prev = head->prev;
+      due.next->prev = due.prev->next = &due;
+      head->next = head->prev = head;
+      occupied[0] &= ~(1ull << idx);
+      current++;
+
+      while (due.next != &due) {
+        auto t = due.next;
+        unlink(t);
+        count--;
+        if (t->callback)
+          t->callback();
+      }
+    }
+  }
+
+  // earliest moment something could be due. exact when a timer sits in the
+  // first level, otherwise the next cascade point (the caller just wakes up,
+  // cascades and asks again).
+  u64 next_deadline() {
+    if (count == 0)
+      return (u64)-1;
+
+    u32 idx = current & (SLOTS - 1);
+    if (occupied[0]) {
+      u64 ahead = occupied[0] >> idx;
+      if (ahead)
+        return current + countr_zero(ahead);
+    }
+    return (current | (SLOTS - 1)) + 1;
+  }
+
+private:
+  void file(Timer *t) {
+    u64 deadline = max(t->deadline, current);
+    u64 delta = min(deadline - current, MAX_SPAN);
+    deadline = current + delta;
+
+    u32 level = 0;
+    while (level < LEVELS - 1 && delta >= (1ull << ((level + 1) * SLOT_BITS)))
+      level++;
+
+    u32 slot = (deadline >> (level * SLOT_BITS)) & (SLOTS - 1);
+    auto head = &slots[level][slot];
+    t->level = (u8)level;
+    t->slot = (u8)slot;
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+    occupied[level] |= 1ull << slot;
+  }
+
+  void unlink(Timer *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = t->next = NULL;
+
+    auto head = &slots[t->level][t->slot];
+    if (head->next == head)
+      occupied[t->level] &= ~(1ull << t->slot);
+  }
+
+  // re-files the slot of `level` that `current` just entered into lower levels.
+  void cascade(u32 level) {
+    if (level >= LEVELS)
+      return;
+
+    u32 idx = (current >> (level * SLOT_BITS)) & (SLOTS - 1);
+    if (idx == 0)
+      cascade(level + 1);
+
+    auto head = &slots[level][idx];
+    while (head->next != head) {
+      auto t = head->next;
+      unlink(t);
+      file(t);
+    }
+  }
+};
@@ -0,0 +1,115 @@
+#include "trace.hpp"
+#include <windows.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <fstream>
+
+// rings are never freed: the threads that trace live as long as the process.
+static SRWLOCK registry_lock = SRWLOCK_INIT;
+static vector<TraceRing*> registry;
+static SRWLOCK dump_lock = SRWLOCK_INIT; // one dump at a time
+static atomic<u32> dumps{0};
+
+TraceRing *this_trace_ring() {
+  static thread_local TraceRing *mine;
+  if (mine == NULL) {
+    mine = new TraceRing;
+    mine->tid = GetCurrentThreadId();
+    snprintf(mine->name, sizeof(mine->name), "thread %u", mine->tid);
+    AcquireSRWLockExclusive(&registry_lock);
+    registry.push_back(mine);
+    ReleaseSRWLockExclusive(&registry_lock);
+  }
+  return mine;
+}
+
+void trace_name_thread(ccstr name) {
+  auto ring = this_trace_ring();
+  snprintf(ring->name, sizeof(ring->name), "%s", name);
+}
+
+// span names are literals from our own source, so they need no escaping.
+static void write_ring(ofstream &out, TraceRing *ring, u32 pid, bool &first) {
+  char line[256];
+  snprintf(line, sizeof(line), "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+           first ? "" : ",\n", pid, ring->tid, ring->name);
+  out << line;
+  first = false;
+
+  // the owner keeps writing while we read; a slot whose sequence moved under
+  // us is being overwritten and is skipped.
+  for (u32 i = 0; i < TRACE_SPANS; i++) {
+    auto &s = ring->spans[i];
+    u64 before = s.seq.load(memory_order_acquire);
+    if (before == 0 || (before & 1))
+      continue;
+    auto name = s.name;
+    auto start_ns = s.start_ns;
+    auto dur_ns = s.dur_ns;
+    auto arg = s.arg;
+    atomic_thread_fence(memory_order_acquire);
+    if (s.seq.load(memory_order_relaxed) != before)
+      continue;
+
+    snprintf(line, sizeof(line), ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"arg\":%llu}}",
+             name, pid, ring->tid, start_ns / 1000.0, dur_ns / 1000.0, (unsigned long long)arg);
+    out << line;
+  }
+}
+
+bool trace_dump(string path) {
+  AcquireSRWLockShared(&registry_lock);
+  auto rings = registry;
+  ReleaseSRWLockShared(&registry_lock);
+
+  AcquireSRWLockExclusive(&dump_lock);
+  defer { ReleaseSRWLockExclusive(&dump_lock); };
+
+  // viewers sort events by timestamp themselves, so rings go out as they are.
+  auto tmp = path + ".tmp";
+  {
+    ofstream out(tmp, ios::binary | ios::trunc);
+    if (!out.is_open())
+      return false;
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+    bool first = true;
+    u32 pid = GetCurrentProcessId();
+    for (auto ring : rings)
+      write_ring(out, ring, pid, first);
+    out << "\n]}\n";
+    if (!out.good())
+      return false;
+  }
+  return MoveFileExA(tmp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+}
+
+string trace_dump_auto(ccstr reason) {
+  CreateDirectoryA(TRACE_DIR, NULL);
+  SYSTEMTIME t;
+  GetLocalTime(&t);
+  char path[MAX_PATH];
+  snprintf(path, sizeof(path), TRACE_DIR "/trace-%04u%02u%02u-%02u%02u%02u-%lu-%u-%s.json",
+           t.wYear, t.wMonth, t.wDay, t.wHour, t.wMinute, t.wSecond,
+           GetCurrentProcessId(), (u32)++dumps, reason);
+  if (!trace_dump(path)) {
+    debug_error("trace: failed to write %s", path);
+    return "";
+  }
+  debug_print("trace: wrote %s", path);
+  return path;
+}
+
+// a dump formats every ring and writes it out, far too long for a shard
+// that other instances are waiting on.
+void trace_dump_auto_async(ccstr reason) {
+  auto proc = [](LPVOID p) -> DWORD {
+    trace_dump_auto((ccstr)p);
+    return 0;
+  };
+  auto thread = CreateThread(NULL, 0, proc, (LPVOID)reason, 0, NULL);
+  if (thread == NULL)
+    debug_error("trace: can't start a thread for the %s dump: %d", reason, GetLastError());
+  else
+    CloseHandle(thread);
+}
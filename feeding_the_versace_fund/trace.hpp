@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+
+#include "core.hpp"
+
+using namespace std;
+
+// spans along a packet's path (recv, decrypt, queue wait, handler, encrypt,
+// send), for telling where a slow reply spent its time. each thread records
+// into its own ring, overwriting the oldest spans; trace_dump writes every
+// ring out as chrome trace json, for chrome://tracing or ui.perfetto.dev.
+//
+// tracing is sampled: trace_sample() starts a unit of work (a read_packet
+// call, an io thread pump) and decides whether its spans are kept. with
+// sampling off a span costs one thread-local test.
+
+#define TRACE_SPANS 4096        // per thread; a power of two
+#define TRACE_SAMPLE_EVERY 64   // default: one unit of work in this many, 0 = off
+#define TRACE_DIR "traces"
+#define TRACE_DISCONNECT_DUMP_MS 60000 // at most one dump on disconnect this often
+
+struct TraceSpan {
+  atomic<u64> seq{0}; // 2n+1 while the ring's nth span is written here, 2n+2 after
+  ccstr name;         // a literal
+  u64 start_ns;
+  u64 dur_ns;
+  u64 arg;            // opcode, byte count, ... depending on the span
+};
+
+struct TraceRing {
+  u32 tid;
+  char name[32];
+  u64 next = 0; // owner only
+  u32 since_sample = 0;
+  TraceSpan spans[TRACE_SPANS];
+};
+
+inline atomic<u32> trace_sample_every{TRACE_SAMPLE_EVERY};
+inline thread_local bool trace_on; // the current unit of work is sampled
+
+TraceRing *this_trace_ring();
+void trace_name_thread(ccstr name);
+bool trace_dump(string path);
+string trace_dump_auto(ccstr reason); // dumps into TRACE_DIR; the path, or "" on failure
+void trace_dump_auto_async(ccstr reason); // the same from a thread of its own; reason must be a literal
+
+inline bool trace_sample() {
+  u32 every = trace_sample_every.load(memory_order_relaxed);
+  if (every == 0)
+    return trace_on = false;
+  auto ring = this_trace_ring();
+  if (++ring->since_sample < every)
+    return trace_on = false;
+  ring->since_sample = 0;
+  return trace_on = true;
+}
+
+inline void trace_span(ccstr name, u64 start_ns, u64 end_ns, u64 arg = 0) {
+  if (!trace_on)
+    return;
+  auto ring = this_trace_ring();
+  u64 n = ring->next++;
+  auto &s = ring->spans[n & (TRACE_SPANS - 1)];
+  s.seq.store(2 * n + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  s.name = name;
+  s.start_ns = start_ns;
+  s.dur_ns = end_ns > start_ns ? end_ns - start_ns : 0;
+  s.arg = arg;
+  s.seq.store(2 * n + 2, memory_order_release);
+}
+
+// a span over the rest of the enclosing scope. not across a co_await: the
+// thread may run other tasks in between.
+struct TraceScope {
+  ccstr name;
+  u64 start;
+  u64 arg;
+
+  TraceScope(ccstr name, u64 arg = 0) : name(name), start(trace_on ? read_clock_ns() : 0), arg(arg) {}
+  ~TraceScope() {
+    if (start != 0)
+      trace_span(name, start, read_clock_ns(), arg);
+  }
+};
+
+#define _trace_scope(line) trace_scope_ ## line
+#define trace_scope_at(line) _trace_scope(line)
+#define trace_scope(...) TraceScope trace_scope_at(__LINE__)(__VA_ARGS__)
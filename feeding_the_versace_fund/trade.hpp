@@ -0,0 +1,155 @@
+#pragma once
+
+#include <algorithm>
+
+#include "core.hpp"
+#include "packet.hpp"
+
+using namespace std;
+
+// the trade logic of run_inst, as a state machine with no clock, socket or
+// scheduler of its own. every call takes the time it happens at, and the
+// machine's own timeouts come back out as deadlines (next_deadline) for the
+// owner to wake it up at, through advance(). what it sends and what it wants
+// recorded goes through Io, a template parameter:
+//
+//   void initiate_trade(u32 char_id);
+//   void cancel_trade();
+//   void submit_trade();
+//   void send_trade_message(); // the beg message
+//   void state_changed(TradeState from, TradeState to);
+//   void joined();             // the partner joined: we've now seen them
+//   void timed_out(TradeState state);
+//
+// run_inst drives it from packets and a timer on its scheduler, with the
+// client behind Io. `tools tradesim` drives it from a simulated clock and a
+// model of the other side, days of trading per second.
+
+#define NO_TRADE_DEADLINE ((u64)-1)
+
+enum TradeState {
+  STATE_INACTIVE,
+  STATE_INITIATED,
+  STATE_PLAYER_JOINED,
+  STATE_PLAYER_MADE_OFFER,
+  STATE_PLAYER_ACCEPTED,
+  STATE_COUNT,
+};
+
+inline ccstr trade_state_names[STATE_COUNT] = {
+  "inactive", "initiated", "player_joined", "player_made_offer", "player_accepted",
+};
+
+struct TradeTimings {
+  // how long the other side may stay quiet in each state before we give up.
+  u32 timeout_ms[STATE_COUNT];
+  u32 beg_delay_ms; // after the player joins
+};
+
+inline const TradeTimings default_trade_timings = {
+  {
+    0,
+    15000, // initiated: waiting for acceptance
+    20000, // player_joined: waiting for offer
+    30000, // player_made_offer: waiting for submission
+    10000, // player_accepted: waiting for server
+  },
+  2000,
+};
+
+template <typename Io>
+struct TradeFsm {
+  Io *io;
+  const TradeTimings *timings = &default_trade_timings;
+  TradeState state = STATE_INACTIVE;
+  u32 char_id = 0;
+  u32 ign = 0;        // interned, 0 if none
+  u64 timeout_at = NO_TRADE_DEADLINE; // the state's timeout, from the last activity
+  u64 beg_at = NO_TRADE_DEADLINE;
+
+  bool active() { return state != STATE_INACTIVE; }
+
+  u64 next_deadline() {
+    return min(timeout_at, beg_at);
+  }
+
+  // drops the trade without telling anyone, for a connection that's gone.
+  void reset() {
+    state = STATE_INACTIVE;
+    ign = 0;
+    timeout_at = beg_at = NO_TRADE_DEADLINE;
+  }
+
+  // invites char_id. only while inactive.
+  void start(u32 char_id_, u32 ign_, u64 now) {
+    set_state(STATE_INITIATED);
+    char_id = char_id_;
+    ign = ign_;
+    touch(now);
+    io->initiate_trade(char_id);
+  }
+
+  // an OP_RECV_TRADE the owner has read the op of.
+  void on_trade(u8 op, u64 now) {
+    switch (op) {
+    case TRADE_MESOS:
+    case TRADE_ITEM:
+    case TRADE_CHAT:
+      touch(now);
+      break;
+
+    case TRADE_ACCEPTED:
+      set_state(STATE_PLAYER_ACCEPTED);
+      io->submit_trade();
+      touch(now);
+      break;
+
+    case TRADE_JOINED:
+      if (state != STATE_INITIATED)
+        break;
+      set_state(STATE_PLAYER_JOINED);
+      io->joined();
+      touch(now);
+      beg_at = now + timings->beg_delay_ms;
+      break;
+
+    case TRADE_DECLINED:
+    case TRADE_ENDED:
+      end();
+      break;
+    }
+  }
+
+  // fires whatever is due by now, earliest first.
+  void advance(u64 now) {
+    while (next_deadline() <= now) {
+      if (beg_at <= timeout_at) {
+        beg_at = NO_TRADE_DEADLINE;
+        if (state == STATE_PLAYER_JOINED) {
+          io->send_trade_message();
+          touch(now);
+        }
+      } else {
+        io->timed_out(state);
+        end();
+        io->cancel_trade();
+      }
+    }
+  }
+
+private:
+  void set_state(TradeState to) {
+    io->state_changed(state, to);
+    state = to;
+  }
+
+  // restarts the unresponsiveness timeout of the current state.
+  void touch(u64 now) {
+    timeout_at = state == STATE_INACTIVE ? NO_TRADE_DEADLINE : now + timings->timeout_ms[state];
+  }
+
+  void end() {
+    set_state(STATE_INACTIVE);
+    timeout_at = beg_at = NO_TRADE_DEADLINE;
+  }
+};
@@ -0,0 +1,270 @@
+#pragma once
+
+#include <winsock2.h>
+#include <windows.h>
+#include <vector>
+#include <deque>
+#include <algorithm>
+
+#include "core.hpp"
+#include "crypto.hpp"
+#include "packet.hpp"
+#include "histogram.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include "probes.hpp"
+
+using namespace std;
+
+// socket-level pieces shared by GameClient and the pipelined io thread:
+// framing of the inbound byte stream, the prioritized inbound queue and the
+// coalescing outbound queue.
+
+#define OUT_IOVECS 16
+#define OUT_HIGH_WATER (64 * 1024)
+#define OUT_LOW_WATER (16 * 1024)
+
+struct SendStats {
+  u64 flushes;
+  u64 syscalls;
+  u64 frames;
+  u64 bytes;
+};
+
+// received bytes, not yet framed. frames are taken from the front by moving
+// `at` past them; the taken bytes are dropped in one move by compact(),
+// before the next recv appends, rather than once per frame.
+struct InBuf {
+  vector<u8> bytes;
+  s32 at = 0;
+
+  u8 *data() { return bytes.data() + at; }
+  s32 size() { return bytes.size() - at; }
+  void consume(s32 n) { at += n; }
+
+  void compact() {
+    if (at == 0)
+      return;
+    bytes.erase(bytes.begin(), bytes.begin() + at);
+    at = 0;
+  }
+
+  void clear() {
+    bytes.clear();
+    at = 0;
+  }
+
+  // n bytes of room at the end, for a recv; give back what it didn't fill
+  // with trim().
+  u8 *grow(s32 n) {
+    compact();
+    auto have = bytes.size();
+    bytes.resize(have + n);
+    return bytes.data() + have;
+  }
+
+  void trim(s32 unused) {
+    bytes.resize(bytes.size() - unused);
+  }
+};
+
+// length of the first whole frame (header included) in buf, 0 if it hasn't
+// fully arrived yet, -1 if the header is garbage.
+inline int frame_length(InBuf &buf) {
+  if (buf.size() < 4)
+    return 0;
+  auto len = crypto::get_packet_length(buf.data());
+  if (len < 2)
+    return -1;
+  return (buf.size() >= 4 + (s32)len) ? 4 + len : 0;
+}
+
+// encrypted frames waiting for the socket. push() encrypts into a pooled
+// frame; flush() hands up to OUT_IOVECS frames to a single WSASend.
+struct OutQueue {
+  deque<vector<u8>> frames;
+  vector<vector<u8>> spare;
+  s32 offset = 0; // bytes of frames.front() already sent
+  s32 queued = 0; // unsent bytes across frames
+  SendStats stats = {};
+
+  void push(const u8 *bytes, u16 len, u8 *iv_send, u16 major_version) {
+    vector<u8> frame;
+    if (!spare.empty()) {
+      frame = move(spare.back());
+      spare.pop_back();
+    }
+    frame.resize(len + 4);
+
+    copy(bytes, bytes + len, frame.begin() + 4);
+    metrics.count_packet(DIR_SEND, bytes, len);
+    probe2(send_enqueue, opcode, (u16)(len >= 2 ? bytes[0] | (bytes[1] << 8) : 0), len, (u32)len);
+    auto start = read_clock_ns();
+    crypto::create_packet_header(frame.data(), iv_send, len, major_version);
+    crypto::encrypt(frame.data() + 4, iv_send, len);
+    auto end = read_clock_ns();
+    encrypt_ns.record(end - start);
+    trace_span("encrypt", start, end, len);
+
+    queued += len + 4;
+    frames.push_back(move(frame));
+    stats.frames++;
+  }
+
+  void clear() {
+    while (!frames.empty()) {
+      spare.push_back(move(frames.front()));
+      frames.pop_front();
+    }
+    offset = 0;
+    queued = 0;
+  }
+
+  // writes as much as the socket takes without blocking. false if the
+  // connection dropped.
+  bool flush(SOCKET conn) {
+    if (queued == 0)
+      return true;
+
+    stats.flushes++;
+    while (!frames.empty()) {
+      WSABUF bufs[OUT_IOVECS];
+      DWORD n = 0;
+      s32 off = offset;
+      for (auto it = frames.begin(); it != frames.end() && n < OUT_IOVECS; ++it, n++) {
+        bufs[n].buf = (char*)it->data() + off;
+        bufs[n].len = (ULONG)(it->size() - off);
+        off = 0;
+      }
+
+      DWORD sent = 0;
+      stats.syscalls++;
+      auto start = read_clock_ns();
+      bool failed = WSASend(conn, bufs, n, &sent, 0, NULL, NULL) == SOCKET_ERROR;
+      trace_span("send", start, read_clock_ns(), sent);
+      probe2(send_flush, bytes, (u32)sent, frames, (u32)n);
+      if (failed)
+        return WSAGetLastError() == WSAEWOULDBLOCK;
+
+      // retire fully written frames, remember where a partial one stopped.
+      stats.bytes += sent;
+      queued -= sent;
+      while (sent > 0) {
+        s32 left = frames.front().size() - offset;
+        if (sent < left) {
+          offset += sent;
+          break;
+        }
+        sent -= (DWORD)left;
+        offset = 0;
+        spare.push_back(move(frames.front()));
+        frames.pop_front();
+      }
+      if (offset != 0)
+        break; // partial write: the socket buffer is full
+    }
+    return true;
+  }
+
+  void print_stats() {
+    if (stats.flushes > 0)
+      debug_print("sent %llu bytes in %llu frames: %.2f bytes and %.2f syscalls per flush",
+        stats.bytes, stats.frames,
+        (double)stats.bytes / stats.flushes, (double)stats.syscalls / stats.flushes);
+  }
+};
+
+// ====================
+// inbound
+// ====================
+
+// inbound packets are sorted by how much a late answer costs us: a late pong
+// gets us dropped, a late trade reply times the trade out, everything else
+// can wait.
+enum PacketClass {
+  CLASS_PING,
+  CLASS_TRADE,
+  CLASS_OTHER,
+  CLASS_COUNT,
+};
+
+inline ccstr packet_class_names[CLASS_COUNT] = { "ping", "trade", "other" };
+
+// time from framing to handing the packet to the handler, per class, in
+// microseconds. shared by every connection.
+inline Histogram queue_delay_us[CLASS_COUNT];
+
+inline PacketClass classify(const vector<u8> &bytes) {
+  if (bytes.size() < 2)
+    return CLASS_OTHER;
+  switch (bytes[0] | (bytes[1] << 8)) {
+  case OP_RECV_PING:  return CLASS_PING;
+  case OP_RECV_TRADE: return CLASS_TRADE;
+  default:            return CLASS_OTHER;
+  }
+}
+
+struct InPacket {
+  vector<u8> bytes; // decrypted
+  u64 framed_us;
+  PacketClass cls;
+  u8 iv[4];         // it was decrypted with, for the flight recorder
+};
+
+// moves the first frame (len bytes, header included) out of inbuf into
+// framed, decrypted, stamped and classified.
+inline void open_frame(InPacket &framed, InBuf &inbuf, int len, u8 *iv_recv) {
+  framed.bytes.assign(inbuf.data() + 4, inbuf.data() + len);
+  inbuf.consume(len);
+  copy(iv_recv, iv_recv + 4, framed.iv);
+  auto start = read_clock_ns();
+  probe1(decrypt_begin, len, (u32)(len - 4));
+  crypto::decrypt(framed.bytes.data(), iv_recv, (u16)(len - 4));
+  auto end = read_clock_ns();
+  probe1(decrypt_end, len, (u32)(len - 4));
+  decrypt_ns.record(end - start);
+  trace_span("decrypt", start, end, len - 4);
+  metrics.count_packet(DIR_RECV, framed.bytes.data(), (u32)framed.bytes.size());
+  framed.framed_us = read_clock_us();
+  framed.cls = classify(framed.bytes);
+  probe3(packet_framed, opcode, (u16)(len >= 6 ? framed.bytes[0] | (framed.bytes[1] << 8) : 0), len, (u32)(len - 4), cls, (u32)framed.cls);
+}
+
+// decrypted packets waiting for the handler. pop() serves the most urgent
+// class first, in arrival order within a class.
+struct InQueue {
+  deque<InPacket> queues[CLASS_COUNT];
+  s32 count = 0;
+
+  // takes p's contents, leaving p empty.
+  void push(InPacket &p) {
+    auto &q = queues[p.cls];
+    q.emplace_back();
+    swap(q.back(), p);
+    count++;
+  }
+
+  bool pop(vector<u8> &bytes, u64 *framed_us = NULL, u8 *iv = NULL) {
+    for (u32 c = 0; c < CLASS_COUNT; c++) {
+      auto &q = queues[c];
+      if (q.empty())
+        continue;
+      swap(bytes, q.front().bytes);
+      if (framed_us != NULL)
+        *framed_us = q.front().framed_us;
+      if (iv != NULL)
+        copy(q.front().iv, q.front().iv + 4, iv);
+      queue_delay_us[c].record(read_clock_us() - q.front().framed_us);
+      q.pop_front();
+      count--;
+      return true;
+    }
+    return false;
+  }
+
+  void clear() {
+    for (auto &q : queues)
+      q.clear();
+    count = 0;
+  }
+};
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <iterator>
+
+#include "core.hpp"
+#include "rng.hpp"
+#include "candidates.hpp"
+#include "interner.hpp"
+#include "tools.hpp"
+
+using namespace std;
+
+// a crowded map: `crowd` players standing around, players entering and
+// leaving, and a trade target picked every `pick_every` events -- the mix
+// run_inst sees in the free market.
+
+struct MapEvent {
+  bool enter;
+  u32 char_id;
+};
+
+static vector<MapEvent> make_events(u32 crowd, u32 n, Rng &rng) {
+  vector<MapEvent> events;
+  vector<u32> present;
+  u32 next_id = 1;
+  for (u32 i = 0; i < crowd; i++) {
+    events.push_back({ true, next_id });
+    present.push_back(next_id++);
+  }
+  while (events.size() < n) {
+    if (present.size() > crowd / 2 && rng.below(2) == 0) {
+      u32 i = rng.below((u32)present.size());
+      events.push_back({ false, present[i] });
+      present[i] = present.back();
+      present.pop_back();
+    } else {
+      events.push_back({ true, next_id });
+      present.push_back(next_id++);
+    }
+  }
+  return events;
+}
+
+static string ign_for(u32 char_id) {
+  return "player" + to_string(char_id);
+}
+
+// the old container: unordered_map and a walk to the n-th node.
+static u64 run_map(const vector<MapEvent> &events, u32 pick_every, u64 &picked) {
+  unordered_map<u32, string> players;
+  auto start = read_clock_us();
+  for (s32 i = 0; i < events.size(); i++) {
+    auto &e = events[i];
+    if (e.enter)
+      players[e.char_id] = ign_for(e.char_id);
+    else
+      players.erase(e.char_id);
+
+    if (i % pick_every == 0 && !players.empty()) {
+      auto it = next(begin(players), rand() % players.size());
+      picked += it->first;
+      players.erase(it);
+    }
+  }
+  return read_clock_us() - start;
+}
+
+static u64 run_set(const vector<MapEvent> &events, u32 pick_every, u64 &picked) {
+  CandidateSet players;
+  Rng rng;
+  rng.seed(1);
+  auto start = read_clock_us();
+  for (s32 i = 0; i < events.size(); i++) {
+    auto &e = events[i];
+    if (e.enter)
+      players.insert(e.char_id, igns.intern(ign_for(e.char_id)));
+    else
+      players.erase(e.char_id);
+
+    if (i % pick_every == 0 && !players.empty())
+      picked += players.take_random(rng).char_id;
+  }
+  return read_clock_us() - start;
+}
+
+static void bench_candidates() {
+  printf("candidate set: enter/exit churn with a random pick every 4 events\n");
+  printf("%8s %10s %14s %14s %8s\n", "crowd", "events", "map us", "set us", "speedup");
+
+  u32 crowds[] = { 50, 200, 1000, 5000, 20000 };
+  for (auto crowd : crowds) {
+    Rng rng;
+    rng.seed(crowd);
+    auto events = make_events(crowd, crowd * 20, rng);
+
+    u64 sink = 0;
+    auto map_us = run_map(events, 4, sink);
+    auto set_us = run_set(events, 4, sink);
+    printf("%8u %10zu %14llu %14llu %7.1fx\n", crowd, events.size(), map_us, set_us,
+      set_us == 0 ? 0.0 : (double)map_us / set_us);
+  }
+}
+
+struct Bench {
+  const char *name;
+  void (*run)();
+};
+
+static Bench benches[] = {
+  { "candidates", bench_candidates },
+};
+
+// tools bench [name...]: runs the named benchmarks, or all of them.
+int bench_main(int argc, char **argv) {
+  for (auto &b : benches) {
+    bool wanted = (argc == 0);
+    for (int i = 0; i < argc; i++)
+      wanted |= (strcmp(argv[i], b.name) == 0);
+    if (wanted) {
+      b.run();
+      printf("\n");
+    }
+  }
+  return 0;
+}
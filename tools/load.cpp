@@ -0,0 +1,488 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <winsock2.h>
+#include <windows.h>
+#include <psapi.h>
+
+#include "core.hpp"
+#include "defer.hpp"
+#include "rng.hpp"
+#include "client.hpp"
+#include "reactor.hpp"
+#include "mock.hpp"
+#include "tools.hpp"
+
+#pragma comment(lib, "psapi.lib")
+
+using namespace std;
+
+// how many instances one host carries before pongs go out late. runs N
+// simulated clients -- GameClient, logging in and then answering pings,
+// tracking the map and trading the way run_inst does -- against an
+// in-process mock server, growing N step by step, and reports per step:
+// login throughput, cpu and working set per connection, and ping-to-pong
+// latency as the mock saw it on the wire.
+//
+// each model runs the same client code:
+//   threads: a scheduler and a thread per client, the old thread-per-Inst
+//            layout (each one blocked on its own socket).
+//   shards:  the reactor the bot runs on, a scheduler per core.
+//
+// cpu is the process's minus the mock's thread. the working set includes the
+// mock's side of each connection, a small fraction of the client's, and
+// whatever the bot keeps per thread (trace and log rings), which is part of
+// what a thread per instance costs.
+//
+// usage: tools load [-m threads|shards|both] [-N 50,100,200,400] [-k shards]
+//                   [-w settle_ms] [-t measure_s] [-n population] [-c churn_ms]
+//                   [-P ping_ms] [-r trade_every_ms] [-J join_pct] [-A accept_pct]
+//                   [-l latency_ms] [-f max_piece] [-p port]
+
+#define LOAD_LOGIN_TIMEOUT_MS 10000 // per packet of the login
+#define LOAD_POLL_MS 250            // how often a client checks for the end of the run
+#define LOAD_TRADE_TIMEOUT_MS 10000
+#define LOAD_RECONNECT_MS 1000
+#define LOAD_LOGIN_WAIT_MS 60000    // for a step's clients to all get online
+
+enum LoadModel {
+  MODEL_THREADS,
+  MODEL_SHARDS,
+  MODEL_COUNT,
+};
+
+static ccstr model_names[MODEL_COUNT] = { "threads", "shards" };
+
+struct LoadOptions {
+  bool models[MODEL_COUNT] = { true, true };
+  vector<u32> steps = { 50, 100, 200, 400 };
+  u32 shards = 0;             // 0 = one per core
+  u32 settle_ms = 2000;       // after a step's logins, before measuring
+  u32 measure_s = 10;
+  u32 trade_every_ms = 5000;  // 0 = never trade
+};
+
+// one model's run.
+struct LoadRun {
+  LoadOptions *opt;
+  MockServer *server;
+  atomic<bool> stopping{false};
+  atomic<u32> running{0};
+  atomic<u32> online{0};
+  atomic<u64> login_failures{0};
+  Histogram login_ms;         // connect to the first packet in the channel
+};
+
+struct SimClient {
+  GameClient client;
+  FlightRecorder flight; // as the bot keeps one per instance
+  LoadRun *run;
+  u32 id;
+  Rng rng;
+  Scheduler *own = NULL;      // threads model
+  HANDLE thread = NULL;
+};
+
+struct LoadRow {
+  LoadModel model;
+  u32 conns;
+  double logins_per_s;
+  u64 login_p99_ms;
+  double cpu_pct;             // of one core, per connection
+  double rss_kb;              // per connection
+  u64 pong_p50_us, pong_p99_us, pong_max_us;
+  u64 pings, missed;
+};
+
+// ====================
+// the simulated client
+// ====================
+
+// run_inst's login, with the mock's answers taken as given.
+static Task<bool> sim_login(SimClient *sim) {
+  auto client = &sim->client;
+  if (!co_await client->init("127.0.0.1", sim->run->server->opt.port))
+    co_return false;
+  client->auth("load" + to_string(sim->id), "password");
+
+  while (client->connected) {
+    auto p = co_await client->read_packet(LOAD_LOGIN_TIMEOUT_MS);
+    if (p == NULL)
+      co_return false;
+    switch (p->read2()) {
+    case OP_RECV_PING:
+      client->pong();
+      break;
+    case OP_RECV_LOGIN_STATUS:
+      if (p->read1() != LOGIN_SUCCESS)
+        co_return false;
+      client->show_world();
+      break;
+    case OP_RECV_SERVER_LIST:
+      if (p->read1() != 0xff)
+        client->select_world(0);
+      break;
+    case OP_RECV_WORLD_INFO:
+      client->select_channel(0, 0);
+      break;
+    case OP_RECV_CHAR_INFO: {
+      p->read2();
+      auto char_id = p->read4();
+      client->select_char_with_pic(char_id, "000000", "", "");
+      break;
+    }
+    case OP_RECV_SERVER_INFO: {
+      p->read2();
+      p->skip(4); // ip: the mock only hands out itself
+      auto port = p->read2();
+      auto char_id = p->read4();
+      client->disconnect();
+      if (!co_await client->init("127.0.0.1", port))
+        co_return false;
+      client->announce_logged_in(char_id);
+      co_return true;
+    }
+    }
+  }
+  co_return false;
+}
+
+// in the channel until the connection drops or the run ends. false if the
+// first packet never came.
+static Task<bool> sim_play(SimClient *sim, u64 login_start) {
+  auto client = &sim->client;
+  auto run = sim->run;
+  auto trade_every = run->opt->trade_every_ms;
+  bool online = false;
+  defer {
+    if (online)
+      run->online.fetch_sub(1, memory_order_relaxed);
+  };
+
+  vector<u32> players;
+  u32 partner = 0;
+  u64 trade_deadline = NO_DEADLINE;
+  u64 next_trade = trade_every > 0 ? current_time_in_ms() + sim->rng.below(trade_every) : NO_DEADLINE;
+  auto end_trade = [&](u64 now) {
+    partner = 0;
+    trade_deadline = NO_DEADLINE;
+    if (trade_every > 0)
+      next_trade = now + trade_every;
+  };
+
+  while (client->connected && !run->stopping.load(memory_order_relaxed)) {
+    auto p = co_await client->read_packet(LOAD_POLL_MS);
+    auto now = current_time_in_ms();
+    if (p != NULL) {
+      if (!online) {
+        online = true;
+        run->online.fetch_add(1, memory_order_relaxed);
+        run->login_ms.record(now - login_start);
+      }
+      switch (p->read2()) {
+      case OP_RECV_PING:
+        client->last_ping_ms = now;
+        client->pong();
+        break;
+      case OP_RECV_PLAYER_ENTERED:
+        players.push_back(p->read4());
+        break;
+      case OP_RECV_PLAYER_EXITED: {
+        auto it = find(players.begin(), players.end(), p->read4());
+        if (it != players.end()) {
+          *it = players.back();
+          players.pop_back();
+        }
+        break;
+      }
+      case OP_RECV_TRADE:
+        switch (p->read1()) {
+        case TRADE_JOINED:   client->send_trade_message("hi"); break;
+        case TRADE_ACCEPTED: client->submit_trade();           break;
+        case TRADE_DECLINED:
+        case TRADE_ENDED:    end_trade(now);                   break;
+        }
+        break;
+      }
+    }
+
+    if (partner == 0 && now >= next_trade && !players.empty()) {
+      u32 i = sim->rng.below((u32)players.size());
+      partner = players[i];
+      players[i] = players.back();
+      players.pop_back();
+      trade_deadline = now + LOAD_TRADE_TIMEOUT_MS;
+      client->initiate_trade(partner);
+    } else if (partner != 0 && now >= trade_deadline) {
+      client->cancel_trade();
+      end_trade(now);
+    }
+  }
+  co_return online;
+}
+
+static Task<> sim_main(SimClient *sim) {
+  auto run = sim->run;
+  defer { run->running.fetch_sub(1, memory_order_relaxed); };
+
+  while (!run->stopping.load(memory_order_relaxed)) {
+    auto start = current_time_in_ms();
+    bool ok = co_await sim_login(sim);
+    if (ok)
+      ok = co_await sim_play(sim, start);
+    sim->client.disconnect();
+    if (!ok)
+      run->login_failures.fetch_add(1, memory_order_relaxed);
+    if (!run->stopping.load(memory_order_relaxed))
+      co_await sleep_for(LOAD_RECONNECT_MS);
+  }
+}
+
+// ====================
+// measuring
+// ====================
+
+static u64 filetime_us(FILETIME t) {
+  return (((u64)t.dwHighDateTime << 32) | t.dwLowDateTime) / 10;
+}
+
+// user and kernel time of the process minus the mock's thread.
+static u64 client_cpu_us(MockServer *server) {
+  FILETIME created, exited, kernel, user;
+  if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user))
+    return 0;
+  u64 total = filetime_us(kernel) + filetime_us(user);
+  if (GetThreadTimes(server->thread, &created, &exited, &kernel, &user))
+    total -= filetime_us(kernel) + filetime_us(user);
+  return total;
+}
+
+static u64 working_set_bytes() {
+  PROCESS_MEMORY_COUNTERS pmc = { sizeof(pmc) };
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+    return 0;
+  return pmc.WorkingSetSize;
+}
+
+static void copy_counts(Histogram &h, u64 *out) {
+  for (u32 b = 0; b < HIST_BUCKETS; b++)
+    out[b] = h.counts[b].load(memory_order_relaxed);
+}
+
+// upper edge of the bucket holding the q-th quantile of what h recorded
+// since `before` was copied from it.
+static u64 quantile_since(Histogram &h, const u64 *before, double q) {
+  u64 n = 0;
+  for (u32 b = 0; b < HIST_BUCKETS; b++)
+    n += h.counts[b].load(memory_order_relaxed) - before[b];
+  if (n == 0)
+    return 0;
+  u64 rank = max<u64>((u64)(q * n + 0.5), 1);
+  u64 seen = 0;
+  for (u32 b = 0; b < HIST_BUCKETS; b++) {
+    seen += h.counts[b].load(memory_order_relaxed) - before[b];
+    if (seen >= rank)
+      return b + 1 < HIST_BUCKETS ? Histogram::bucket_floor(b + 1) - 1 : ~(u64)0;
+  }
+  return 0;
+}
+
+static void print_header() {
+  printf("%-8s %6s %9s %11s %9s %9s %22s %8s %7s\n",
+         "model", "conns", "logins/s", "login p99", "cpu/conn", "rss/conn", "pong p50/p99/max us", "pings", "missed");
+}
+
+static void print_row(LoadRow &r) {
+  char pong[32];
+  snprintf(pong, sizeof(pong), "%llu/%llu/%llu", r.pong_p50_us, r.pong_p99_us, r.pong_max_us);
+  printf("%-8s %6u %9.1f %9llums %8.3f%% %7.0fKB %22s %8llu %7llu\n",
+         model_names[r.model], r.conns, r.logins_per_s, r.login_p99_ms, r.cpu_pct, r.rss_kb, pong, r.pings, r.missed);
+}
+
+// ====================
+// a run
+// ====================
+
+static void add_client(LoadRun &run, LoadModel model, Reactor &reactor, vector<SimClient*> &sims) {
+  auto sim = new SimClient();
+  sim->client.flight = &sim->flight;
+  sim->run = &run;
+  sim->id = (u32)sims.size() + 1;
+  sim->rng.seed(run.server->opt.seed * 0xbf58476d1ce4e5b9ull + sim->id);
+  sims.push_back(sim);
+  run.running.fetch_add(1, memory_order_relaxed);
+
+  if (model == MODEL_SHARDS) {
+    reactor.spawn(sim_main(sim));
+    return;
+  }
+  sim->own = new Scheduler();
+  sim->own->spawn(sim_main(sim));
+  auto proc = [](LPVOID p) -> DWORD {
+    ((Scheduler*)p)->run();
+    return 0;
+  };
+  sim->thread = CreateThread(NULL, 0, proc, sim->own, 0, NULL);
+}
+
+static void run_model(LoadModel model, LoadOptions &opt, MockServer &server, vector<LoadRow> &rows) {
+  LoadRun run;
+  run.opt = &opt;
+  run.server = &server;
+  vector<SimClient*> sims;
+  Reactor reactor;
+  bool reactor_started = false;
+  if (model == MODEL_SHARDS) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    reactor.init(opt.shards > 0 ? opt.shards : info.dwNumberOfProcessors);
+  }
+  auto baseline_ws = working_set_bytes();
+
+  for (auto n : opt.steps) {
+    if (n <= sims.size())
+      continue;
+    u32 batch = n - (u32)sims.size();
+    u64 before_login[HIST_BUCKETS];
+    copy_counts(run.login_ms, before_login);
+
+    auto start = read_clock_ms();
+    while (sims.size() < n)
+      add_client(run, model, reactor, sims);
+    if (model == MODEL_SHARDS && !reactor_started)
+      reactor_started = reactor.start();
+
+    while (run.online.load(memory_order_relaxed) < n && read_clock_ms() - start < LOAD_LOGIN_WAIT_MS)
+      Sleep(10);
+    auto login_took = read_clock_ms() - start;
+    if (run.online.load(memory_order_relaxed) < n)
+      printf("  (%u of %u online after %ums, measuring anyway)\n", run.online.load(), n, LOAD_LOGIN_WAIT_MS);
+
+    Sleep(opt.settle_ms);
+
+    u64 before_pong[HIST_BUCKETS];
+    copy_counts(server.stats.pong_us, before_pong);
+    auto pings = server.stats.pings.load();
+    auto pongs = server.stats.pongs.load();
+    auto cpu = client_cpu_us(&server);
+    auto measure_start = read_clock_us();
+    Sleep(opt.measure_s * 1000);
+    auto elapsed_us = read_clock_us() - measure_start;
+
+    LoadRow r = { model, n };
+    r.logins_per_s = batch * 1000.0 / max<u64>(login_took, 1);
+    r.login_p99_ms = quantile_since(run.login_ms, before_login, 0.99);
+    r.cpu_pct = 100.0 * (client_cpu_us(&server) - cpu) / elapsed_us / n;
+    r.rss_kb = (double)(i64)(working_set_bytes() - baseline_ws) / 1024 / n;
+    r.pong_p50_us = quantile_since(server.stats.pong_us, before_pong, 0.5);
+    r.pong_p99_us = quantile_since(server.stats.pong_us, before_pong, 0.99);
+    r.pong_max_us = quantile_since(server.stats.pong_us, before_pong, 1.0);
+    r.pings = server.stats.pings.load() - pings;
+    r.missed = r.pings - min(r.pings, server.stats.pongs.load() - pongs);
+    print_row(r);
+    rows.push_back(r);
+  }
+
+  // wind down: clients notice within LOAD_POLL_MS, then their schedulers run dry.
+  run.stopping = true;
+  while (run.running.load(memory_order_relaxed) > 0)
+    Sleep(10);
+  if (model == MODEL_SHARDS) {
+    reactor.join();
+  } else {
+    for (auto sim : sims) {
+      WaitForSingleObject(sim->thread, INFINITE);
+      CloseHandle(sim->thread);
+      delete sim->own;
+    }
+  }
+  for (auto sim : sims)
+    delete sim;
+  if (run.login_failures.load() > 0)
+    printf("  %llu logins failed or dropped (and were retried)\n", run.login_failures.load());
+}
+
+static bool parse_steps(ccstr s, vector<u32> &steps) {
+  steps.clear();
+  while (*s != '\0') {
+    char *end;
+    u32 n = (u32)strtoul(s, &end, 10);
+    if (end == s || n == 0)
+      return false;
+    steps.push_back(n);
+    s = (*end == ',') ? end + 1 : end;
+  }
+  sort(steps.begin(), steps.end());
+  return !steps.empty();
+}
+
+int load_main(int argc, char **argv) {
+  static MockServer server; // the scheduler and histogram are too big for the stack
+  LoadOptions opt;
+  server.opt.port = MOCK_DEFAULT_PORT + 1; // leave the default to a `tools mock`
+  server.opt.ping_ms = 1000;               // enough pongs to take percentiles of
+  server.opt.churn_ms = 1000;
+
+  for (s32 i = 0; i + 1 < argc; i += 2) {
+    auto flag = argv[i];
+    auto value = argv[i + 1];
+    u32 n = (u32)strtoul(value, NULL, 10);
+    if (strcmp(flag, "-m") == 0) {
+      for (u32 m = 0; m < MODEL_COUNT; m++)
+        opt.models[m] = strcmp(value, "both") == 0 || strcmp(value, model_names[m]) == 0;
+    }
+    else if (strcmp(flag, "-N") == 0 && parse_steps(value, opt.steps)) {}
+    else if (strcmp(flag, "-k") == 0) opt.shards = n;
+    else if (strcmp(flag, "-w") == 0) opt.settle_ms = n;
+    else if (strcmp(flag, "-t") == 0) opt.measure_s = max(n, 1u);
+    else if (strcmp(flag, "-r") == 0) opt.trade_every_ms = n;
+    else if (strcmp(flag, "-n") == 0) server.opt.population = n;
+    else if (strcmp(flag, "-c") == 0) server.opt.churn_ms = n;
+    else if (strcmp(flag, "-P") == 0) server.opt.ping_ms = max(n, 1u);
+    else if (strcmp(flag, "-J") == 0) server.opt.join_pct = min(n, 100u);
+    else if (strcmp(flag, "-A") == 0) server.opt.accept_pct = min(n, 100u);
+    else if (strcmp(flag, "-l") == 0) server.opt.latency_ms = n;
+    else if (strcmp(flag, "-f") == 0) server.opt.fragment = n;
+    else if (strcmp(flag, "-p") == 0) server.opt.port = (u16)n;
+    else {
+      printf("load: unknown option %s %s\n", flag, value);
+      return EXIT_FAILURE;
+    }
+  }
+
+  // the clients' per-connection chatter would be most of what we measure.
+  debug_log_level(LOG_ERROR);
+  if (!server.start()) {
+    printf("load: failed to start the mock server\n");
+    return EXIT_FAILURE;
+  }
+  printf("mock on 127.0.0.1:%u: %u players per map, churn every %ums, ping every %ums, trade every %ums\n\n",
+         server.opt.port, server.opt.population, server.opt.churn_ms, server.opt.ping_ms, opt.trade_every_ms);
+
+  vector<LoadRow> rows;
+  print_header();
+  for (u32 m = 0; m < MODEL_COUNT; m++)
+    if (opt.models[m])
+      run_model((LoadModel)m, opt, server, rows);
+
+  if (opt.models[MODEL_THREADS] && opt.models[MODEL_SHARDS]) {
+    printf("\nthreads vs shards, per connection:\n");
+    printf("%6s %18s %18s %22s\n", "conns", "cpu threads/shards", "rss threads/shards", "pong p99 threads/shards");
+    for (auto &t : rows) {
+      if (t.model != MODEL_THREADS)
+        continue;
+      for (auto &s : rows) {
+        if (s.model != MODEL_SHARDS || s.conns != t.conns)
+          continue;
+        char cpu[32], rss[32], pong[32];
+        snprintf(cpu, sizeof(cpu), "%.3f/%.3f%%", t.cpu_pct, s.cpu_pct);
+        snprintf(rss, sizeof(rss), "%.0f/%.0fKB", t.rss_kb, s.rss_kb);
+        snprintf(pong, sizeof(pong), "%llu/%lluus", t.pong_p99_us, s.pong_p99_us);
+        printf("%6u %18s %18s %22s\n", t.conns, cpu, rss, pong);
+      }
+    }
+  }
+  return EXIT_SUCCESS;
+}
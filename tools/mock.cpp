@@ -0,0 +1,651 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <winsock2.h>
+#include <windows.h>
+
+#include "core.hpp"
+#include "defer.hpp"
+#include "crypto.hpp"
+#include "packet.hpp"
+#include "rng.hpp"
+#include "task.hpp"
+#include "scheduler.hpp"
+#include "mock.hpp"
+#include "tools.hpp"
+
+using namespace std;
+
+// usage: tools mock [-p port] [-n population] [-c churn_ms] [-P ping_ms]
+//                   [-l latency_ms] [-j jitter_ms] [-f max_piece] [-g gap_ms]
+//                   [-d drop_s] [-k close|reset|stall|mix] [-L login_drop_pct]
+//                   [-t trade_react_ms] [-J join_pct] [-A accept_pct] [-s seed]
+//                   [-i report_s]
+//
+// point a profile's server_ip/server_port at it. the profile's credentials,
+// world and channel are taken as they come.
+
+#define MOCK_REPORT_S 5
+#define MOCK_RECV_CHUNK 4096
+
+enum TradeStage : u8 {
+  MOCK_TRADE_NONE,
+  MOCK_TRADE_INVITED,  // answer due: join, decline, or nothing
+  MOCK_TRADE_JOINED,   // waiting for them to talk
+  MOCK_TRADE_CHAT,     // then our offer, then accept
+  MOCK_TRADE_OFFERED,
+  MOCK_TRADE_ACCEPTED, // waiting for their confirm
+  MOCK_TRADE_CANCEL,   // we walk away
+};
+
+// a piece of the outbound byte stream and when it may go.
+struct Piece {
+  vector<u8> bytes;
+  u64 due_ms;
+};
+
+struct MockConn {
+  MockServer *server;
+  MockOptions *opt;
+  SOCKET sock;
+  u32 id;
+  Rng rng;
+
+  u8 iv_in[4];  // what they encrypt with, their iv_send
+  u8 iv_out[4]; // their iv_recv
+  vector<u8> inbuf;
+  deque<Piece> out;
+  s32 out_offset = 0;  // bytes of out.front() already sent
+  u64 out_last_ms = 0; // due time of the last piece queued, pieces keep order
+  bool blocked = false;
+
+  u32 account_id;
+  u32 char_id = 0;
+  bool in_channel = false;
+  bool stalled = false;
+  u32 login_drop_step = 0; // 0 = this login goes through
+  u32 login_step = 0;
+
+  vector<u32> crowd;
+  u64 next_ping_ms = NO_DEADLINE;
+  u64 ping_sent_us = 0; // 0 while none is outstanding
+  u64 next_churn_ms = NO_DEADLINE;
+  u64 drop_ms = NO_DEADLINE;
+
+  TradeStage trade = MOCK_TRADE_NONE;
+  u64 trade_ms = NO_DEADLINE;
+  bool trade_answer; // at MOCK_TRADE_INVITED: join or decline
+  u32 mesos = 0;
+
+  u32 jittered(u32 ms, u32 jitter) {
+    return ms + (jitter > 0 ? rng.below(jitter + 1) : 0);
+  }
+
+  // queues bytes that are already on the wire format, with latency and
+  // fragmentation applied.
+  void queue_raw(const u8 *bytes, s32 len) {
+    if (stalled)
+      return;
+    auto due = max(current_time_in_ms() + jittered(opt->latency_ms, opt->jitter_ms), out_last_ms);
+    s32 at = 0;
+    while (at < len) {
+      s32 n = opt->fragment > 0 ? min<s32>(rng.below(opt->fragment) + 1, len - at) : len - at;
+      out.push_back({ vector<u8>(bytes + at, bytes + at + n), due });
+      at += n;
+      if (at < len)
+        due += opt->fragment_gap_ms;
+    }
+    out_last_ms = due;
+  }
+
+  void send(Packet &p) {
+    u16 len = (u16)p.bytes.size();
+    vector<u8> frame(4 + len);
+    copy(p.bytes.begin(), p.bytes.end(), frame.begin() + 4);
+    // the server's side of the header: version is the complement of major.
+    crypto::create_packet_header(frame.data(), iv_out, len, (u16)(0xffff - MOCK_MAJOR_VERSION));
+    crypto::encrypt(frame.data() + 4, iv_out, len);
+    queue_raw(frame.data(), frame.size());
+    server->stats.frames_out.fetch_add(1, memory_order_relaxed);
+  }
+
+  void send_handshake() {
+    Packet hs;
+    hs.add2(MOCK_MAJOR_VERSION);
+    hs.addstr("1");
+    for (u32 i = 0; i < 4; i++)
+      hs.add1(iv_in[i]);
+    for (u32 i = 0; i < 4; i++)
+      hs.add1(iv_out[i]);
+    hs.add1(MOCK_LOCALE);
+
+    Packet framed;
+    framed.add2((u16)hs.bytes.size());
+    framed.bytes.insert(framed.bytes.end(), hs.bytes.begin(), hs.bytes.end());
+    queue_raw(framed.bytes.data(), framed.bytes.size());
+  }
+
+  // sends every piece that's due, one send each so the pieces leave as
+  // separate segments. false if the connection dropped.
+  bool flush() {
+    auto now = current_time_in_ms();
+    blocked = false;
+    while (!out.empty() && out.front().due_ms <= now) {
+      auto &piece = out.front();
+      int n = ::send(sock, (const char*)piece.bytes.data() + out_offset, (int)(piece.bytes.size() - out_offset), 0);
+      if (n == SOCKET_ERROR) {
+        if (WSAGetLastError() != WSAEWOULDBLOCK)
+          return false;
+        blocked = true;
+        return true;
+      }
+      server->stats.bytes_out.fetch_add(n, memory_order_relaxed);
+      out_offset += n;
+      if (out_offset < piece.bytes.size()) {
+        blocked = true;
+        return true;
+      }
+      out_offset = 0;
+      out.pop_front();
+    }
+    return true;
+  }
+
+  // ====================
+  // login
+  // ====================
+
+  // true if this login is to be dropped here.
+  bool login_drops() {
+    return ++login_step == login_drop_step;
+  }
+
+  void handle_login(Packet &p, u16 opcode) {
+    switch (opcode) {
+    case OP_SEND_LOGIN: {
+      Packet r;
+      r.add2(OP_RECV_LOGIN_STATUS);
+      r.add1(LOGIN_SUCCESS);
+      r.add1(0);
+      r.add4(0);
+      r.add4(account_id);
+      send(r);
+      break;
+    }
+    case OP_SEND_SHOW_WORLD: {
+      Packet world;
+      world.add2(OP_RECV_SERVER_LIST);
+      world.add1(0); // world id
+      world.addstr("Scania");
+      world.add1(0);
+      world.addstr("");
+      world.add2(100);
+      world.add2(100);
+      world.add1(0);
+      send(world);
+
+      Packet end;
+      end.add2(OP_RECV_SERVER_LIST);
+      end.add1(0xff);
+      send(end);
+      break;
+    }
+    case OP_SEND_SELECT_WORLD: {
+      Packet r;
+      r.add2(OP_RECV_WORLD_INFO);
+      r.add1(0);
+      send(r);
+      break;
+    }
+    case OP_SEND_SELECT_CHANNEL: {
+      char_id = server->next_char_id.fetch_add(1, memory_order_relaxed);
+      Packet r;
+      r.add2(OP_RECV_CHAR_INFO);
+      r.add2(0);
+      r.add4(char_id);
+      send(r);
+      break;
+    }
+    case OP_SEND_SELECT_CHAR_WITH_PIC: {
+      p.readstr(); // pic
+      auto id = p.read4();
+      Packet r;
+      r.add2(OP_RECV_SERVER_INFO);
+      r.add2(0);
+      r.add1(127);
+      r.add1(0);
+      r.add1(0);
+      r.add1(1);
+      r.add2(opt->port);
+      r.add4(id);
+      send(r);
+      break;
+    }
+    case OP_SEND_ANNOUNCE_LOGGED_IN:
+      char_id = p.read4();
+      enter_channel();
+      break;
+    }
+  }
+
+  // ====================
+  // channel
+  // ====================
+
+  void enter_channel() {
+    in_channel = true;
+    server->stats.logins.fetch_add(1, memory_order_relaxed);
+    server->stats.in_channel.fetch_add(1, memory_order_relaxed);
+
+    Packet warp;
+    warp.add2(OP_RECV_WARP_TO_MAP);
+    warp.add4(0); // channel
+    warp.add1(0);
+    warp.add1(1); // connecting: the character follows
+    warp.add2(0);
+    for (u32 i = 0; i < 12 + 13; i++) // rng seeds, then the rest of the header
+      warp.add1(0);
+    char ign[13] = {};
+    snprintf(ign, sizeof(ign), "mock%u", char_id);
+    for (u32 i = 0; i < 13; i++)
+      warp.add1(ign[i]);
+    for (u32 i = 0; i < 77; i++)
+      warp.add1(0);
+    warp.add1(0); // no linked name
+    warp.add4(mesos);
+    send(warp);
+
+    for (u32 i = 0; i < opt->population; i++)
+      player_enters();
+
+    auto now = current_time_in_ms();
+    next_ping_ms = now + opt->ping_ms;
+    if (opt->churn_ms > 0)
+      next_churn_ms = now + jittered(opt->churn_ms / 2, opt->churn_ms);
+    if (opt->drop_s > 0)
+      drop_ms = now + jittered(opt->drop_s * 500, opt->drop_s * 1000);
+  }
+
+  void player_enters() {
+    u32 id = server->next_char_id.fetch_add(1, memory_order_relaxed);
+    crowd.push_back(id);
+    Packet p;
+    p.add2(OP_RECV_PLAYER_ENTERED);
+    p.add4(id);
+    p.add1(0);
+    p.addstr("mock" + to_string(id));
+    p.add1(0);
+    send(p);
+  }
+
+  void player_exits() {
+    u32 i = rng.below((u32)crowd.size());
+    u32 id = crowd[i];
+    crowd[i] = crowd.back();
+    crowd.pop_back();
+    Packet p;
+    p.add2(OP_RECV_PLAYER_EXITED);
+    p.add4(id);
+    send(p);
+  }
+
+  void send_trade(u8 op) {
+    Packet p;
+    p.add2(OP_RECV_TRADE);
+    p.add1(op);
+    switch (op) {
+    case TRADE_CHAT:
+      p.add1(0x08);
+      p.add1(1); // their side
+      p.addstr("hi");
+      break;
+    case TRADE_MESOS:
+      p.add1(1);
+      p.add4(1 + rng.below(1000000));
+      break;
+    case TRADE_ENDED:
+      p.add1(0);
+      p.add1(trade == MOCK_TRADE_CANCEL ? 0x02 : 0x07);
+      break;
+    }
+    send(p);
+  }
+
+  void trade_next(TradeStage stage) {
+    trade = stage;
+    trade_ms = current_time_in_ms() + jittered(opt->trade_react_ms / 2, opt->trade_react_ms);
+  }
+
+  void trade_over() {
+    trade = MOCK_TRADE_NONE;
+    trade_ms = NO_DEADLINE;
+  }
+
+  void handle_trade(Packet &p) {
+    switch (p.read1()) {
+    case 0x02: { // invite
+      server->stats.invites.fetch_add(1, memory_order_relaxed);
+      u32 roll = rng.below(100);
+      if (roll < opt->join_pct) {
+        trade_answer = true;
+        trade_next(MOCK_TRADE_INVITED);
+      } else if (rng.below(2) == 0) {
+        trade_answer = false;
+        trade_next(MOCK_TRADE_INVITED);
+      } else {
+        trade_over(); // they never answer; the bot times out
+      }
+      break;
+    }
+    case TRADE_CHAT:
+      if (trade == MOCK_TRADE_JOINED)
+        trade_next(rng.below(100) < opt->accept_pct ? MOCK_TRADE_CHAT : MOCK_TRADE_CANCEL);
+      break;
+    case TRADE_ACCEPTED: // their confirm, after the submit
+      if (trade == MOCK_TRADE_ACCEPTED) {
+        send_trade(TRADE_ENDED);
+        server->stats.trades_done.fetch_add(1, memory_order_relaxed);
+        mesos += 1000;
+        Packet stats;
+        stats.add2(OP_RECV_UPDATE_STATS);
+        stats.add1(0);
+        stats.add4(0x40000);
+        stats.add4(mesos);
+        send(stats);
+        trade_over();
+      }
+      break;
+    case TRADE_ENDED: // they cancelled
+      trade_over();
+      break;
+    }
+  }
+
+  // the partner's side of a trade, one step per call.
+  void advance_trade() {
+    switch (trade) {
+    case MOCK_TRADE_INVITED:
+      if (trade_answer) {
+        send_trade(TRADE_JOINED);
+        trade = MOCK_TRADE_JOINED;
+        trade_ms = NO_DEADLINE;
+      } else {
+        send_trade(TRADE_DECLINED);
+        trade_over();
+      }
+      break;
+    case MOCK_TRADE_CHAT:
+      send_trade(TRADE_CHAT);
+      trade_next(MOCK_TRADE_OFFERED);
+      break;
+    case MOCK_TRADE_OFFERED:
+      send_trade(TRADE_MESOS);
+      send_trade(TRADE_ACCEPTED);
+      trade = MOCK_TRADE_ACCEPTED;
+      trade_ms = NO_DEADLINE;
+      break;
+    case MOCK_TRADE_CANCEL:
+      send_trade(TRADE_ENDED);
+      trade_over();
+      break;
+    default:
+      trade_ms = NO_DEADLINE;
+      break;
+    }
+  }
+
+  void handle_channel(Packet &p, u16 opcode) {
+    switch (opcode) {
+    case OP_SEND_PONG:
+      if (ping_sent_us != 0) {
+        server->stats.pongs.fetch_add(1, memory_order_relaxed);
+        server->stats.pong_us.record(read_clock_us() - ping_sent_us);
+        ping_sent_us = 0;
+      }
+      break;
+    case OP_SEND_TRADE:
+      handle_trade(p);
+      break;
+    }
+  }
+
+  // ====================
+  // faults and timers
+  // ====================
+
+  // false once the connection is to be closed.
+  bool drop() {
+    server->stats.drops.fetch_add(1, memory_order_relaxed);
+    auto kind = opt->drop == DROP_MIX ? (DropKind)rng.below(DROP_MIX) : opt->drop;
+    switch (kind) {
+    case DROP_RESET: {
+      linger l = { 1, 0 };
+      setsockopt(sock, SOL_SOCKET, SO_LINGER, (char*)&l, sizeof(l));
+      return false;
+    }
+    case DROP_STALL:
+      stalled = true;
+      out.clear();
+      out_offset = 0;
+      next_ping_ms = next_churn_ms = trade_ms = drop_ms = NO_DEADLINE;
+      return true;
+    default:
+      shutdown(sock, SD_BOTH);
+      return false;
+    }
+  }
+
+  bool run_timers() {
+    auto now = current_time_in_ms();
+    if (now >= drop_ms && !drop())
+      return false;
+    if (now >= next_ping_ms) {
+      Packet ping;
+      ping.add2(OP_RECV_PING);
+      send(ping);
+      server->stats.pings.fetch_add(1, memory_order_relaxed);
+      ping_sent_us = read_clock_us();
+      next_ping_ms = now + opt->ping_ms;
+    }
+    if (now >= next_churn_ms) {
+      // drift around the configured population.
+      if (crowd.size() > opt->population / 2 && rng.below(2) == 0)
+        player_exits();
+      else
+        player_enters();
+      next_churn_ms = now + jittered(opt->churn_ms / 2, opt->churn_ms);
+    }
+    if (now >= trade_ms)
+      advance_trade();
+    return true;
+  }
+
+  u64 next_deadline() {
+    u64 deadline = min(min(next_ping_ms, next_churn_ms), min(trade_ms, drop_ms));
+    if (!out.empty() && !blocked)
+      deadline = min(deadline, out.front().due_ms);
+    return deadline;
+  }
+
+  // false once the connection is to be closed.
+  bool read_frames() {
+    auto have = inbuf.size();
+    inbuf.resize(have + MOCK_RECV_CHUNK);
+    int got = recv(sock, (char*)inbuf.data() + have, MOCK_RECV_CHUNK, 0);
+    inbuf.resize(have + max(got, 0));
+    if (got == 0 || (got == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK))
+      return false;
+    if (stalled)
+      inbuf.clear();
+
+    while (inbuf.size() >= 4) {
+      auto len = crypto::get_packet_length(inbuf.data());
+      if (len < 2)
+        return false; // not speaking our protocol
+      if (inbuf.size() < 4 + (s32)len)
+        break;
+
+      Packet p;
+      p.bytes.assign(inbuf.begin() + 4, inbuf.begin() + 4 + len);
+      inbuf.erase(inbuf.begin(), inbuf.begin() + 4 + len);
+      crypto::decrypt(p.bytes.data(), iv_in, len);
+      server->stats.frames_in.fetch_add(1, memory_order_relaxed);
+
+      auto opcode = p.read2();
+      if (in_channel) {
+        handle_channel(p, opcode);
+      } else {
+        if (login_drops()) {
+          if (!drop())
+            return false;
+          inbuf.clear(); // stalled
+          break;
+        }
+        handle_login(p, opcode);
+      }
+    }
+    return true;
+  }
+};
+
+static Task<> mock_session(MockServer *server, SOCKET sock, u32 id) {
+  auto &stats = server->stats;
+  stats.open.fetch_add(1, memory_order_relaxed);
+
+  MockConn c = { server, &server->opt, sock, id };
+  defer {
+    if (c.in_channel)
+      stats.in_channel.fetch_sub(1, memory_order_relaxed);
+    stats.open.fetch_sub(1, memory_order_relaxed);
+    closesocket(sock);
+  };
+
+  c.rng.seed(server->opt.seed * 0x9e3779b97f4a7c15ull + id);
+  c.account_id = id;
+  u64 ivs = c.rng.next();
+  memcpy(c.iv_in, &ivs, 4);
+  memcpy(c.iv_out, (u8*)&ivs + 4, 4);
+  // a request of the login to drop at: five on the login connection, the
+  // announce on the channel one.
+  if (c.rng.below(100) < server->opt.login_drop_pct)
+    c.login_drop_step = 1 + c.rng.below(5);
+
+  c.send_handshake();
+  while (true) {
+    if (!c.run_timers() || !c.flush())
+      co_return;
+    short events = POLLRDNORM | (c.blocked ? POLLWRNORM : 0);
+    auto revents = co_await wait_io(sock, events, c.next_deadline());
+    if ((revents & (POLLRDNORM | POLLHUP | POLLERR)) != 0 && !c.read_frames())
+      co_return;
+  }
+}
+
+static Task<> mock_accept(MockServer *server) {
+  u32 next_id = 1;
+  while (true) {
+    co_await wait_io(server->listener, POLLRDNORM);
+    SOCKET sock;
+    while ((sock = accept(server->listener, NULL, NULL)) != INVALID_SOCKET) {
+      u_long nonblocking = 1;
+      ioctlsocket(sock, FIONBIO, &nonblocking);
+      BOOL nodelay = TRUE;
+      setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char*)&nodelay, sizeof(nodelay));
+      server->stats.connections.fetch_add(1, memory_order_relaxed);
+      this_scheduler->spawn(mock_session(server, sock, next_id++));
+    }
+  }
+}
+
+bool MockServer::start() {
+  WSADATA wsa;
+  if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+    return false;
+
+  listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (listener == INVALID_SOCKET)
+    return false;
+
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(opt.port);
+  if (bind(listener, (SOCKADDR*)&addr, sizeof(addr)) == SOCKET_ERROR || listen(listener, SOMAXCONN) == SOCKET_ERROR) {
+    debug_error("mock: can't listen on port %u: %d", opt.port, WSAGetLastError());
+    closesocket(listener);
+    listener = INVALID_SOCKET;
+    return false;
+  }
+  u_long nonblocking = 1;
+  ioctlsocket(listener, FIONBIO, &nonblocking);
+
+  sched.spawn(mock_accept(this));
+  auto proc = [](LPVOID p) -> DWORD {
+    ((Scheduler*)p)->run();
+    return 0;
+  };
+  thread = CreateThread(NULL, 0, proc, &sched, 0, NULL);
+  return thread != NULL;
+}
+
+void MockServer::print_stats() {
+  printf("%u open, %u in channel, %llu connections, %llu logins, %llu drops | %llu invites, %llu trades | frames %llu in %llu out\n",
+         stats.open.load(), stats.in_channel.load(), stats.connections.load(), stats.logins.load(), stats.drops.load(),
+         stats.invites.load(), stats.trades_done.load(), stats.frames_in.load(), stats.frames_out.load());
+  printf("  %s\n", stats.pong_us.summary("ping->pong us").c_str());
+}
+
+static bool parse_drop(ccstr s, DropKind *kind) {
+  ccstr names[] = { "close", "reset", "stall", "mix" };
+  for (u32 i = 0; i < _countof(names); i++) {
+    if (strcmp(s, names[i]) == 0) {
+      *kind = (DropKind)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+int mock_main(int argc, char **argv) {
+  static MockServer server; // the scheduler and histogram are too big for the stack
+  auto &opt = server.opt;
+  u32 report_s = MOCK_REPORT_S;
+  for (s32 i = 0; i + 1 < argc; i += 2) {
+    auto flag = argv[i];
+    auto value = argv[i + 1];
+    u32 n = (u32)strtoul(value, NULL, 10);
+    if (strcmp(flag, "-p") == 0)      opt.port = (u16)n;
+    else if (strcmp(flag, "-n") == 0) opt.population = n;
+    else if (strcmp(flag, "-c") == 0) opt.churn_ms = n;
+    else if (strcmp(flag, "-P") == 0) opt.ping_ms = max(n, 1u);
+    else if (strcmp(flag, "-l") == 0) opt.latency_ms = n;
+    else if (strcmp(flag, "-j") == 0) opt.jitter_ms = n;
+    else if (strcmp(flag, "-f") == 0) opt.fragment = n;
+    else if (strcmp(flag, "-g") == 0) opt.fragment_gap_ms = n;
+    else if (strcmp(flag, "-d") == 0) opt.drop_s = n;
+    else if (strcmp(flag, "-L") == 0) opt.login_drop_pct = min(n, 100u);
+    else if (strcmp(flag, "-t") == 0) opt.trade_react_ms = n;
+    else if (strcmp(flag, "-J") == 0) opt.join_pct = min(n, 100u);
+    else if (strcmp(flag, "-A") == 0) opt.accept_pct = min(n, 100u);
+    else if (strcmp(flag, "-s") == 0) opt.seed = strtoull(value, NULL, 10);
+    else if (strcmp(flag, "-i") == 0) report_s = max(n, 1u);
+    else if (strcmp(flag, "-k") == 0 && parse_drop(value, &opt.drop)) {}
+    else {
+      printf("mock: unknown option %s %s\n", flag, value);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (!server.start()) {
+    printf("mock: failed to start\n");
+    return EXIT_FAILURE;
+  }
+  printf("mock server on 127.0.0.1:%u, %u players per map\n", opt.port, opt.population);
+  while (true) {
+    Sleep(report_s * 1000);
+    server.print_stats();
+  }
+}
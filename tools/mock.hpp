@@ -0,0 +1,82 @@
+#pragma once
+
+#include <winsock2.h>
+#include <windows.h>
+#include <atomic>
+
+#include "core.hpp"
+#include "histogram.hpp"
+#include "scheduler.hpp"
+
+using namespace std;
+
+// a stand-in for the login and channel servers, enough of them for
+// GameClient and run_inst: the v83 handshake, the login sequence up to
+// OP_SEND_ANNOUNCE_LOGGED_IN, then a map with players coming and going,
+// pings, and trade partners that join, chat, offer, accept, decline or go
+// quiet. one port plays both servers; the server info it hands out points
+// back at itself.
+//
+// faults are injected on the way out: latency, frames cut into pieces at
+// random byte boundaries (handshake and headers included), and connections
+// that get closed, reset or stall. every connection is a task on one
+// scheduler thread, the same machinery the bot runs on.
+
+#define MOCK_DEFAULT_PORT 8484
+#define MOCK_MAJOR_VERSION 83
+#define MOCK_LOCALE 8
+
+enum DropKind : u8 {
+  DROP_CLOSE, // graceful shutdown
+  DROP_RESET, // rst, by closing with a zero linger
+  DROP_STALL, // stop talking, keep the connection open
+  DROP_MIX,   // one of the above, at random
+};
+
+struct MockOptions {
+  u16 port = MOCK_DEFAULT_PORT;
+  u32 population = 30;       // players on the map when we log in
+  u32 churn_ms = 2000;       // a player enters or leaves this often, 0 = never
+  u32 ping_ms = 15000;
+  u32 latency_ms = 0;        // added to every frame we send
+  u32 jitter_ms = 0;         // plus up to this much, frames stay in order
+  u32 fragment = 0;          // cut frames into pieces of 1..fragment bytes, 0 = whole
+  u32 fragment_gap_ms = 0;   // between the pieces of a frame
+  u32 drop_s = 0;            // drop channel connections after about this long, 0 = never
+  DropKind drop = DROP_MIX;
+  u32 login_drop_pct = 0;    // of logins, dropped at a random step on the way
+  u32 trade_react_ms = 500;  // between a trade packet and the partner's reaction
+  u32 join_pct = 60;         // of invites; the rest are declined or ignored, half each
+  u32 accept_pct = 50;       // of joined trades; the rest get cancelled
+  u64 seed = 1;
+};
+
+// written by the server thread, read by anyone.
+struct MockStats {
+  atomic<u64> connections{0};
+  atomic<u32> open{0};
+  atomic<u32> in_channel{0};
+  atomic<u64> logins{0};        // reached the channel
+  atomic<u64> pings{0};
+  atomic<u64> pongs{0};
+  atomic<u64> invites{0};
+  atomic<u64> trades_done{0};
+  atomic<u64> drops{0};
+  atomic<u64> frames_in{0};
+  atomic<u64> frames_out{0};
+  atomic<u64> bytes_out{0};
+  Histogram pong_us;            // our ping queued to their pong framed
+};
+
+struct MockServer {
+  MockOptions opt;
+  MockStats stats;
+  Scheduler sched;
+  SOCKET listener = INVALID_SOCKET;
+  HANDLE thread = NULL; // serving, kept for its cpu time
+  atomic<u32> next_char_id{1000}; // unique across connections, so no one is "seen" twice
+
+  // binds opt.port on loopback and serves from a thread of its own.
+  bool start();
+  void print_stats();
+};
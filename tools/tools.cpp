@@ -0,0 +1,41 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <winsock2.h>
+#include <windows.h>
+
+#include "core.hpp"
+#include "tools.hpp"
+
+#pragma comment(lib, "ws2_32.lib")
+
+// offline tooling for the bot: benchmarks, harnesses and viewers that share
+// its headers but not its window.
+
+struct Command {
+  const char *name;
+  int (*run)(int argc, char **argv);
+  const char *help;
+};
+
+static Command commands[] = {
+  { "bench", bench_main, "micro-benchmarks of the bot's hot data structures" },
+  { "load", load_main, "load test: N simulated clients against the mock, threads vs shards" },
+  { "mock", mock_main, "local stand-in for the login and channel servers, with injected faults" },
+  { "top", top_main, "live table of a running bot's instances, from its stats segment" },
+  { "trace", trace_main, "dump a running bot's packet spans as chrome trace json, or set its sampling" },
+  { "tradesim", tradesim_main, "run the trade state machine on a simulated clock, days per second" },
+};
+
+int main(int argc, char **argv) {
+  if (argc >= 2) {
+    for (auto &cmd : commands)
+      if (strcmp(argv[1], cmd.name) == 0)
+        return cmd.run(argc - 2, argv + 2);
+  }
+
+  printf("usage: tools <command> [args]\n\n");
+  for (auto &cmd : commands)
+    printf("  %-8s %s\n", cmd.name, cmd.help);
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+// subcommands of tools.exe. each takes the arguments after its name and
+// returns the process exit code.
+int bench_main(int argc, char **argv);
+int load_main(int argc, char **argv);
+int mock_main(int argc, char **argv);
+int top_main(int argc, char **argv);
+int trace_main(int argc, char **argv);
+int tradesim_main(int argc, char **argv);
@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <windows.h>
+
+#include "core.hpp"
+#include "statseg.hpp"
+#include "tools.hpp"
+
+using namespace std;
+
+// a refreshing table of a running bot's instances, read from its stats
+// segment. the bot doesn't know we're here: we only map its memory read-only.
+//
+// usage: tools top [pid] [-i interval_ms] [-n frames]
+
+#define TOP_DEFAULT_INTERVAL_MS 1000
+#define TOP_READ_ATTEMPTS 100
+
+struct TopRow {
+  bool valid;
+  bool has_before;
+  InstSlot slot;
+  InstSlot before; // the previous distinct write, for rates
+};
+
+static double per_second(u64 now, u64 before, u64 dt_ms) {
+  return (dt_ms == 0 || now < before) ? 0 : (now - before) * 1000.0 / dt_ms;
+}
+
+static void draw(StatsSegment &seg, vector<TopRow> &rows, bool clear) {
+  if (clear)
+    printf("\x1b[H\x1b[J");
+
+  u32 count = min<u32>(seg.header->count.load(memory_order_relaxed), seg.header->capacity);
+  printf("bot pid %u, %u instances\n\n", seg.header->pid, count);
+  printf("%-16s %-12s %-15s %-17s %12s %7s %7s %7s %7s %8s %8s %5s %7s %5s %5s\n",
+         "name", "ign", "status", "trade", "mesos", "players", "seen", "in/s", "out/s", "kB/s in", "kB/s out", "inq", "outq", "recon", "age");
+
+  u64 now = read_clock_ms();
+  rows.resize(count);
+  for (u32 i = 0; i < count; i++) {
+    auto &row = rows[i];
+    InstSlot fresh;
+    if (!seg.slot(i)->try_load(fresh, TOP_READ_ATTEMPTS)) {
+      printf("(slot %u busy)\n", i);
+      continue;
+    }
+    if (!row.valid || fresh.updated_ms != row.slot.updated_ms) {
+      row.has_before = row.valid;
+      row.before = row.slot;
+      row.slot = fresh;
+      row.valid = true;
+    }
+
+    // rates are over the last two writes, not the last two frames
+    auto &s = row.slot;
+    auto &b = row.before;
+    u64 dt = row.has_before ? s.updated_ms - b.updated_ms : 0;
+    char rates[4][16];
+    if (dt > 0) {
+      snprintf(rates[0], 16, "%.1f", per_second(s.packets_in, b.packets_in, dt));
+      snprintf(rates[1], 16, "%.1f", per_second(s.packets_out, b.packets_out, dt));
+      snprintf(rates[2], 16, "%.1f", per_second(s.bytes_in, b.bytes_in, dt) / 1024);
+      snprintf(rates[3], 16, "%.1f", per_second(s.bytes_out, b.bytes_out, dt) / 1024);
+    } else {
+      for (auto &r : rates)
+        snprintf(r, 16, "-");
+    }
+
+    // a quiet instance isn't republished, so age is also a liveness hint
+    printf("%-16.16s %-12.12s %-15.15s %-17.17s %12u %7u %7u %7s %7s %8s %8s %5u %7u %5u %4llus\n",
+           s.name, s.ign[0] ? s.ign : "-", s.status, s.trade, s.mesos, s.players, s.seen,
+           rates[0], rates[1], rates[2], rates[3], s.inq_depth, s.outq_bytes, s.reconnects,
+           (unsigned long long)(now > s.updated_ms ? (now - s.updated_ms) / 1000 : 0));
+  }
+  fflush(stdout);
+}
+
+int top_main(int argc, char **argv) {
+  u32 pid = 0;
+  u32 interval_ms = TOP_DEFAULT_INTERVAL_MS;
+  int frames = -1;
+  for (s32 i = 0; i < argc; i++) {
+    if (strcmp(argv[i], "-i") == 0 && i + 1 < argc)
+      interval_ms = max(atoi(argv[++i]), 50);
+    else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+      frames = atoi(argv[++i]);
+    else
+      pid = (u32)strtoul(argv[i], NULL, 10);
+  }
+
+  StatsSegment seg;
+  if (!seg.open(pid)) {
+    if (pid != 0)
+      printf("no stats segment for pid %u (is it running, and the same version?)\n", pid);
+    else
+      printf("no stats segment found (is the bot running, and the same version?)\n");
+    return EXIT_FAILURE;
+  }
+  defer { seg.close(); };
+
+  auto bot = OpenProcess(SYNCHRONIZE, FALSE, seg.header->pid);
+  defer { if (bot != NULL) CloseHandle(bot); };
+
+  // clear-and-redraw needs vt sequences; without them (or when asked for a
+  // fixed number of frames, e.g. piped into a file) frames are just appended.
+  bool clear = false;
+  auto out = GetStdHandle(STD_OUTPUT_HANDLE);
+  DWORD mode;
+  if (frames < 0 && GetConsoleMode(out, &mode))
+    clear = SetConsoleMode(out, mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING) != 0;
+
+  vector<TopRow> rows;
+  for (int frame = 0; frames < 0 || frame < frames; frame++) {
+    if (frame > 0)
+      Sleep(interval_ms);
+    draw(seg, rows, clear);
+    if (bot != NULL && WaitForSingleObject(bot, 0) == WAIT_OBJECT_0) {
+      printf("\nbot exited\n");
+      return EXIT_SUCCESS;
+    }
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+
+#include "core.hpp"
+#include "statseg.hpp"
+#include "tools.hpp"
+
+using namespace std;
+
+// asks a running bot for a chrome trace of its recent packet spans, or
+// changes how often it samples them. goes through the stats segment, the
+// only part of it a reader may write.
+//
+// usage: tools trace [pid] [-s sample_every] [-w wait_ms]
+//   -s N: trace one unit of work in N from now on, 0 turns tracing off.
+//         without -s, asks for a dump and prints where it was written.
+
+#define TRACE_DEFAULT_WAIT_MS 5000
+#define TRACE_POLL_MS 50
+
+int trace_main(int argc, char **argv) {
+  u32 pid = 0;
+  int sample_every = -1;
+  u32 wait_ms = TRACE_DEFAULT_WAIT_MS;
+  for (s32 i = 0; i < argc; i++) {
+    if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+      sample_every = max(atoi(argv[++i]), 0);
+    else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+      wait_ms = (u32)max(atoi(argv[++i]), 0);
+    else
+      pid = (u32)strtoul(argv[i], NULL, 10);
+  }
+
+  StatsSegment seg;
+  if (!seg.open(pid, true)) {
+    printf("no stats segment found (is the bot running, and the same version?)\n");
+    return EXIT_FAILURE;
+  }
+  defer { seg.close(); };
+  auto header = seg.header;
+
+  if (sample_every >= 0) {
+    header->trace_sample_every.store((u32)sample_every, memory_order_relaxed);
+    if (sample_every == 0)
+      printf("bot %u: tracing off\n", header->pid);
+    else
+      printf("bot %u: tracing one in %d\n", header->pid, sample_every);
+    return EXIT_SUCCESS;
+  }
+
+  if (header->trace_sample_every.load(memory_order_relaxed) == 0)
+    printf("note: tracing is off in bot %u, the dump will only hold what was recorded before\n", header->pid);
+
+  u32 ticket = header->trace_requests.fetch_add(1, memory_order_acq_rel) + 1;
+  for (u32 waited = 0; waited < wait_ms; waited += TRACE_POLL_MS) {
+    // another `tools trace` may have asked after us; its dump covers ours too.
+    if ((i32)(header->trace_dumps.load(memory_order_acquire) - ticket) >= 0) {
+      char path[sizeof(header->trace_path) + 1] = "";
+      memcpy(path, header->trace_path, sizeof(header->trace_path));
+      if (path[0] == '\0') {
+        printf("bot %u failed to write the trace, see its log\n", header->pid);
+        return EXIT_FAILURE;
+      }
+      printf("%s\n", path);
+      return EXIT_SUCCESS;
+    }
+    Sleep(TRACE_POLL_MS);
+  }
+  printf("bot %u didn't answer within %ums\n", header->pid, wait_ms);
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,317 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <queue>
+
+#include "core.hpp"
+#include "rng.hpp"
+#include "candidates.hpp"
+#include "trade.hpp"
+#include "tools.hpp"
+
+using namespace std;
+
+// run_inst's trade state machine on a simulated clock, against a model of
+// the map and of the players on it. nothing waits: the clock jumps straight
+// to the next event or fsm deadline, so days of trading take a fraction of
+// a second, and with a fixed seed every run is the same run. for profiling
+// the decision loop, and for seeing what the timeouts cost or buy.
+//
+// usage: tools tradesim [-d days] [-n population] [-e enter_every_ms] [-s seed]
+//                       [-J join_pct] [-D decline_pct] [-O offer_pct] [-A accept_pct]
+//                       [-r react_ms] [-x initiated|player_joined|player_accepted|beg=ms,ms,...]
+//
+// of the invited, J% join and D% decline, the rest never answer. of those
+// who join, O% make an offer once begged, and A% of those accept; the rest
+// cancel or go quiet, half each. every reaction takes an exponentially
+// distributed time with mean react_ms. -x runs once per value of one timing.
+
+#define SIM_SERVER_MS 200 // a submitted trade to the server's "finished"
+
+enum SimEventKind : u8 {
+  SIM_ENTER, // a player walks onto the map
+  SIM_LEAVE,
+  SIM_TRADE, // the partner's op reaches us
+};
+
+struct SimEvent {
+  u64 at;
+  u64 seq; // orders events at the same ms, so runs repeat exactly
+  SimEventKind kind;
+  u8 op;
+  u32 char_id; // SIM_ENTER, SIM_LEAVE
+  u32 trade;   // SIM_TRADE: which trade it belongs to
+};
+
+struct SimEventLater {
+  bool operator()(const SimEvent &a, const SimEvent &b) const {
+    return a.at != b.at ? a.at > b.at : a.seq > b.seq;
+  }
+};
+
+struct SimParams {
+  u32 days = 7;
+  u32 population = 30;
+  u32 enter_every_ms = 5000;
+  u32 join_pct = 40;
+  u32 decline_pct = 30;
+  u32 offer_pct = 50;
+  u32 accept_pct = 60;
+  u32 react_ms = 4000;
+  u64 seed = 1;
+};
+
+struct SimResult {
+  u64 events;
+  u64 wall_us;
+  u64 initiated;
+  u64 joined;
+  u64 completed;
+  u64 timeouts[STATE_COUNT];
+};
+
+struct Sim;
+
+// the fsm's transport: what it sends turns into the partner's reactions.
+struct SimIo {
+  Sim *sim;
+
+  void initiate_trade(u32 char_id);
+  void cancel_trade() {}
+  void submit_trade();
+  void send_trade_message();
+  void state_changed(TradeState from, TradeState to);
+  void joined();
+  void timed_out(TradeState state);
+};
+
+struct Sim {
+  SimParams *params;
+  SimResult result = {};
+  u64 now = 0;
+  Rng rng;
+  priority_queue<SimEvent, vector<SimEvent>, SimEventLater> events;
+  u64 next_seq = 0;
+  u32 next_char_id = 1;
+  u32 trade_id = 0; // the partner's trade; bumped when ours ends, so stale reactions are dropped
+  CandidateSet players;
+  SimIo io;
+  TradeFsm<SimIo> fsm;
+
+  void push(u64 at, SimEventKind kind, u8 op, u32 char_id) {
+    events.push({ at, next_seq++, kind, op, char_id, trade_id });
+  }
+
+  // exponential, mean `mean`.
+  u64 delay(u32 mean) {
+    double u = (rng.next() >> 11) * (1.0 / (1ull << 53));
+    return (u64)(-log(1.0 - u) * mean);
+  }
+
+  bool roll(u32 pct) {
+    return rng.below(100) < pct;
+  }
+
+  void enter() {
+    u32 id = next_char_id++;
+    players.insert(id, id); // the ign is never looked up here; the id stands in
+    // stays long enough that arrivals and departures settle at the population.
+    push(now + delay(params->population * params->enter_every_ms), SIM_LEAVE, 0, id);
+    push(now + delay(params->enter_every_ms), SIM_ENTER, 0, 0);
+  }
+
+  // run_inst's initiate_next_trade.
+  void initiate_next_trade() {
+    if (fsm.active() || players.empty())
+      return;
+    auto picked = players.take_random(rng);
+    result.initiated++;
+    fsm.start(picked.char_id, picked.ign, now);
+  }
+
+  void handle(const SimEvent &e) {
+    switch (e.kind) {
+    case SIM_ENTER:
+      enter();
+      break;
+    case SIM_LEAVE:
+      players.erase(e.char_id);
+      break;
+    case SIM_TRADE:
+      if (e.trade != trade_id)
+        break; // from a trade we already gave up on
+      if (e.op == TRADE_ENDED && fsm.state == STATE_PLAYER_ACCEPTED)
+        result.completed++;
+      fsm.on_trade(e.op, now);
+      break;
+    }
+  }
+
+  void run(const TradeTimings *timings) {
+    rng.seed(params->seed);
+    io.sim = this;
+    fsm.io = &io;
+    fsm.timings = timings;
+    for (u32 i = 0; i < params->population; i++) {
+      players.insert(next_char_id, next_char_id);
+      push(delay(params->population * params->enter_every_ms), SIM_LEAVE, 0, next_char_id);
+      next_char_id++;
+    }
+    push(delay(params->enter_every_ms), SIM_ENTER, 0, 0);
+
+    u64 end = (u64)params->days * 24 * 3600 * 1000;
+    auto start = read_clock_us();
+    while (now < end) {
+      initiate_next_trade();
+      // the next thing to happen: an event, or one of the fsm's deadlines.
+      u64 deadline = fsm.next_deadline();
+      if (events.empty() || deadline < events.top().at) {
+        now = deadline;
+        fsm.advance(now);
+      } else {
+        auto e = events.top();
+        events.pop();
+        now = e.at;
+        handle(e);
+      }
+      result.events++;
+    }
+    result.wall_us = read_clock_us() - start;
+  }
+};
+
+void SimIo::initiate_trade(u32 char_id) {
+  auto p = sim->params;
+  u32 roll = sim->rng.below(100);
+  if (roll < p->join_pct)
+    sim->push(sim->now + sim->delay(p->react_ms), SIM_TRADE, TRADE_JOINED, 0);
+  else if (roll < p->join_pct + p->decline_pct)
+    sim->push(sim->now + sim->delay(p->react_ms), SIM_TRADE, TRADE_DECLINED, 0);
+}
+
+// ours ended, however it ended: whatever the partner still had in flight
+// for it is stale.
+void SimIo::state_changed(TradeState from, TradeState to) {
+  if (to == STATE_INACTIVE)
+    sim->trade_id++;
+}
+
+void SimIo::submit_trade() {
+  sim->push(sim->now + SIM_SERVER_MS, SIM_TRADE, TRADE_ENDED, 0);
+}
+
+void SimIo::send_trade_message() {
+  auto p = sim->params;
+  if (!sim->roll(p->offer_pct))
+    return;
+  u64 offer_at = sim->now + sim->delay(p->react_ms);
+  sim->push(offer_at, SIM_TRADE, TRADE_MESOS, 0);
+  u64 then = offer_at + sim->delay(p->react_ms);
+  if (sim->roll(p->accept_pct))
+    sim->push(then, SIM_TRADE, TRADE_ACCEPTED, 0);
+  else if (sim->roll(50))
+    sim->push(then, SIM_TRADE, TRADE_ENDED, 0);
+}
+
+void SimIo::joined() {
+  sim->result.joined++;
+}
+
+void SimIo::timed_out(TradeState state) {
+  sim->result.timeouts[state]++;
+}
+
+static void print_result(ccstr label, SimParams &params, SimResult &r) {
+  double hours = params.days * 24.0;
+  u64 timeouts = 0;
+  for (u32 s = 0; s < STATE_COUNT; s++)
+    timeouts += r.timeouts[s];
+  printf("%-18s %9.1f %9.1f %9.1f %8.1f%% %9llu %9llu %9llu %11.0fx\n",
+         label, r.initiated / hours, r.joined / hours, r.completed / hours,
+         r.initiated > 0 ? 100.0 * timeouts / r.initiated : 0.0,
+         r.timeouts[STATE_INITIATED], r.timeouts[STATE_PLAYER_JOINED], r.timeouts[STATE_PLAYER_ACCEPTED],
+         params.days * 86400e6 / max<u64>(r.wall_us, 1));
+}
+
+int tradesim_main(int argc, char **argv) {
+  SimParams params;
+  i32 sweep = -1; // index into timeout_ms, STATE_COUNT for the beg delay
+  vector<u32> values;
+
+  for (s32 i = 0; i + 1 < argc; i += 2) {
+    auto flag = argv[i];
+    auto value = argv[i + 1];
+    u32 n = (u32)strtoul(value, NULL, 10);
+    if (strcmp(flag, "-d") == 0)      params.days = max(n, 1u);
+    else if (strcmp(flag, "-n") == 0) params.population = n;
+    else if (strcmp(flag, "-e") == 0) params.enter_every_ms = max(n, 1u);
+    else if (strcmp(flag, "-s") == 0) params.seed = strtoull(value, NULL, 10);
+    else if (strcmp(flag, "-J") == 0) params.join_pct = min(n, 100u);
+    else if (strcmp(flag, "-D") == 0) params.decline_pct = min(n, 100u - params.join_pct);
+    else if (strcmp(flag, "-O") == 0) params.offer_pct = min(n, 100u);
+    else if (strcmp(flag, "-A") == 0) params.accept_pct = min(n, 100u);
+    else if (strcmp(flag, "-r") == 0) params.react_ms = n;
+    else if (strcmp(flag, "-x") == 0) {
+      auto eq = strchr(value, '=');
+      sweep = STATE_INACTIVE; // unless the name turns out to be one
+      if (eq == NULL)
+        break;
+      string name(value, eq - value);
+      for (u32 s = 0; s < STATE_COUNT; s++)
+        if (name == trade_state_names[s])
+          sweep = s;
+      if (name == "beg")
+        sweep = STATE_COUNT;
+      for (auto at = eq + 1; *at != '\0';) {
+        char *end;
+        values.push_back((u32)strtoul(at, &end, 10));
+        if (end == at)
+          break;
+        at = (*end == ',') ? end + 1 : end;
+      }
+    } else {
+      printf("tradesim: unknown option %s %s\n", flag, value);
+      return EXIT_FAILURE;
+    }
+  }
+  if (sweep == STATE_INACTIVE || (sweep >= 0 && values.empty())) {
+    printf("tradesim: -x takes initiated, player_joined, player_made_offer, player_accepted or beg, then =ms,ms,...\n");
+    return EXIT_FAILURE;
+  }
+
+  printf("%u simulated days, %u players on the map, one new every %ums, reactions ~%ums\n",
+         params.days, params.population, params.enter_every_ms, params.react_ms);
+  printf("invites: %u%% join, %u%% decline; joined: %u%% offer, then %u%% accept\n\n",
+         params.join_pct, params.decline_pct, params.offer_pct, params.accept_pct);
+  printf("%-18s %9s %9s %9s %9s %9s %9s %9s %12s\n",
+         "", "invites/h", "joins/h", "trades/h", "timed out", "initiated", "joined", "accepted", "speed");
+
+  if (sweep < 0) {
+    auto sim = new Sim(); // the fsm's io points into it; keep it in one place
+    sim->params = &params;
+    sim->run(&default_trade_timings);
+    print_result("default", params, sim->result);
+    delete sim;
+    return EXIT_SUCCESS;
+  }
+
+  for (auto v : values) {
+    TradeTimings timings = default_trade_timings;
+    if (sweep == STATE_COUNT)
+      timings.beg_delay_ms = v;
+    else
+      timings.timeout_ms[sweep] = v;
+
+    auto sim = new Sim();
+    sim->params = &params;
+    sim->run(&timings);
+    char label[32];
+    snprintf(label, sizeof(label), "%s=%u", sweep == STATE_COUNT ? "beg" : trade_state_names[sweep], v);
+    print_result(label, params, sim->result);
+    delete sim;
+  }
+  return EXIT_SUCCESS;
+}